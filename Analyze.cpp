@@ -0,0 +1,103 @@
+// Offline analyzer for the traces which 'Demo -o' records.  It replays each
+// interval into a counter table and reports it with the same code as Demo.
+
+#include "ipc_histogram.hpp"
+#include "performance_counter_lib.hpp"
+#include "thread_report.hpp"
+#include "trace_recorder.hpp"
+
+constexpr char PROC_PATH[] = "/proc/";
+// As in Demo.
+constexpr uint64_t MIN_IPC_CYCLES = 10000U;
+
+void usage() {
+  fprintf(stderr,
+          "Usage is './Analyze [-p] [-s] [-t <threads>] <trace>'.\n"
+          "  -p  also report percentiles of the per-thread IPC and cycle "
+          "rates\n"
+          "  -s  report only the totals over the whole trace\n"
+          "  -t  also report the threads with the most cycles and the worst "
+          "IPC\n"
+          "      in each interval.  Thread names are looked up in /proc, so "
+          "they\n"
+          "      are only known while the threads still run.\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  bool distribution = false;
+  bool summary = false;
+  long top = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "pst:")) != -1) {
+    switch (opt) {
+    case 'p':
+      distribution = true;
+      break;
+    case 's':
+      summary = true;
+      break;
+    case 't':
+      errno = 0;
+      top = strtol(optarg, NULL, 10);
+      if (errno || (top < 1)) {
+        usage();
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+  if ((argc - optind) != 1) {
+    usage();
+  }
+
+  trace_reader reader(argv[optind]);
+  if (!reader.ok()) {
+    exit(EXIT_FAILURE);
+  }
+  if (!reader.matches<default_counter_table>()) {
+    fprintf(stderr, "%s does not hold the cycles and instructions group.\n",
+            argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  default_counter_table counters{};
+  thread_names names(PROC_PATH, {});
+  default_counter_table::values_type totals{};
+  std::chrono::nanoseconds total_elapsed{0};
+  uint64_t intervals = 0U;
+  ipc_distribution interval_ipc{};
+  ipc_distribution trace_ipc{};
+  for (uint64_t next = 0U; next < reader.size(); intervals++) {
+    const std::chrono::nanoseconds elapsed(reader.record(next).elapsed);
+    next = replayInterval(reader, next, counters);
+    const auto scaled = sumScaledCounters(counters);
+    for (uint32_t ev = 0U; ev < default_counter_table::OBSERVED_EVENTS; ev++) {
+      totals[ev] += scaled.estimates[ev];
+    }
+    total_elapsed += elapsed;
+    if (distribution) {
+      interval_ipc.clear();
+      recordIpc(interval_ipc, counters, elapsed, MIN_IPC_CYCLES);
+      trace_ipc.merge(interval_ipc);
+    }
+    if (summary) {
+      continue;
+    }
+    printResults(scaled.estimates[CYCLES], scaled.estimates[INSTRUCTIONS],
+                 elapsed, scaled.confidence);
+    printIpcDistribution(interval_ipc);
+    if (top) {
+      printThreadReport(counters, names, top, elapsed);
+    }
+  }
+  std::cout << "===================================================="
+            << std::endl
+            << reader.size() << " records in " << intervals << " intervals"
+            << std::endl;
+  if (intervals) {
+    printResults(totals[CYCLES], totals[INSTRUCTIONS], total_elapsed);
+    printIpcDistribution(trace_ipc);
+  }
+}
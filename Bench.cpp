@@ -0,0 +1,330 @@
+// Microbenchmarks of the library's own per-interval work, as functions of the
+// number of observed threads and of the fraction of them which exit and are
+// replaced between intervals.  The threads live in a synthetic procfs tree and
+// the counter groups are regular files which hold the data a group read
+// returns, so no privileges are needed and the results do not depend on the
+// PMU.
+
+#include "derived_metrics.hpp"
+#include "interval_timer.hpp"
+#include "performance_counter_lib.hpp"
+
+#include <fcntl.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <random>
+
+constexpr char BENCH_PATH[] = "bench_proc/";
+// Above PID_MAX_LIMIT, the largest pid_max which Linux allows, so no real
+// task has this tid or the ones which follow it.
+constexpr pid_t FAKE_PID = (4 * 1024 * 1024) + 1;
+constexpr uint32_t OBSERVED_EVENTS = default_counter_table::OBSERVED_EVENTS;
+// Enough descriptors for everything besides the fake groups.
+constexpr size_t SPARE_FDS = 64U;
+
+namespace {
+// Every allocation in the program, so that the benchmarks can report how many
+// the library makes.
+std::atomic<uint64_t> allocations{0U};
+} // namespace
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1U, std::memory_order_relaxed);
+  void *p = malloc(size ? size : 1U);
+  if (nullptr == p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+// Out of line, or GCC pairs the inlined free() with operator new and warns.
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+// Accumulates the time and allocations between each start() and stop().
+struct stopwatch {
+  void start() {
+    allocs_at_start = allocations.load(std::memory_order_relaxed);
+    started = monotonicNow();
+  }
+  void stop() {
+    elapsed += monotonicNow() - started;
+    allocs += allocations.load(std::memory_order_relaxed) - allocs_at_start;
+    laps++;
+  }
+
+  std::chrono::nanoseconds elapsed{0};
+  uint64_t allocs = 0U;
+  uint64_t laps = 0U;
+  std::chrono::nanoseconds started{0};
+  uint64_t allocs_at_start = 0U;
+};
+
+// The task directories of one process.  Exiting threads are picked at random
+// and new threads take the next higher tid, as they usually do.
+struct fake_process {
+  fake_process(const std::string &proc_path, const size_t threads)
+      : task_path(proc_path + std::to_string(FAKE_PID) + "/task/"), live{},
+        next_tid(FAKE_PID), random(threads) {
+    fs::remove_all(proc_path);
+    fs::create_directories(task_path);
+    for (size_t i = 0U; i < threads; i++) {
+      add();
+    }
+  }
+
+  void add() {
+    fs::create_directory(task_path + std::to_string(next_tid));
+    live.push_back(next_tid++);
+  }
+
+  // Replace n threads.
+  void churn(const size_t n) {
+    for (size_t i = 0U; (i < n) && !live.empty(); i++) {
+      const size_t victim = random() % live.size();
+      fs::remove(task_path + std::to_string(live[victim]));
+      live[victim] = live.back();
+      live.pop_back();
+    }
+    for (size_t i = 0U; i < n; i++) {
+      add();
+    }
+  }
+
+  const std::string task_path;
+  std::vector<pid_t> live;
+  pid_t next_tid;
+  std::mt19937 random;
+};
+
+// A file with one group read per round, which stands in for a group leader.
+// Each open() of it has its own offset, so each fake group returns the next
+// record on each read.
+struct fake_group_file {
+  fake_group_file(const std::string &path, const int rounds) : path(path) {
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    for (int round = 0; round < rounds; round++) {
+      struct read_format<OBSERVED_EVENTS> data;
+      data.nr = OBSERVED_EVENTS;
+      data.time_enabled = 2000U;
+      data.time_running = 1000U;
+      data.values[CYCLES] = {1000U + round, 1U};
+      data.values[INSTRUCTIONS] = {2000U + round, 2U};
+      if (write(fd, &data, sizeof(data)) != sizeof(data)) {
+        std::cerr << "Failed to write " << path << std::endl;
+      }
+    }
+    close(fd);
+  }
+
+  default_pcounter group(const pid_t tid) const {
+    default_pcounter pc(tid);
+    pc.group_fd[CYCLES] = open(path.c_str(), O_RDONLY);
+    pc.group_fd[INSTRUCTIONS] = -1;
+    pc.event_id = {1U, 2U};
+    return pc;
+  }
+
+  const std::string path;
+};
+
+struct bench_config {
+  size_t threads;
+  size_t churn_percent;
+  int rounds;
+};
+
+void printResult(const bench_config &config, const char *name,
+                 const stopwatch &watch) {
+  const double per_thread =
+      static_cast<double>(watch.elapsed.count()) /
+      static_cast<double>(watch.laps * std::max<size_t>(config.threads, 1U));
+  const double per_round =
+      static_cast<double>(watch.allocs) /
+      static_cast<double>(std::max<uint64_t>(watch.laps, 1U));
+  std::cout << std::setw(8) << config.threads << std::setw(6)
+            << config.churn_percent << "%  " << std::left << std::setw(20)
+            << name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << per_thread << " ns/thread" << std::setw(12)
+            << per_round << " allocs/round" << std::endl;
+}
+
+// getProcessChildPids() and getPidDelta() on the synthetic tree.  The fake
+// tids cannot exist, so perf_event_open() fails quickly for the new threads
+// and the creation cost excludes the kernel's counter setup.  The error
+// messages which the failures print are discarded.
+void benchProcfs(const bench_config &config) {
+  fake_process process(BENCH_PATH, config.threads);
+  const size_t churn = (config.threads * config.churn_percent) / 100U;
+  stopwatch enumerate{};
+  stopwatch delta{};
+  default_counter_table counters{};
+  std::set<pid_t> pids{};
+  std::streambuf *old_cout = std::cout.rdbuf(nullptr);
+  getPidDelta(BENCH_PATH, FAKE_PID, counters, pids);
+  for (int round = 0; round < config.rounds; round++) {
+    process.churn(churn);
+    enumerate.start();
+    const std::set<pid_t> tids = getProcessChildPids(BENCH_PATH, FAKE_PID);
+    enumerate.stop();
+    delta.start();
+    getPidDelta(BENCH_PATH, FAKE_PID, counters, pids);
+    delta.stop();
+  }
+  std::cout.rdbuf(old_cout);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    closeCounterFds(counters, i);
+  }
+  printResult(config, "getProcessChildPids", enumerate);
+  printResult(config, "getPidDelta", delta);
+  fs::remove_all(BENCH_PATH);
+}
+
+// The table maintenance which createCounters() and cullCounters() do once the
+// groups are open, then the reads, the aggregation and per-thread derived
+// metrics of each interval.
+void benchTable(const bench_config &config) {
+  const fake_group_file file(std::string(BENCH_PATH) + "group",
+                             config.rounds + 1);
+  const size_t churn = (config.threads * config.churn_percent) / 100U;
+  std::mt19937 random(config.threads);
+  pid_t next_tid = FAKE_PID;
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  for (size_t i = 0U; i < config.threads; i++) {
+    staged.push_back(file.group(next_tid++));
+  }
+  insertCounters(counters, staged);
+  stopwatch create{};
+  stopwatch read{};
+  stopwatch aggregate{};
+  stopwatch derive{};
+  metric_plan plan = compileMetrics(standardMetrics(),
+                                    eventNames<default_counter_table>());
+  uint64_t checksum = 0U;
+  for (int round = 0; round < config.rounds; round++) {
+    std::set<pid_t> exited{};
+    while (exited.size() < churn) {
+      exited.insert(counters.tids[random() % counters.size()]);
+    }
+    staged.clear();
+    for (size_t i = 0U; i < churn; i++) {
+      staged.push_back(file.group(next_tid++));
+    }
+    create.start();
+    cullCounters(counters, exited);
+    insertCounters(counters, staged);
+    create.stop();
+    read.start();
+    readCounters(counters);
+    read.stop();
+    aggregate.start();
+    const auto totals = sumCounters(counters);
+    const auto scaled = sumScaledCounters(counters);
+    aggregate.stop();
+    checksum += totals[CYCLES] + scaled.estimates[INSTRUCTIONS];
+    derive.start();
+    for (const auto &values : counters.values) {
+      plan.evaluate(values, std::chrono::seconds(1));
+    }
+    derive.stop();
+  }
+  for (size_t i = 0U; i < counters.size(); i++) {
+    closeCounterFds(counters, i);
+  }
+  printResult(config, "insert/cull", create);
+  printResult(config, "readCounters", read);
+  printResult(config, "aggregate", aggregate);
+  printResult(config, "derived metrics", derive);
+  if (0U == checksum) {
+    std::cerr << "The fake groups returned no counts" << std::endl;
+  }
+}
+
+// Each fake group holds one descriptor.
+size_t raiseFdLimit() {
+  struct rlimit rlimits;
+  if (getrlimit(RLIMIT_NOFILE, &rlimits) == -1) {
+    return 0U;
+  }
+  rlimits.rlim_cur = rlimits.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rlimits);
+  return (rlimits.rlim_cur > SPARE_FDS) ? (rlimits.rlim_cur - SPARE_FDS) : 0U;
+}
+
+void usage() {
+  fprintf(stderr,
+          "Usage is './Bench [-c <percent>] [-r <rounds>] [-t <threads>]'.\n"
+          "  -c  replace this percentage of the threads between rounds, "
+          "rather\n"
+          "      than 0, 1 and 10%% in turn\n"
+          "  -r  rounds per measurement, by default 10\n"
+          "  -t  the most threads to observe, by default 100000\n");
+  exit(EXIT_FAILURE);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<size_t> churn_percents{0U, 1U, 10U};
+  long rounds = 10;
+  long max_threads = 100000;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:t:")) != -1) {
+    if ('?' == opt) {
+      usage();
+    }
+    errno = 0;
+    const long arg = strtol(optarg, NULL, 10);
+    if (errno || (arg < 0)) {
+      usage();
+    }
+    switch (opt) {
+    case 'c':
+      if (arg > 100) {
+        usage();
+      }
+      churn_percents = {static_cast<size_t>(arg)};
+      break;
+    case 'r':
+      rounds = arg;
+      break;
+    default:
+      max_threads = arg;
+    }
+  }
+  if ((optind != argc) || (rounds < 1) || (max_threads < 1)) {
+    usage();
+  }
+
+  fs::current_path(fs::temp_directory_path());
+  const size_t max_fds = raiseFdLimit();
+  std::cout << std::setw(8) << "threads" << std::setw(7) << "churn"
+            << "  benchmark" << std::endl;
+  for (size_t threads = 100U; threads <= static_cast<size_t>(max_threads);
+       threads *= 10U) {
+    for (const size_t churn_percent : churn_percents) {
+      const bench_config config{threads, churn_percent,
+                                static_cast<int>(rounds)};
+      benchProcfs(config);
+      // Each round's new groups are opened before the exited ones close.
+      const size_t churn = (threads * churn_percent) / 100U;
+      if ((threads + churn) > max_fds) {
+        std::cout << std::setw(8) << threads << std::setw(6) << churn_percent
+                  << "%  skipped the table, which needs " << (threads + churn)
+                  << " descriptors" << std::endl;
+        continue;
+      }
+      fs::create_directories(BENCH_PATH);
+      benchTable(config);
+      fs::remove_all(BENCH_PATH);
+    }
+  }
+}
@@ -15,11 +15,37 @@ DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
 WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
 OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.*/
 
+#include "derived_metrics.hpp"
+#include "event_resolver.hpp"
+#include "fd_budget.hpp"
+#include "interval_timer.hpp"
+#include "ipc_histogram.hpp"
+#include "overflow_waiter.hpp"
 #include "performance_counter_lib.hpp"
+#include "sample_profiler.hpp"
+#include "sharded_collector.hpp"
+#include "shm_snapshot.hpp"
+#include "thread_report.hpp"
+#include "thread_tracker.hpp"
+#include "trace_recorder.hpp"
+#include "uring_reader.hpp"
 
-#include <thread>
+#include <memory>
 
 constexpr char PROC_PATH[] = "/proc/";
+constexpr char SYS_PATH[] = "/sys/";
+// Threads which ran for fewer cycles in an interval have no meaningful IPC.
+constexpr uint64_t MIN_IPC_CYCLES = 10000U;
+// Data pages in each thread's sample ring with -S.
+constexpr uint32_t SAMPLE_RING_PAGES = 8U;
+// Descriptors which -b leaves for everything besides the counters.
+constexpr size_t SPARE_FDS = 64U;
+// Threads, and addresses per thread, in the sample profile unless -t says.
+constexpr size_t PROFILE_TOP = 5U;
+
+// The group which -r alternates with the default one.
+using branch_counter_table =
+    counter_table<branch_instructions_event, branch_misses_event>;
 
 // start by cranking up resource limits so we can track programs with many
 // threads
@@ -43,6 +69,153 @@ void setLimits() {
   }
 }
 
+void report(const default_counter_table &counters,
+            const std::chrono::nanoseconds elapsed) {
+  const auto totals = sumScaledCounters(counters);
+  printResults(totals.estimates[CYCLES], totals.estimates[INSTRUCTIONS],
+               elapsed, totals.confidence);
+}
+
+void report(const branch_counter_table &counters,
+            const std::chrono::nanoseconds elapsed) {
+  const auto totals = sumScaledCounters(counters);
+  printBranchResults(totals.estimates[0], totals.estimates[1], elapsed,
+                     totals.confidence);
+}
+
+// Only the default group counts cycles and instructions.
+void reportThreads(const default_counter_table &counters, thread_names &names,
+                   const size_t top, const std::chrono::nanoseconds elapsed) {
+  printThreadReport(counters, names, top, elapsed);
+}
+
+void reportThreads(const branch_counter_table &, thread_names &, const size_t,
+                   const std::chrono::nanoseconds) {}
+
+// Each process's share of the threads which the tracker follows.
+void reportProcesses(const default_counter_table &counters,
+                     const thread_tracker &tracker, thread_names &names,
+                     const std::chrono::nanoseconds elapsed) {
+  std::cout << "By process:" << std::endl;
+  for (const auto &process : sumByProcess(counters, tracker)) {
+    printThreadLine(names.name(process.first), process.first,
+                    process.second[CYCLES], process.second[INSTRUCTIONS],
+                    elapsed);
+  }
+}
+
+void reportProcesses(const branch_counter_table &, const thread_tracker &,
+                     thread_names &, const std::chrono::nanoseconds) {}
+
+// The trace holds the default group only.
+void record(trace_recorder &recorder, const default_counter_table &counters,
+            const std::chrono::nanoseconds timestamp,
+            const std::chrono::nanoseconds elapsed) {
+  recordCounters(recorder, counters, timestamp, elapsed);
+}
+
+void record(trace_recorder &, const branch_counter_table &,
+            const std::chrono::nanoseconds, const std::chrono::nanoseconds) {}
+
+void publish(snapshot_publisher &publisher,
+             const default_counter_table &counters,
+             const std::chrono::nanoseconds timestamp,
+             const std::chrono::nanoseconds elapsed) {
+  publishSnapshot(publisher, counters, timestamp, elapsed);
+}
+
+void publish(snapshot_publisher &, const branch_counter_table &,
+             const std::chrono::nanoseconds, const std::chrono::nanoseconds) {}
+
+// The distributions of this interval and of all intervals so far.  Merging
+// the interval into the run costs one pass over the buckets.
+void reportDistribution(const default_counter_table &counters,
+                        ipc_distribution &interval, ipc_distribution &run,
+                        const std::chrono::nanoseconds elapsed) {
+  interval.clear();
+  recordIpc(interval, counters, elapsed, MIN_IPC_CYCLES);
+  run.merge(interval);
+  std::cout << "This interval:" << std::endl;
+  printIpcDistribution(interval);
+  std::cout << "Since start:" << std::endl;
+  printIpcDistribution(run);
+}
+
+void reportDistribution(const branch_counter_table &, ipc_distribution &,
+                        ipc_distribution &, const std::chrono::nanoseconds) {}
+
+// Consume the samples whenever the kernel signals that a ring is half full,
+// until the timer, which the waiter also watches, ends the interval.
+void collectSamples(const default_counter_table &counters,
+                    overflow_waiter &waiter, interval_timer &timer,
+                    sample_profile<default_counter_table> &profile,
+                    std::vector<char> &scratch) {
+  const std::chrono::nanoseconds deadline = monotonicNow() + timer.period;
+  while (true) {
+    const std::chrono::nanoseconds left = deadline - monotonicNow();
+    const bool woken = (left.count() > 0) && waiter.wait(left);
+    consumeSamples(counters, profile, scratch);
+    if (!woken || waiter.ready(timer.timer_fd)) {
+      break;
+    }
+  }
+  // Without a timerfd, the deadline ended the interval instead.
+  if (timer.available()) {
+    timer.wait();
+  }
+}
+
+void collectSamples(const branch_counter_table &, overflow_waiter &,
+                    interval_timer &, sample_profile<default_counter_table> &,
+                    std::vector<char> &) {}
+
+void usage() {
+  fprintf(stderr,
+          "Usage is 'sudo ./Demo [-b <intervals>] [-c] [-E <event>]... "
+          "[-e <instructions>]\n"
+          "  [-f] [-g <cgroup path>] [-I] [-i <milliseconds>] [-m] "
+          "[-n <name pattern>]...\n"
+          "  [-o <trace>] [-p] [-r] [-S <cycles>] [-s <shm name>] [-T] "
+          "[-t <threads>]\n"
+          "  [-u] [-w <workers>] [<pid>...]'.\n"
+          "  -b  count only the threads which run, as far as the descriptor "
+          "limit\n      allows, and give up the counters of threads which "
+          "count nothing for\n      so many intervals\n"
+          "  -c  count all tasks with one counter group per CPU\n"
+          "  -E  count two events, such as cache-misses or\n"
+          "      cpu/event=0x3c,umask=0x0/, in place of the branches of -r, "
+          "which it\n      implies\n"
+          "  -e  wake when any counted task has run so many instructions, "
+          "or\n      after the interval if none has\n"
+          "  -f  keep the counters running and report the difference between "
+          "reads\n"
+          "  -g  count the tasks in a cgroup with one counter group per CPU\n"
+          "  -I  let the kernel fold new threads into their creators' "
+          "counters\n      instead of rescanning procfs.  Only the threads "
+          "which exist at startup\n      get counters, which stay open until "
+          "Demo exits\n"
+          "  -i  read the counters every so many milliseconds (default 5000)\n"
+          "  -m  also report the derived metrics, such as miss rates, which "
+          "the\n      counted events allow\n"
+          "  -n  also report the threads whose names match a pattern, such as\n"
+          "      'grpc-worker-*', together\n"
+          "  -o  also record every thread's counts to a trace for Analyze\n"
+          "  -p  also report percentiles of the per-thread IPC and cycle "
+          "rates\n"
+          "  -r  alternate between the cycles and the branches group every "
+          "interval\n"
+          "  -S  also sample every thread's instruction pointer every so many "
+          "cycles\n      and report the hottest addresses, with their IPC\n"
+          "  -s  also publish the latest interval in POSIX shared memory\n"
+          "  -T  also count the processes which the given ones fork, and "
+          "their\n      children\n"
+          "  -t  also report the threads with the most cycles and the worst "
+          "IPC\n"
+          "  -u  read the counters in batches through io_uring\n"
+          "  -w  shard the counters across workers pinned to the first CPUs\n");
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
   if (geteuid()) {
     fprintf(stderr, "Please run the program with sudo.\n");
@@ -51,62 +224,451 @@ int main(int argc, char **argv) {
   setLimits();
 
   // our counter and PID data
-  // https://cplusplus.com/reference/map/map/
-  //  map containers are generally slower than unordered_map containers to
-  //  access individual elements by their key, but they allow the direct
-  //  iteration on subsets based on their order.
-  std::map<pid_t, struct pcounter> MyCounters = {};
-  pid_t pid;
-
-  // get a PID to track from the user
-  if (argc > 2) {
-    fprintf(stderr, "Usage is 'sudo ./Demo <pid>'.\n");
-    exit(EXIT_FAILURE);
+  // The branches group only has counters, and only gets a turn, with -r.
+  event_rotation<default_counter_table, branch_counter_table> rotation{};
+  default_counter_table &MyCounters = std::get<0>(rotation.tables);
+  branch_counter_table &BranchCounters = std::get<1>(rotation.tables);
+  bool rotate = false;
+  // With -b, counters are attached to running threads within the descriptor
+  // limit and detached after so many idle intervals.
+  long idle_limit = 0;
+  // The events which -E puts in the branches group's slots.
+  std::vector<std::string> event_names{};
+  std::set<pid_t> pids{};
+  // Follow the processes which the given processes fork.
+  bool tree = false;
+  // In per-CPU mode, the counters are keyed by CPU rather than by task, and the
+  // set of tasks need not be tracked.
+  bool per_cpu = false;
+  std::string cgroup_path{};
+  // With kernel-side inheritance, threads created after startup are counted by
+  // their creators' counters, so procfs need not be rescanned.  Counters for
+  // new threads would then count them twice.
+  bool inherit = false;
+  // Created only if requested.
+  std::unique_ptr<uring_reader> ring{};
+  long workers = 0;
+  // Free-running counters are enabled once, so there is no gap between
+  // intervals.
+  bool free_running = false;
+  std::chrono::nanoseconds interval = SLEEPTIME;
+  // The per-thread report, which is off unless one of these is given.
+  std::vector<std::string> patterns{};
+  long top = 0;
+  // The trace and the snapshot segment are created only once the options are
+  // known to be valid, so that a mistyped command line does not truncate an
+  // existing trace.
+  std::string trace_path{};
+  std::unique_ptr<trace_recorder> recorder{};
+  std::string shm_name{};
+  std::unique_ptr<snapshot_publisher> publisher{};
+  bool distribution = false;
+  bool metrics = false;
+  // With -e, the instructions counters overflow every so many instructions.
+  uint64_t overflow_period = 0U;
+  // With -S, the cycles counters are sampled every so many cycles.
+  uint64_t profile_period = 0U;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:cE:e:fg:Ii:mn:o:prS:s:Tt:uw:")) != -1) {
+    switch (opt) {
+    case 'b':
+      errno = 0;
+      idle_limit = strtol(optarg, NULL, 10);
+      if (errno || (idle_limit < 1)) {
+        usage();
+      }
+      break;
+    case 'c':
+      per_cpu = true;
+      break;
+    case 'E':
+      event_names.push_back(optarg);
+      rotate = true;
+      break;
+    case 'e': {
+      errno = 0;
+      const long long period = strtoll(optarg, NULL, 10);
+      if (errno || (period < 1)) {
+        usage();
+      }
+      overflow_period = period;
+      break;
+    }
+    case 'f':
+      free_running = true;
+      break;
+    case 'g':
+      per_cpu = true;
+      cgroup_path = optarg;
+      break;
+    case 'I':
+      inherit = true;
+      break;
+    case 'i': {
+      errno = 0;
+      const long ms = strtol(optarg, NULL, 10);
+      if (errno || (ms < 1)) {
+        usage();
+      }
+      interval = std::chrono::milliseconds(ms);
+      break;
+    }
+    case 'm':
+      metrics = true;
+      break;
+    case 'n':
+      patterns.push_back(optarg);
+      break;
+    case 'o':
+      trace_path = optarg;
+      break;
+    case 'p':
+      distribution = true;
+      break;
+    case 'r':
+      rotate = true;
+      break;
+    case 'S': {
+      errno = 0;
+      const long long period = strtoll(optarg, NULL, 10);
+      if (errno || (period < 1)) {
+        usage();
+      }
+      profile_period = period;
+      break;
+    }
+    case 's':
+      shm_name = optarg;
+      break;
+    case 'T':
+      tree = true;
+      break;
+    case 't':
+      errno = 0;
+      top = strtol(optarg, NULL, 10);
+      if (errno || (top < 1)) {
+        usage();
+      }
+      break;
+    case 'u':
+      ring.reset(new uring_reader());
+      break;
+    case 'w':
+      errno = 0;
+      workers = strtol(optarg, NULL, 10);
+      if (errno || (workers < 1)) {
+        usage();
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+
+  // get the PIDs to track from the user
+  if (per_cpu && (argc > optind)) {
+    usage();
+  }
+  // -E implies -r, so it rules out what -r does.
+  if (!event_names.empty() &&
+      (free_running || overflow_period || profile_period || idle_limit)) {
+    fprintf(stderr, "-E alternates its events with the cycles group, as -r "
+                    "does, so it cannot be\ncombined with -f, -e, -S or "
+                    "-b.\n");
+    usage();
+  }
+  // The rotation relies on disabling the groups whose turn is over, and the
+  // branches group counts no instructions.
+  if (rotate && (free_running || overflow_period)) {
+    usage();
+  }
+  // Each group has one sampled event, and the kernel cannot inherit groups
+  // whose samples carry the group's counts.
+  if (profile_period && (overflow_period || rotate || inherit)) {
+    usage();
+  }
+  // The budget follows the threads of the tracker, one table at a time.
+  if (idle_limit && (per_cpu || inherit || rotate)) {
+    usage();
+  }
+  // Inherited counts fold into the threads found at startup, so a breakdown
+  // of the threads or processes created later cannot be had.
+  if (inherit && (top || !patterns.empty() || tree)) {
+    fprintf(stderr, "-I folds new threads into their creators' counts, so it "
+                    "cannot be combined\nwith -t, -n or -T.\n");
+    usage();
+  }
+  // CPUs have no names.
+  if (per_cpu && (top || !patterns.empty() || tree)) {
+    usage();
+  }
+  // The workers read their shards themselves, so the batches would go unused.
+  if (workers && ring) {
+    usage();
   }
-  if (2 == argc) {
+  for (int arg = optind; arg < argc; arg++) {
     errno = 0;
-    long val{strtol(argv[1], NULL, 10)};
+    long val{strtol(argv[arg], NULL, 10)};
     if (errno || (0 == val)) {
-      fprintf(stderr, "%s is not a valid PID.\n", argv[1]);
+      fprintf(stderr, "%s is not a valid PID.\n", argv[arg]);
       exit(EXIT_FAILURE);
     }
-    pid = val;
+    pids.insert(val);
   }
-  if (!pid) {
+  if (!per_cpu && pids.empty()) {
     std::string input;
     std::cout << "Enter a PID " << std::flush;
     std::cin >> input;
     try {
-      pid = std::stol(input);
+      pids.insert(std::stol(input));
     } catch (...) { // PID must be a number
       std::cout << "Invalid PID" << std::endl;
       return 1;
     }
   }
 
-  // the next step is to make counters for all the known children of our newly
-  // obtained PID find all the children, then make counters for them
-  std::set<pid_t> currentPids = getProcessChildPids(PROC_PATH, pid);
-  if (currentPids.empty()) {
-    exit(EXIT_SUCCESS);
+  if (!trace_path.empty()) {
+    recorder.reset(
+        new trace_recorder(trace_path, traceEvents<default_counter_table>()));
+    if (!recorder->ok()) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (!shm_name.empty()) {
+    // Room for the threads of a large process.
+    publisher.reset(new snapshot_publisher(
+        shm_name, traceEvents<default_counter_table>(), 65536U));
+    if (!publisher->ok()) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // On hybrid CPUs, every target gets a group on each type of core.
+  MyCounters.core_pmus = getCorePmus(SYS_PATH);
+  BranchCounters.core_pmus = MyCounters.core_pmus;
+
+  // Resolved once, before any group is created.  The table points into it.
+  std::unique_ptr<event_table> events{};
+  if (!event_names.empty()) {
+    events.reset(new event_table(event_names, SYS_PATH));
+    if (!useEvents(BranchCounters, *events)) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Created only if requested, before the counters, which it configures.
+  std::unique_ptr<overflow_waiter> waiter{};
+  if (overflow_period) {
+    waiter.reset(new overflow_waiter());
+    if (!waiter->available()) {
+      exit(EXIT_FAILURE);
+    }
+    MyCounters.sampling.period = overflow_period;
+    MyCounters.sampling.slot = INSTRUCTIONS;
+  }
+  std::unique_ptr<sample_profile<default_counter_table>> profile{};
+  if (profile_period) {
+    waiter.reset(new overflow_waiter());
+    if (!waiter->available()) {
+      exit(EXIT_FAILURE);
+    }
+    MyCounters.sampling =
+        profileSampling(profile_period, CYCLES, SAMPLE_RING_PAGES);
+    profile.reset(new sample_profile<default_counter_table>());
+  }
+
+  // Follows thread creation and exit in the per-thread mode.
+  std::unique_ptr<thread_tracker> tracker{};
+  std::unique_ptr<fd_budget> budget{};
+  if (per_cpu) {
+    int cgroup_fd = -1;
+    if (!cgroup_path.empty()) {
+      cgroup_fd = openCgroup(cgroup_path);
+      if (cgroup_fd < 0) {
+        exit(EXIT_FAILURE);
+      }
+    }
+    std::set<int> cpus = getOnlineCpus(SYS_PATH);
+    if (cpus.empty()) {
+      exit(EXIT_FAILURE);
+    }
+    // The perf_event_open() calls hold their own references to the cgroup, so
+    // cgroup_fd could be closed after this point.
+    createCpuCounters(MyCounters, cpus, cgroup_fd);
+    if (rotate) {
+      createCpuCounters(BranchCounters, cpus, cgroup_fd);
+    }
+  } else {
+    // the next step is to make counters for all the known children of our
+    // newly obtained PID find all the children, then make counters for them
+    tracker.reset(new thread_tracker(PROC_PATH, pids, tree, !inherit));
+    if (tracker->tids.empty()) {
+      exit(EXIT_SUCCESS);
+    }
+    if (idle_limit) {
+      budget.reset(new fd_budget(PROC_PATH, counterFdLimit(SPARE_FDS),
+                                 idle_limit));
+      budget->add(tracker->tids);
+      attachCounters(*budget, MyCounters);
+    } else {
+      createCounters(MyCounters, tracker->tids, inherit);
+    }
+    if (rotate) {
+      createCounters(BranchCounters, tracker->tids, inherit);
+    }
+  }
+
+  if (waiter) {
+    watchOverflows(*waiter, MyCounters);
+  }
+
+  std::unique_ptr<sharded_collector> pool{};
+  if (workers) {
+    std::set<int> online = getOnlineCpus(SYS_PATH);
+    std::vector<int> cpus(online.begin(), online.end());
+    if (cpus.empty()) {
+      exit(EXIT_FAILURE);
+    }
+    cpus.resize(std::min<size_t>(workers, cpus.size()));
+    pool.reset(new sharded_collector(cpus));
+    if (!pool->ok()) {
+      exit(EXIT_FAILURE);
+    }
   }
-  createCounters(MyCounters, currentPids);
 
+  thread_names names(PROC_PATH, patterns);
+  const bool report_threads = top || !patterns.empty();
+  // Inherited counters fold forked processes into their parents.
+  const bool report_processes =
+      tracker && !inherit && (tree || (pids.size() > 1U));
+
+  // One plan per group of the rotation, compiled once.
+  std::array<metric_plan, decltype(rotation)::GROUPS> plans{
+      compileMetrics(standardMetrics(), eventNames<default_counter_table>()),
+      compileMetrics(standardMetrics(),
+                     events ? events->names
+                            : eventNames<branch_counter_table>())};
+  // Reused on every interval, since each holds a few thousand buckets.
+  ipc_distribution interval_ipc{};
+  ipc_distribution run_ipc{};
+
+  interval_timer timer(interval);
+  // Holds a sample which wraps around the end of a ring.
+  std::vector<char> scratch{};
+  if (profile && timer.available()) {
+    waiter->add(timer.timer_fd);
+  }
+  // When the counters were last enabled or, if they are free-running, read.
+  std::chrono::nanoseconds start = monotonicNow();
+  if (free_running) {
+    startFreeRunning(MyCounters);
+  }
   while (true) {
-    resetAndEnableCounters(MyCounters);
-    std::this_thread::sleep_for(
-        SLEEPTIME); // cross-platform method of sleeping, though it doesn't
-                    // matter if you are only targeting Linux
-    disableCounters(MyCounters);
-    readCounters(MyCounters);
-    long long cycles = 0;
-    long long instructions = 0;
-    // Second element is the pcounter associated with the PID.
-    for (auto it = MyCounters.cbegin(); it != MyCounters.cend(); it++) {
-      cycles += it->second.event_value[0];
-      instructions += it->second.event_value[1];
-    }
-    printResults(cycles, instructions);
-    getPidDelta(PROC_PATH, pid, MyCounters, currentPids);
+    rotation.withActive([&](auto &counters) {
+      if (!free_running) {
+        if (pool) {
+          resetAndEnableCountersSharded(*pool, counters);
+        } else {
+          resetAndEnableCounters(counters);
+        }
+        start = monotonicNow();
+      }
+      uint64_t overflows = 0U;
+      if (profile) {
+        collectSamples(counters, *waiter, timer, *profile, scratch);
+      } else if (waiter) {
+        waiter->wait(interval);
+        overflows = drainOverflows(counters);
+      } else {
+        const uint64_t expirations = timer.wait();
+        if (expirations > 1U) {
+          std::cerr << "Missed " << (expirations - 1U) << " intervals"
+                    << std::endl;
+        }
+      }
+      const std::chrono::nanoseconds stop = monotonicNow();
+      if (pool && free_running) {
+        readCountersSharded(*pool, counters);
+      } else if (pool) {
+        disableAndReadCountersSharded(*pool, counters);
+      } else {
+        if (!free_running) {
+          disableCounters(counters);
+        }
+        if (ring) {
+          readCountersUring(*ring, counters);
+        } else {
+          readCounters(counters);
+        }
+      }
+      if (free_running) {
+        takeDeltas(counters);
+      }
+      mergePmuGroups(counters);
+      if (events && (1U == rotation.active)) {
+        const auto totals = sumScaledCounters(counters);
+        printEventRates(*events, totals.estimates.data(), stop - start,
+                        totals.confidence);
+      } else {
+        report(counters, stop - start);
+      }
+      if (profile) {
+        printSampleProfile(*profile, names, top ? top : PROFILE_TOP);
+        profile->clear();
+      } else if (waiter) {
+        printOverflows(overflows, overflow_period, stop - start);
+      }
+      if (metrics) {
+        metric_plan &plan = plans[rotation.active];
+        plan.evaluate(sumScaledCounters(counters).estimates, stop - start);
+        printMetrics(plan);
+      }
+      if (distribution) {
+        reportDistribution(counters, interval_ipc, run_ipc, stop - start);
+      }
+      if (recorder) {
+        record(*recorder, counters, stop, stop - start);
+      }
+      if (publisher) {
+        publish(*publisher, counters, stop, stop - start);
+      }
+      if (budget) {
+        printCoverage(*budget, fdsInUse(MyCounters));
+      }
+      if (report_processes) {
+        reportProcesses(counters, *tracker, names, stop - start);
+      }
+      if (report_threads) {
+        reportThreads(counters, names, top, stop - start);
+      }
+      start = stop;
+    });
+    if (rotate) {
+      rotation.rotate();
+    }
+    // With -I, only the threads found at startup have groups, so their number
+    // cannot grow.  A group stays open after its thread exits: the groups of
+    // the descendants which the kernel created from it fold into it, and
+    // closing it would stop those which still run from counting.
+    if (per_cpu || inherit) {
+      continue;
+    }
+    if (rotate) {
+      updateCounters(*tracker, MyCounters, BranchCounters);
+    } else if (budget) {
+      updateBudgetedCounters(*tracker, *budget, MyCounters);
+    } else {
+      updateCounters(*tracker, MyCounters);
+    }
+    if (waiter) {
+      watchOverflows(*waiter, MyCounters);
+    }
+    if (profile) {
+      profile->prune(MyCounters);
+    }
+    if (report_threads || report_processes) {
+      names.prune(MyCounters.tids);
+    }
   }
 }
@@ -0,0 +1,315 @@
+#include "derived_metrics.hpp"
+
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+
+bool isNameStart(const char c) {
+  return std::isalpha(static_cast<unsigned char>(c)) || ('_' == c);
+}
+
+bool isNameChar(const char c) {
+  return std::isalnum(static_cast<unsigned char>(c)) || ('_' == c) ||
+         ('.' == c);
+}
+
+// A recursive descent parser which emits the steps of one formula in postfix
+// order, and tracks how deep they make the stack.
+//   expr   := term (('+' | '-') term)*
+//   term   := factor (('*' | '/') factor)*
+//   factor := number | name | '(' expr ')' | '-' factor
+struct formula_parser {
+  formula_parser(const std::string &text,
+                 const std::vector<std::string> &event_names)
+      : pos(text.c_str()), events(event_names), ops{}, error{},
+        missing{}, depth(0U), max_depth(0U) {}
+
+  // False if the formula has a syntax error, which is then in error, or names
+  // an event which is not counted, which is then in missing.
+  bool parse() {
+    if (!expr()) {
+      return false;
+    }
+    skipSpace();
+    if ('\0' != *pos) {
+      return fail("unexpected '" + std::string(1, *pos) + "'");
+    }
+    return true;
+  }
+
+  const char *pos;
+  const std::vector<std::string> &events;
+  std::vector<struct metric_op> ops;
+  std::string error;
+  std::string missing;
+  size_t depth;
+  size_t max_depth;
+
+private:
+  bool fail(const std::string &message) {
+    if (error.empty() && missing.empty()) {
+      error = message;
+    }
+    return false;
+  }
+
+  void skipSpace() {
+    while (std::isspace(static_cast<unsigned char>(*pos))) {
+      pos++;
+    }
+  }
+
+  void push(const metric_op::op_code code, const uint32_t arg,
+            const double constant) {
+    ops.push_back({code, arg, constant});
+    depth++;
+    max_depth = std::max(max_depth, depth);
+  }
+
+  void combine(const metric_op::op_code code) {
+    ops.push_back({code, 0U, 0.0});
+    depth--;
+  }
+
+  bool expr() {
+    if (!term()) {
+      return false;
+    }
+    while (true) {
+      skipSpace();
+      if (('+' != *pos) && ('-' != *pos)) {
+        return true;
+      }
+      const metric_op::op_code code =
+          ('+' == *pos++) ? metric_op::ADD : metric_op::SUBTRACT;
+      if (!term()) {
+        return false;
+      }
+      combine(code);
+    }
+  }
+
+  bool term() {
+    if (!factor()) {
+      return false;
+    }
+    while (true) {
+      skipSpace();
+      if (('*' != *pos) && ('/' != *pos)) {
+        return true;
+      }
+      const metric_op::op_code code =
+          ('*' == *pos++) ? metric_op::MULTIPLY : metric_op::DIVIDE;
+      if (!factor()) {
+        return false;
+      }
+      combine(code);
+    }
+  }
+
+  bool factor() {
+    skipSpace();
+    if ('(' == *pos) {
+      pos++;
+      if (!expr()) {
+        return false;
+      }
+      skipSpace();
+      if (')' != *pos) {
+        return fail("missing ')'");
+      }
+      pos++;
+      return true;
+    }
+    if ('-' == *pos) {
+      pos++;
+      if (!factor()) {
+        return false;
+      }
+      ops.push_back({metric_op::NEGATE, 0U, 0.0});
+      return true;
+    }
+    if (std::isdigit(static_cast<unsigned char>(*pos)) || ('.' == *pos)) {
+      char *end = nullptr;
+      const double constant = strtod(pos, &end);
+      if (end == pos) {
+        return fail("bad number");
+      }
+      pos = end;
+      push(metric_op::PUSH_CONSTANT, 0U, constant);
+      return true;
+    }
+    if (!isNameStart(*pos)) {
+      return fail(('\0' == *pos) ? std::string("unexpected end")
+                                 : "unexpected '" + std::string(1, *pos) +
+                                       "'");
+    }
+    // A '-' between letters belongs to the name.
+    const char *start = pos;
+    while (isNameChar(*pos) ||
+           (('-' == *pos) && isNameChar(pos[-1]) && isNameStart(pos[1]))) {
+      pos++;
+    }
+    const std::string name(start, pos);
+    if ("seconds" == name) {
+      push(metric_op::PUSH_SECONDS, 0U, 0.0);
+      return true;
+    }
+    for (size_t slot = 0U; slot < events.size(); slot++) {
+      if (events[slot] == name) {
+        push(metric_op::PUSH_EVENT, slot, 0.0);
+        return true;
+      }
+    }
+    if (missing.empty() && error.empty()) {
+      missing = name;
+    }
+    return false;
+  }
+};
+
+} // namespace
+
+std::string eventName(const perf_type_id type, const uint64_t config) {
+  if (PERF_TYPE_HARDWARE == type) {
+    switch (config) {
+    case PERF_COUNT_HW_CPU_CYCLES:
+      return "cycles";
+    case PERF_COUNT_HW_INSTRUCTIONS:
+      return "instructions";
+    case PERF_COUNT_HW_CACHE_REFERENCES:
+      return "cache-references";
+    case PERF_COUNT_HW_CACHE_MISSES:
+      return "cache-misses";
+    case PERF_COUNT_HW_BRANCH_INSTRUCTIONS:
+      return "branch-instructions";
+    case PERF_COUNT_HW_BRANCH_MISSES:
+      return "branch-misses";
+    case PERF_COUNT_HW_BUS_CYCLES:
+      return "bus-cycles";
+    case PERF_COUNT_HW_STALLED_CYCLES_FRONTEND:
+      return "stalled-cycles-frontend";
+    case PERF_COUNT_HW_STALLED_CYCLES_BACKEND:
+      return "stalled-cycles-backend";
+    case PERF_COUNT_HW_REF_CPU_CYCLES:
+      return "ref-cycles";
+    default:
+      return "";
+    }
+  }
+  if (PERF_TYPE_SOFTWARE == type) {
+    switch (config) {
+    case PERF_COUNT_SW_CPU_CLOCK:
+      return "cpu-clock";
+    case PERF_COUNT_SW_TASK_CLOCK:
+      return "task-clock";
+    case PERF_COUNT_SW_PAGE_FAULTS:
+      return "page-faults";
+    case PERF_COUNT_SW_CONTEXT_SWITCHES:
+      return "context-switches";
+    case PERF_COUNT_SW_CPU_MIGRATIONS:
+      return "cpu-migrations";
+    default:
+      return "";
+    }
+  }
+  return "";
+}
+
+// PERF_COUNT_HW_CACHE_MISSES counts last-level cache misses on most CPUs.
+const std::vector<struct metric_formula> &standardMetrics() {
+  static const std::vector<struct metric_formula> metrics{
+      {"IPC", "instructions / cycles"},
+      {"branch miss rate", "branch-misses / branch-instructions"},
+      {"cache miss rate", "cache-misses / cache-references"},
+      {"LLC MPKI", "1000 * cache-misses / instructions"},
+      {"frontend bound", "stalled-cycles-frontend / cycles"},
+      {"backend bound", "stalled-cycles-backend / cycles"},
+      {"GHz", "cycles / seconds / 1e9"}};
+  return metrics;
+}
+
+struct metric_plan
+compileMetrics(const std::vector<struct metric_formula> &formulas,
+               const std::vector<std::string> &events) {
+  struct metric_plan plan{};
+  plan.slots = events.size();
+  size_t max_depth = 0U;
+  for (const struct metric_formula &metric : formulas) {
+    formula_parser parser(metric.formula, events);
+    if (!parser.parse()) {
+      if (!parser.error.empty()) {
+        std::cerr << "Bad formula for " << metric.name << ": "
+                  << parser.error << " in \"" << metric.formula << "\""
+                  << std::endl;
+      }
+      continue;
+    }
+    plan.ops.insert(plan.ops.end(), parser.ops.begin(), parser.ops.end());
+    plan.ops.push_back({metric_op::STORE,
+                        static_cast<uint32_t>(plan.names.size()), 0.0});
+    plan.names.push_back(metric.name);
+    max_depth = std::max(max_depth, parser.max_depth);
+  }
+  plan.results.resize(plan.names.size());
+  plan.stack.resize(max_depth);
+  return plan;
+}
+
+void metric_plan::evaluate(const uint64_t *values, const size_t n,
+                           const std::chrono::nanoseconds elapsed) {
+  if (n != slots) {
+    std::fill(results.begin(), results.end(), NAN);
+    return;
+  }
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  double *top = stack.data();
+  for (const struct metric_op &op : ops) {
+    switch (op.code) {
+    case metric_op::PUSH_EVENT:
+      *top++ = static_cast<double>(values[op.arg]);
+      break;
+    case metric_op::PUSH_CONSTANT:
+      *top++ = op.constant;
+      break;
+    case metric_op::PUSH_SECONDS:
+      *top++ = seconds;
+      break;
+    case metric_op::ADD:
+      top--;
+      top[-1] += *top;
+      break;
+    case metric_op::SUBTRACT:
+      top--;
+      top[-1] -= *top;
+      break;
+    case metric_op::MULTIPLY:
+      top--;
+      top[-1] *= *top;
+      break;
+    case metric_op::DIVIDE:
+      top--;
+      top[-1] = (0.0 == *top) ? NAN : top[-1] / *top;
+      break;
+    case metric_op::NEGATE:
+      top[-1] = -top[-1];
+      break;
+    case metric_op::STORE:
+      results[op.arg] = *--top;
+      break;
+    }
+  }
+}
+
+void printMetrics(const metric_plan &plan) {
+  for (size_t m = 0U; m < plan.size(); m++) {
+    std::cout << plan.names[m] << ": ";
+    if (std::isnan(plan.results[m])) {
+      std::cout << "n/a" << std::endl;
+    } else {
+      std::cout << plan.results[m] << std::endl;
+    }
+  }
+}
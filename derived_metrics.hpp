@@ -0,0 +1,95 @@
+#ifndef DERIVED_METRICS_HPP
+#define DERIVED_METRICS_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A metric computed from the counts of one interval, such as
+// "branch-misses / branch-instructions".  Formulas combine event names, the
+// variable "seconds", which is the length of the interval, and decimal
+// constants with + - * / and parentheses.  Since event names contain '-', a
+// '-' which subtracts needs a space or a parenthesis before its right operand.
+struct metric_formula {
+  std::string name;
+  std::string formula;
+};
+
+// The name which formulas use for an event, as perf list spells it, or an
+// empty string if the event has none.
+std::string eventName(const perf_type_id type, const uint64_t config);
+
+template <class... Events>
+std::vector<std::string> eventNames(pcounter<Events...> *) {
+  return {eventName(Events::type, Events::config)...};
+}
+
+// The names of the events of a counter_table, in the order of its slots.
+template <class Table> std::vector<std::string> eventNames() {
+  return eventNames(static_cast<typename Table::counter_type *>(nullptr));
+}
+
+// IPC, miss rates, LLC misses per thousand instructions, the fractions of
+// cycles stalled in the frontend and the backend, and the clock rate.
+const std::vector<struct metric_formula> &standardMetrics();
+
+// One step of a stack machine.  PUSH_EVENT pushes the count in slot arg,
+// PUSH_CONSTANT pushes constant, the arithmetic steps replace the top two
+// values by their result, and STORE pops the top into result arg.
+struct metric_op {
+  enum op_code : uint32_t {
+    PUSH_EVENT,
+    PUSH_CONSTANT,
+    PUSH_SECONDS,
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    DIVIDE,
+    NEGATE,
+    STORE
+  };
+  op_code code;
+  uint32_t arg;
+  double constant;
+};
+
+// The formulas of one counter table, compiled into a single flat program.
+// Evaluating it walks the program once with a preallocated stack, so it
+// neither allocates nor parses, however often it runs.
+struct metric_plan {
+  // Evaluate every metric on the counts of the table's slots.  A division by
+  // zero, for example by the count of an event which never ran, gives NaN.
+  void evaluate(const uint64_t *values, const size_t n,
+                const std::chrono::nanoseconds elapsed);
+  template <size_t N>
+  void evaluate(const std::array<uint64_t, N> &values,
+                const std::chrono::nanoseconds elapsed) {
+    evaluate(values.data(), N, elapsed);
+  }
+  size_t size() const { return names.size(); }
+
+  std::vector<std::string> names;
+  // The value of each metric at the latest evaluate().
+  std::vector<double> results;
+  std::vector<struct metric_op> ops;
+  std::vector<double> stack;
+  // The number of slots which the formulas were compiled against.
+  size_t slots = 0U;
+};
+
+// Compile the formulas against the events in the slots of a table.  Formulas
+// which need events that the table does not count are left out silently, so
+// the standard metrics can be compiled against any table.  Formulas with
+// syntax errors are reported and left out.
+struct metric_plan
+compileMetrics(const std::vector<struct metric_formula> &formulas,
+               const std::vector<std::string> &events);
+
+void printMetrics(const metric_plan &plan);
+
+#endif // DERIVED_METRICS_HPP
@@ -0,0 +1,102 @@
+#include "derived_metrics.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <sstream>
+
+using namespace std;
+
+using branch_counter_table =
+    counter_table<branch_instructions_event, branch_misses_event>;
+
+namespace local_testing {
+
+TEST(DerivedMetricsSimpleTest, eventNames) {
+  EXPECT_THAT(eventNames<default_counter_table>(),
+              testing::ElementsAre("cycles", "instructions"));
+  EXPECT_THAT(eventNames<branch_counter_table>(),
+              testing::ElementsAre("branch-instructions", "branch-misses"));
+  EXPECT_EQ("", eventName(PERF_TYPE_RAW, 0x1234U));
+}
+
+TEST(DerivedMetricsSimpleTest, standardMetrics) {
+  // Only the metrics whose events the table counts are compiled.
+  metric_plan plan = compileMetrics(standardMetrics(),
+                                    eventNames<default_counter_table>());
+  EXPECT_THAT(plan.names, testing::ElementsAre("IPC", "GHz"));
+  plan.evaluate(std::array<uint64_t, 2>{4000000000U, 6000000000U},
+                std::chrono::seconds(2));
+  EXPECT_DOUBLE_EQ(1.5, plan.results[0]);
+  EXPECT_DOUBLE_EQ(2.0, plan.results[1]);
+
+  plan = compileMetrics(standardMetrics(),
+                        eventNames<branch_counter_table>());
+  EXPECT_THAT(plan.names, testing::ElementsAre("branch miss rate"));
+  plan.evaluate(std::array<uint64_t, 2>{1000U, 25U}, std::chrono::seconds(1));
+  EXPECT_DOUBLE_EQ(0.025, plan.results[0]);
+}
+
+TEST(DerivedMetricsSimpleTest, arithmetic) {
+  const std::vector<std::string> events{"cycles", "instructions",
+                                        "cache-misses"};
+  metric_plan plan = compileMetrics(
+      {{"precedence", "1 + 2 * 3 - 4 / 2"},
+       {"parentheses", "(1 + 2) * (3 - 4)"},
+       {"negation", "-cycles + -(2 * 3)"},
+       {"subtraction", "instructions -cycles"},
+       {"MPKI", "1e3 * cache-misses / instructions"},
+       {"zero", "cycles / (instructions - instructions)"}},
+      events);
+  ASSERT_EQ(6U, plan.size());
+  // One stack slot per pending operand.
+  EXPECT_EQ(3U, plan.stack.size());
+  plan.evaluate(std::array<uint64_t, 3>{10U, 40U, 2U}, std::chrono::seconds(1));
+  EXPECT_DOUBLE_EQ(5.0, plan.results[0]);
+  EXPECT_DOUBLE_EQ(-3.0, plan.results[1]);
+  EXPECT_DOUBLE_EQ(-16.0, plan.results[2]);
+  EXPECT_DOUBLE_EQ(30.0, plan.results[3]);
+  EXPECT_DOUBLE_EQ(50.0, plan.results[4]);
+  EXPECT_TRUE(std::isnan(plan.results[5]));
+
+  // Counts from a table with other slots are not evaluated.
+  plan.evaluate(std::array<uint64_t, 2>{10U, 40U}, std::chrono::seconds(1));
+  EXPECT_TRUE(std::isnan(plan.results[0]));
+}
+
+TEST(DerivedMetricsSimpleTest, badFormulas) {
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  const metric_plan plan = compileMetrics({{"unbalanced", "(cycles"},
+                                           {"trailing", "cycles cycles"},
+                                           {"empty", ""},
+                                           {"operator", "cycles * / 2"},
+                                           {"unknown", "bogus-event / 2"},
+                                           {"good", "cycles"}},
+                                          {"cycles"});
+  cerr.rdbuf(old_cerr);
+  EXPECT_THAT(plan.names, testing::ElementsAre("good"));
+  EXPECT_THAT(errors.str(), testing::HasSubstr("unbalanced: missing ')'"));
+  EXPECT_THAT(errors.str(), testing::HasSubstr("trailing: unexpected 'c'"));
+  EXPECT_THAT(errors.str(), testing::HasSubstr("empty: unexpected end"));
+  EXPECT_THAT(errors.str(), testing::HasSubstr("operator: unexpected '/'"));
+  // Formulas for events which are not counted are skipped without a message.
+  EXPECT_THAT(errors.str(), testing::Not(testing::HasSubstr("unknown")));
+}
+
+TEST(DerivedMetricsSimpleTest, printMetrics) {
+  metric_plan plan =
+      compileMetrics({{"IPC", "instructions / cycles"}},
+                     eventNames<default_counter_table>());
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  plan.evaluate(std::array<uint64_t, 2>{0U, 10U}, std::chrono::seconds(1));
+  printMetrics(plan);
+  plan.evaluate(std::array<uint64_t, 2>{10U, 5U}, std::chrono::seconds(1));
+  printMetrics(plan);
+  cout.rdbuf(old_cout);
+  EXPECT_EQ("IPC: n/a\nIPC: 0.5\n", out.str());
+}
+
+} // namespace local_testing
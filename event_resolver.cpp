@@ -0,0 +1,289 @@
+#include "event_resolver.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+
+namespace {
+constexpr char DEVICES_PATH[] = "bus/event_source/devices/";
+
+struct named_event {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+constexpr uint64_t cacheEvent(const uint64_t cache, const uint64_t op,
+                              const uint64_t result) {
+  return cache | (op << 8U) | (result << 16U);
+}
+
+// The generic events, under the names which perf list gives them.
+const named_event GENERIC_EVENTS[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"cpu-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-instructions", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES},
+    {"stalled-cycles-frontend", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+    {"stalled-cycles-backend", PERF_TYPE_HARDWARE,
+     PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+    {"ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+    {"cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK},
+    {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+    {"major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cs", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    {"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {"migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+    {"L1-dcache-loads", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    {"L1-dcache-load-misses", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"L1-icache-load-misses", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC-loads", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    {"LLC-load-misses", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"dTLB-load-misses", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"iTLB-load-misses", PERF_TYPE_HW_CACHE,
+     cacheEvent(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ,
+                PERF_COUNT_HW_CACHE_RESULT_MISS)},
+};
+
+// The first line of a sysfs file, without its newline.
+bool readLine(const std::string &path, std::string &line) {
+  std::ifstream file{path};
+  return static_cast<bool>(std::getline(file, line));
+}
+
+// Decimal, or hexadecimal with 0x, as in sysfs.
+bool parseNumber(const std::string &text, const int base, uint64_t &value) {
+  if (text.empty() || !std::isxdigit(static_cast<unsigned char>(text[0]))) {
+    return false;
+  }
+  char *end = nullptr;
+  errno = 0;
+  value = strtoull(text.c_str(), &end, base);
+  return (0 == errno) && ('\0' == *end);
+}
+
+uint64_t *configWord(const std::string &word, struct event_config &config) {
+  if ("config" == word) {
+    return &config.config;
+  }
+  if ("config1" == word) {
+    return &config.config1;
+  }
+  if ("config2" == word) {
+    return &config.config2;
+  }
+  return nullptr;
+}
+
+// Scatter the bits of value, lowest first, into the bits which a format such
+// as "config:0-7,21" lists.  False if the format is not understood or the
+// value does not fit.
+bool applyFormat(const std::string &format, uint64_t value,
+                 struct event_config &config) {
+  const size_t colon = format.find(':');
+  uint64_t *word = configWord(format.substr(0U, colon), config);
+  if ((std::string::npos == colon) || (nullptr == word)) {
+    return false;
+  }
+  const char *pos = format.c_str() + colon + 1U;
+  while ('\0' != *pos) {
+    unsigned first = 0U;
+    unsigned last = 0U;
+    int consumed = 0;
+    const int matched = sscanf(pos, "%u-%u%n", &first, &last, &consumed);
+    if (matched < 2) {
+      consumed = 0;
+      if (sscanf(pos, "%u%n", &first, &consumed) < 1) {
+        return false;
+      }
+      last = first;
+    }
+    if ((last < first) || (last > 63U)) {
+      return false;
+    }
+    for (unsigned bit = first; bit <= last; bit++) {
+      *word |= (value & 1U) << bit;
+      value >>= 1U;
+    }
+    pos += consumed;
+    if (',' == *pos) {
+      pos++;
+    }
+  }
+  return 0U == value;
+}
+
+// Apply the terms, such as "event=0x3c,umask=0x0", of the PMU in pmu_path to
+// config.  A term may name one of the PMU's events, whose own terms are then
+// applied, but those may not name further events.
+bool applyTerms(const std::string &pmu_path, const std::string &terms,
+                const bool allow_events, struct event_config &config) {
+  size_t start = 0U;
+  while (start <= terms.size()) {
+    size_t end = terms.find(',', start);
+    if (std::string::npos == end) {
+      end = terms.size();
+    }
+    const std::string term = terms.substr(start, end - start);
+    start = end + 1U;
+    const size_t equals = term.find('=');
+    const std::string name = term.substr(0U, equals);
+    uint64_t value = 1U;
+    if ((std::string::npos != equals) &&
+        !parseNumber(term.substr(equals + 1U), 0, value)) {
+      std::cerr << "Bad value in term " << term << std::endl;
+      return false;
+    }
+    std::string text{};
+    if (uint64_t *word = configWord(name, config)) {
+      *word = value;
+    } else if (readLine(pmu_path + "format/" + name, text)) {
+      if (!applyFormat(text, value, config)) {
+        std::cerr << "Term " << term << " does not fit format " << text
+                  << std::endl;
+        return false;
+      }
+    } else if (allow_events && (std::string::npos == equals) &&
+               readLine(pmu_path + "events/" + name, text)) {
+      if (!applyTerms(pmu_path, text, false, config)) {
+        return false;
+      }
+    } else {
+      std::cerr << "Unknown term " << term << " for " << pmu_path
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool resolvePmuEvent(const std::string &pmu, const std::string &terms,
+                     const std::string &sys_path,
+                     struct event_config &config) {
+  const std::string pmu_path = sys_path + DEVICES_PATH + pmu + "/";
+  std::string type{};
+  uint64_t value = 0U;
+  if (!readLine(pmu_path + "type", type) || !parseNumber(type, 10, value)) {
+    std::cerr << "Unknown PMU " << pmu << std::endl;
+    return false;
+  }
+  config = {static_cast<uint32_t>(value), 0U, 0U, 0U};
+  return applyTerms(pmu_path, terms, true, config);
+}
+
+std::vector<struct event_config>
+resolveEvents(const std::vector<std::string> &names,
+              const std::string &sys_path) {
+  std::vector<struct event_config> configs(names.size());
+  for (size_t i = 0U; i < names.size(); i++) {
+    if (!resolveEvent(names[i], sys_path, configs[i])) {
+      return std::vector<struct event_config>{};
+    }
+  }
+  return configs;
+}
+
+// An event which names its PMU, even one of the core PMUs, counts only on that
+// PMU, and a software event on none.
+bool coreGeneric(const std::vector<std::string> &names,
+                 const std::vector<struct event_config> &configs) {
+  for (size_t i = 0U; i < configs.size(); i++) {
+    const std::string &name = names[i];
+    uint64_t raw = 0U;
+    const bool generic =
+        std::any_of(std::begin(GENERIC_EVENTS), std::end(GENERIC_EVENTS),
+                    [&name](const named_event &ev) { return name == ev.name; });
+    const bool is_raw = (name.size() > 1U) && ('r' == name[0]) &&
+                        parseNumber(name.substr(1U), 16, raw);
+    if (!(generic || is_raw) || !pmuRetargetable(configs[i].type)) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace
+
+bool resolveEvent(const std::string &name, const std::string &sys_path,
+                  struct event_config &config) {
+  const size_t slash = name.find('/');
+  if (std::string::npos != slash) {
+    if ((name.size() < (slash + 2U)) || ('/' != name.back())) {
+      std::cerr << "Event " << name << " lacks its closing '/'" << std::endl;
+      return false;
+    }
+    return resolvePmuEvent(name.substr(0U, slash),
+                           name.substr(slash + 1U, name.size() - slash - 2U),
+                           sys_path, config);
+  }
+  for (const named_event &generic : GENERIC_EVENTS) {
+    if (name == generic.name) {
+      config = {generic.type, generic.config, 0U, 0U};
+      return true;
+    }
+  }
+  uint64_t raw = 0U;
+  if ((name.size() > 1U) && ('r' == name[0]) &&
+      parseNumber(name.substr(1U), 16, raw)) {
+    config = {PERF_TYPE_RAW, raw, 0U, 0U};
+    return true;
+  }
+  // The directory iterator's order is unspecified.
+  std::vector<std::string> pmus{};
+  std::error_code ec{};
+  for (const fs::directory_entry &device :
+       fs::directory_iterator(sys_path + DEVICES_PATH, ec)) {
+    if (fs::exists(device.path() / "events" / name, ec)) {
+      pmus.push_back(device.path().filename().string());
+    }
+  }
+  if (pmus.empty()) {
+    std::cerr << "Unknown event " << name << std::endl;
+    return false;
+  }
+  return resolvePmuEvent(*std::min_element(pmus.begin(), pmus.end()), name,
+                         sys_path, config);
+}
+
+event_table::event_table(const std::vector<std::string> &event_names,
+                         const std::string &sys_path)
+    : names(event_names), configs(resolveEvents(event_names, sys_path)),
+      core_generic(coreGeneric(names, configs)) {}
+
+void printEventRates(const event_table &events, const uint64_t *estimates,
+                     const std::chrono::nanoseconds elapsed,
+                     const double confidence) {
+  if (elapsed.count() <= 0) {
+    return;
+  }
+  std::cout << "----------------------------------------------------"
+            << std::endl;
+  for (size_t ev = 0U; ev < events.size(); ev++) {
+    printRate(estimates[ev], events.names[ev], elapsed);
+  }
+  printConfidence(confidence);
+}
@@ -0,0 +1,75 @@
+#ifndef EVENT_RESOLVER_HPP
+#define EVENT_RESOLVER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+  Events are named as perf list spells them:
+    cycles, cache-misses, LLC-load-misses  a generic hardware, cache or
+                                           software event
+    r1c2                                   a raw config for the core PMU, in
+                                           hex
+    cpu/event=0x3c,umask=0x0/              terms for a PMU in sysfs
+    cpu/mem-loads/, mem-loads              an event which a PMU's sysfs
+                                           directory lists
+  A PMU's terms are the fields which its format directory describes, such as
+  event, umask or cmask.  A term without a value is 1, and config, config1 and
+  config2 set those words whole.  A name without a PMU which is not generic or
+  raw is looked up in the PMUs in name order.
+*/
+
+// Resolve one event name against <sys_path>bus/event_source/devices.  Errors
+// are reported, and the result is false.
+bool resolveEvent(const std::string &name, const std::string &sys_path,
+                  struct event_config &config);
+
+// The events of a group, resolved once at startup.  The table never changes
+// afterwards, so counter tables can point into configs, and setting up a
+// counter indexes it without handling any strings.
+struct event_table {
+  event_table(const std::vector<std::string> &event_names,
+              const std::string &sys_path);
+
+  // False if any name failed to resolve, in which case configs is empty.
+  bool ok() const { return configs.size() == names.size(); }
+  size_t size() const { return names.size(); }
+
+  const std::vector<std::string> names;
+  const std::vector<struct event_config> configs;
+  // Whether every event is a generic hardware or cache event or a raw one,
+  // which configureStruct() can direct to each core PMU of a hybrid CPU.
+  const bool core_generic;
+};
+
+// Count the events of the table in the slots of counters.  The groups which
+// are created afterwards count them.  False if the table failed to resolve or,
+// with an error, if the number of events and of slots differ.  A group is
+// opened on each core PMU only if all of its events can be directed to one, so
+// the table's core_pmus must be set first, and are cleared otherwise.
+template <class Table>
+bool useEvents(Table &counters, const event_table &events) {
+  if (!events.ok()) {
+    return false;
+  }
+  if (events.size() != Table::OBSERVED_EVENTS) {
+    std::cerr << "The group counts " << Table::OBSERVED_EVENTS
+              << " events, not " << events.size() << std::endl;
+    return false;
+  }
+  counters.events = events.configs.data();
+  if (!events.core_generic) {
+    counters.core_pmus.clear();
+  }
+  return true;
+}
+
+// The rate of each event in the table, whose scaled counts are estimates.
+void printEventRates(const event_table &events, const uint64_t *estimates,
+                     const std::chrono::nanoseconds elapsed,
+                     const double confidence);
+
+#endif // EVENT_RESOLVER_HPP
@@ -0,0 +1,205 @@
+#include "event_resolver.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+
+namespace local_testing {
+
+// A core PMU, with the formats and one event of an Intel core, and an uncore
+// PMU, in a fake sysfs.
+struct EventResolverTest : public ::testing::Test {
+  void SetUp() {
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(TEST_PATH);
+    const fs::path devices{std::string(TEST_PATH) +
+                           "bus/event_source/devices"};
+    ASSERT_TRUE(fs::create_directories(devices / "cpu" / "format"));
+    ASSERT_TRUE(fs::create_directories(devices / "cpu" / "events"));
+    ASSERT_TRUE(fs::create_directories(devices / "uncore_imc" / "events"));
+    write(devices / "cpu" / "type", "4");
+    write(devices / "cpu" / "format" / "event", "config:0-7");
+    write(devices / "cpu" / "format" / "umask", "config:8-15");
+    write(devices / "cpu" / "format" / "edge", "config:18");
+    write(devices / "cpu" / "format" / "cmask", "config:24-31");
+    write(devices / "cpu" / "format" / "ldlat", "config1:0-15");
+    write(devices / "cpu" / "format" / "split", "config:0-3,32-35");
+    write(devices / "cpu" / "events" / "mem-loads",
+          "event=0xcd,umask=0x1,ldlat=3");
+    write(devices / "uncore_imc" / "type", "17");
+    write(devices / "uncore_imc" / "events" / "clockticks", "config=0xff");
+  }
+  void TearDown() { ASSERT_NE(-1, fs::remove_all(TEST_PATH)); }
+  void write(const fs::path &path, const std::string &text) {
+    std::ofstream{path} << text << std::endl;
+  }
+  // Resolve name, which must fail, and return the error.
+  std::string failure(const std::string &name) {
+    std::ostringstream errors{};
+    std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+    struct event_config config {};
+    EXPECT_FALSE(resolveEvent(name, TEST_PATH, config)) << name;
+    cerr.rdbuf(old_cerr);
+    return errors.str();
+  }
+  struct event_config resolve(const std::string &name) {
+    struct event_config config {};
+    EXPECT_TRUE(resolveEvent(name, TEST_PATH, config)) << name;
+    return config;
+  }
+};
+
+TEST_F(EventResolverTest, genericEvents) {
+  struct event_config config = resolve("cache-misses");
+  EXPECT_EQ(PERF_TYPE_HARDWARE, config.type);
+  EXPECT_EQ(PERF_COUNT_HW_CACHE_MISSES, config.config);
+  config = resolve("branches");
+  EXPECT_EQ(PERF_COUNT_HW_BRANCH_INSTRUCTIONS, config.config);
+  config = resolve("task-clock");
+  EXPECT_EQ(PERF_TYPE_SOFTWARE, config.type);
+  EXPECT_EQ(PERF_COUNT_SW_TASK_CLOCK, config.config);
+  config = resolve("LLC-load-misses");
+  EXPECT_EQ(PERF_TYPE_HW_CACHE, config.type);
+  EXPECT_EQ(PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8U) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16U),
+            config.config);
+  config = resolve("r1c2");
+  EXPECT_EQ(PERF_TYPE_RAW, config.type);
+  EXPECT_EQ(0x1c2U, config.config);
+}
+
+TEST_F(EventResolverTest, pmuTerms) {
+  struct event_config config = resolve("cpu/event=0x3c,umask=0x0/");
+  EXPECT_EQ(4U, config.type);
+  EXPECT_EQ(0x3cU, config.config);
+  config = resolve("cpu/event=0xc0,umask=2,edge,cmask=1/");
+  EXPECT_EQ(0x010402c0U, config.config);
+  // The low bits of the value fill the first range, the rest the second.
+  config = resolve("cpu/split=0x5a/");
+  EXPECT_EQ((0x5ULL << 32U) | 0xaU, config.config);
+  config = resolve("cpu/config=0x1234,config1=7,config2=9/");
+  EXPECT_EQ(0x1234U, config.config);
+  EXPECT_EQ(7U, config.config1);
+  EXPECT_EQ(9U, config.config2);
+}
+
+TEST_F(EventResolverTest, sysfsAliases) {
+  struct event_config config = resolve("cpu/mem-loads/");
+  EXPECT_EQ(4U, config.type);
+  EXPECT_EQ(0x1cdU, config.config);
+  EXPECT_EQ(3U, config.config1);
+  // Without a PMU.
+  config = resolve("mem-loads");
+  EXPECT_EQ(0x1cdU, config.config);
+  config = resolve("clockticks");
+  EXPECT_EQ(17U, config.type);
+  EXPECT_EQ(0xffU, config.config);
+  // An alias's terms can be extended.
+  config = resolve("cpu/mem-loads,cmask=1/");
+  EXPECT_EQ(0x010001cdU, config.config);
+}
+
+TEST_F(EventResolverTest, errors) {
+  EXPECT_THAT(failure("no-such-event"), testing::HasSubstr("Unknown event"));
+  EXPECT_THAT(failure("nopmu/event=1/"), testing::HasSubstr("Unknown PMU"));
+  EXPECT_THAT(failure("cpu/event=1"), testing::HasSubstr("closing '/'"));
+  EXPECT_THAT(failure("cpu/flavor=1/"), testing::HasSubstr("Unknown term"));
+  EXPECT_THAT(failure("cpu/umask=0x100/"),
+              testing::HasSubstr("does not fit format"));
+  EXPECT_THAT(failure("cpu/event=-1/"), testing::HasSubstr("Bad value"));
+  EXPECT_THAT(failure("cpu/event=0x3cq/"), testing::HasSubstr("Bad value"));
+  // An event's own terms are not looked up as events.
+  EXPECT_THAT(failure("cpu/mem-loads=1/"), testing::HasSubstr("Unknown term"));
+}
+
+TEST_F(EventResolverTest, eventTable) {
+  const event_table events({"cpu/event=0x3c/", "cache-misses"}, TEST_PATH);
+  ASSERT_TRUE(events.ok());
+  ASSERT_EQ(2U, events.size());
+  EXPECT_EQ("cpu/event=0x3c/", events.names[0]);
+  EXPECT_EQ(4U, events.configs[0].type);
+  EXPECT_EQ(PERF_COUNT_HW_CACHE_MISSES, events.configs[1].config);
+
+  // New groups index the table.
+  default_counter_table counters{};
+  ASSERT_TRUE(useEvents(counters, events));
+  EXPECT_EQ(events.configs.data(), counters.events);
+  default_pcounter pc(1);
+  copyGroupSettings(counters, pc);
+  setupCounter(pc);
+  EXPECT_EQ(4U, pc.perfstruct[0].type);
+  EXPECT_EQ(0x3cU, pc.perfstruct[0].config);
+  EXPECT_EQ(PERF_COUNT_HW_CACHE_MISSES, pc.perfstruct[1].config);
+  for (const int fd : pc.group_fd) {
+    closeCounterFd(fd);
+  }
+
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  const event_table three({"cycles", "instructions", "branches"}, TEST_PATH);
+  EXPECT_TRUE(three.ok());
+  default_counter_table other{};
+  EXPECT_FALSE(useEvents(other, three));
+  EXPECT_EQ(nullptr, other.events);
+  const event_table bad({"cycles", "no-such-event"}, TEST_PATH);
+  EXPECT_FALSE(bad.ok());
+  EXPECT_TRUE(bad.configs.empty());
+  EXPECT_FALSE(useEvents(other, bad));
+  cerr.rdbuf(old_cerr);
+  EXPECT_THAT(errors.str(), testing::HasSubstr("counts 2 events, not 3"));
+}
+
+// A software event has no core PMU, so each thread gets a single group rather
+// than one per PMU which would all count the same.
+TEST_F(EventResolverTest, corePmus) {
+  const std::vector<struct core_pmu> pmus{{"cpu_atom", 10U, {}},
+                                          {"cpu_core", 4U, {}}};
+  const event_table generic({"cycles", "r1c2"}, TEST_PATH);
+  default_counter_table counters{};
+  counters.core_pmus = pmus;
+  ASSERT_TRUE(useEvents(counters, generic));
+  EXPECT_EQ(2U, counters.core_pmus.size());
+
+  const event_table software({"cycles", "task-clock"}, TEST_PATH);
+  counters.core_pmus = pmus;
+  ASSERT_TRUE(useEvents(counters, software));
+  EXPECT_TRUE(counters.core_pmus.empty());
+  std::ostringstream errors{};
+  std::streambuf *old_cout = cout.rdbuf(errors.rdbuf());
+  createCounters(counters, std::set<pid_t>{1234, 1235});
+  cout.rdbuf(old_cout);
+  EXPECT_EQ((std::vector<pid_t>{1234, 1235}), counters.tids);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    closeCounterFds(counters, i);
+  }
+
+  // Nor do the events which name their PMU, even a core one.
+  for (const char *name : {"cpu/event=0x3c/", "mem-loads"}) {
+    const event_table named({name, "cycles"}, TEST_PATH);
+    counters.core_pmus = pmus;
+    ASSERT_TRUE(useEvents(counters, named));
+    EXPECT_TRUE(counters.core_pmus.empty()) << name;
+  }
+}
+
+TEST(EventResolverSimpleTest, printEventRates) {
+  const event_table events({"cycles", "branch-misses"}, "nonexistent/");
+  const uint64_t estimates[] = {3000000000U, 1000U};
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printEventRates(events, estimates, std::chrono::seconds(2), 0.5);
+  cout.rdbuf(old_cout);
+  EXPECT_THAT(out.str(),
+              testing::HasSubstr("Got 1500000000 (1.5 billion) cycles"));
+  EXPECT_THAT(out.str(), testing::HasSubstr("Got 500 (5e-07 billion) "
+                                            "branch-misses per second"));
+  EXPECT_THAT(out.str(), testing::HasSubstr("Counted 50%"));
+}
+
+} // namespace local_testing
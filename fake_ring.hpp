@@ -0,0 +1,68 @@
+#ifndef FAKE_RING_HPP
+#define FAKE_RING_HPP
+
+// For tests only: a test fixture, not part of the library.
+
+#include "performance_counter_lib.hpp"
+
+#include "gtest/gtest.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace local_testing {
+
+// A ring buffer's metadata page and one data page in ordinary memory, as the
+// kernel would lay them out.  Records are appended at head, and the reader
+// sees them once they are published.
+struct FakeRingTest : public ::testing::Test {
+  void SetUp() {
+    page_size = sysconf(_SC_PAGESIZE);
+    buffer.assign(3U * page_size, 0);
+    // The metadata page must be aligned like a real mapping.
+    char *base = buffer.data() + page_size -
+                 (reinterpret_cast<uintptr_t>(buffer.data()) % page_size);
+    ring = {reinterpret_cast<struct perf_event_mmap_page *>(base),
+            2U * page_size};
+    ring.page->data_offset = page_size;
+    ring.page->data_size = page_size;
+  }
+  // Copy size bytes to position pos of the ring, wrapping at its end.
+  void write(const uint64_t pos, const void *record, const size_t size) {
+    char *data = reinterpret_cast<char *>(ring.page) + page_size;
+    const char *bytes = static_cast<const char *>(record);
+    for (size_t i = 0U; i < size; i++) {
+      data[(pos + i) % page_size] = bytes[i];
+    }
+  }
+  // Append a record of type and size of which only the header is written.
+  void writeRecord(const uint32_t type, const uint16_t size) {
+    const struct perf_event_header header = {type, 0U, size};
+    write(head, &header, sizeof(header));
+    head += size;
+  }
+  void writeLost(const uint64_t lost) {
+    const struct {
+      struct perf_event_header header;
+      uint64_t id;
+      uint64_t lost;
+    } record = {{PERF_RECORD_LOST, 0U, 24U}, 1U, lost};
+    write(head, &record, sizeof(record));
+    head += sizeof(record);
+  }
+  // Start reading and writing at pos.
+  void seek(const uint64_t pos) {
+    head = pos;
+    ring.page->data_tail = pos;
+  }
+  void publish() { ring.page->data_head = head; }
+
+  size_t page_size = 0U;
+  std::vector<char> buffer{};
+  struct perf_ring ring {};
+  uint64_t head = 0U;
+};
+
+} // namespace local_testing
+
+#endif // FAKE_RING_HPP
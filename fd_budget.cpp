@@ -0,0 +1,146 @@
+#include "fd_budget.hpp"
+
+#include <fcntl.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+// Read the start of <proc_path><tid>/<file> into buf, which is terminated.
+bool readProcFile(const std::string &proc_path, const pid_t tid,
+                  const char *file, char *buf, const size_t size) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%d/%s", proc_path.c_str(), tid, file);
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const ssize_t len = read(fd, buf, size - 1U);
+  close(fd);
+  if (len <= 0) {
+    return false;
+  }
+  buf[len] = '\0';
+  return true;
+}
+} // namespace
+
+// schedstat holds the time on the CPU, the time waiting for it and the number
+// of timeslices.  The state follows the name in stat, which is in parentheses
+// and may itself contain them.
+bool threadRan(const std::string &proc_path, const pid_t tid,
+               uint64_t &runtime) {
+  char buf[512];
+  if (readProcFile(proc_path, tid, "schedstat", buf, sizeof(buf))) {
+    const uint64_t now = strtoull(buf, nullptr, 10);
+    const bool ran = now > runtime;
+    runtime = now;
+    return ran;
+  }
+  if (!readProcFile(proc_path, tid, "stat", buf, sizeof(buf))) {
+    return false;
+  }
+  const char *name_end = strrchr(buf, ')');
+  return (nullptr != name_end) && (0 == strncmp(name_end, ") R", 3U));
+}
+
+size_t counterFdLimit(const size_t reserve) {
+  struct rlimit rlimits;
+  if (getrlimit(RLIMIT_NOFILE, &rlimits) == -1) {
+    return 0U;
+  }
+  return (rlimits.rlim_cur > reserve) ? (rlimits.rlim_cur - reserve) : 0U;
+}
+
+fd_budget::fd_budget(const std::string &path, const size_t fds,
+                     const uint32_t intervals)
+    : proc_path(path), max_fds(fds), idle_limit(intervals), waiting{},
+      counted{}, evictions(0U) {}
+
+void fd_budget::add(const std::set<pid_t> &tids) {
+  for (const pid_t tid : tids) {
+    if (!counted.count(tid)) {
+      waiting.emplace(tid, 0U);
+    }
+  }
+}
+
+void fd_budget::remove(const std::set<pid_t> &tids) {
+  for (const pid_t tid : tids) {
+    waiting.erase(tid);
+    counted.erase(tid);
+  }
+}
+
+bool fd_budget::idle(const pid_t tid, const bool counts) {
+  uint32_t &intervals = counted[tid];
+  intervals = counts ? 0U : intervals + 1U;
+  return intervals >= idle_limit;
+}
+
+// The thread's time so far is its baseline.
+void fd_budget::evict(const std::set<pid_t> &tids) {
+  for (const pid_t tid : tids) {
+    counted.erase(tid);
+    uint64_t runtime = 0U;
+    threadRan(proc_path, tid, runtime);
+    waiting[tid] = runtime;
+    evictions++;
+  }
+}
+
+void fd_budget::requeue(const std::set<pid_t> &tids) {
+  for (const pid_t tid : tids) {
+    counted.erase(tid);
+    waiting[tid] = 0U;
+  }
+}
+
+void fd_budget::shrink(const size_t fds) {
+  max_fds = std::min(max_fds, fds);
+}
+
+std::set<pid_t> fd_budget::attach(const size_t n) {
+  std::set<pid_t> attached{};
+  if (0U == n) {
+    return attached;
+  }
+  // The CPU time of each thread which ran, since it was last checked.
+  std::vector<std::pair<uint64_t, pid_t>> ran{};
+  for (auto &thread : waiting) {
+    const uint64_t before = thread.second;
+    if (threadRan(proc_path, thread.first, thread.second)) {
+      ran.emplace_back(thread.second - std::min(before, thread.second),
+                       thread.first);
+    }
+  }
+  const size_t k = std::min(n, ran.size());
+  std::partial_sort(ran.begin(), ran.begin() + k, ran.end(),
+                    [](const std::pair<uint64_t, pid_t> &a,
+                       const std::pair<uint64_t, pid_t> &b) {
+                      return a.first > b.first;
+                    });
+  for (size_t i = 0U; i < k; i++) {
+    const pid_t tid = ran[i].second;
+    waiting.erase(tid);
+    counted[tid] = 0U;
+    attached.insert(tid);
+  }
+  return attached;
+}
+
+void printCoverage(const fd_budget &budget, const size_t fds) {
+  const size_t threads = budget.threads();
+  if (0U == threads) {
+    return;
+  }
+  std::cout << "Counting " << budget.counted.size() << " of " << threads
+            << " threads ("
+            << (100.0 * static_cast<double>(budget.counted.size())) /
+                   static_cast<double>(threads)
+            << "%) with " << fds << " of " << budget.max_fds
+            << " descriptors, " << budget.evictions << " evicted while idle"
+            << std::endl;
+}
@@ -0,0 +1,169 @@
+#ifndef FD_BUDGET_HPP
+#define FD_BUDGET_HPP
+
+#include "performance_counter_lib.hpp"
+#include "thread_tracker.hpp"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Whether tid ran since runtime, its CPU time in nanoseconds when last
+// checked, which is updated.  The time comes from <proc_path><tid>/schedstat;
+// without it, a thread counts as having run if its state in stat is R.  False
+// if the thread is gone.
+bool threadRan(const std::string &proc_path, const pid_t tid,
+               uint64_t &runtime);
+
+// The soft RLIMIT_NOFILE less reserve descriptors for everything besides the
+// counters.
+size_t counterFdLimit(const size_t reserve);
+
+// Keeps the counters of a thread_tracker's threads within a budget of file
+// descriptors.  Threads get counters lazily, once procfs shows that they run,
+// busiest first, as long as the budget has room, and a thread whose counters
+// counted nothing for idle_limit intervals in a row gives them up.  A process
+// with more threads than the budget allows is then covered where it is busy
+// instead of failing to open counters with EMFILE.
+struct fd_budget {
+  fd_budget(const std::string &proc_path, const size_t max_fds,
+            const uint32_t idle_limit);
+
+  // Follow new threads, which have no counters yet.  Any CPU time makes them
+  // eligible.
+  void add(const std::set<pid_t> &tids);
+  // Forget threads which exited.
+  void remove(const std::set<pid_t> &tids);
+  // Record whether the counted thread tid counted anything this interval.
+  // True once it has been idle for idle_limit intervals.
+  bool idle(const pid_t tid, const bool counted);
+  // Move counted threads back to the waiting ones.  Evicted threads must run
+  // again to get new counters, and failed ones, whose counters did not open,
+  // are eligible as new ones are.
+  void evict(const std::set<pid_t> &tids);
+  void requeue(const std::set<pid_t> &tids);
+  // The descriptors ran out with fds in use, short of the budget, so the
+  // budget shrinks to fds rather than failing the same threads each interval.
+  void shrink(const size_t fds);
+  // Up to n of the waiting threads which ran since they were last checked,
+  // busiest first, which become counted.  Nothing is checked if n is zero.
+  std::set<pid_t> attach(const size_t n);
+
+  size_t threads() const { return waiting.size() + counted.size(); }
+
+  const std::string proc_path;
+  size_t max_fds;
+  const uint32_t idle_limit;
+  // The threads without counters, and their CPU time when last checked.
+  std::map<pid_t, uint64_t> waiting;
+  // The threads with counters, and the intervals for which each has counted
+  // nothing.
+  std::map<pid_t, uint32_t> counted;
+  uint64_t evictions;
+};
+
+// The descriptors which one thread's groups take in a table.
+template <class Table> size_t fdsPerThread(const Table &counters) {
+  return Table::OBSERVED_EVENTS *
+         std::max<size_t>(counters.core_pmus.size(), 1U);
+}
+
+template <class Table> size_t fdsInUse(const Table &counters) {
+  return Table::OBSERVED_EVENTS * counters.size();
+}
+
+// The threads of the table which have counted nothing for the budget's
+// idle_limit intervals in a row.  Call it once per interval, after the table
+// was read.  A thread's groups on several core PMUs count together.
+template <class Table>
+std::set<pid_t> idleThreads(fd_budget &budget, const Table &counters) {
+  std::set<pid_t> idle{};
+  for (size_t i = 0U; i < counters.size();) {
+    const pid_t tid = counters.tids[i];
+    bool counted = false;
+    for (; (i < counters.size()) && (counters.tids[i] == tid); i++) {
+      for (const uint64_t value : counters.values[i]) {
+        counted = counted || (0U != value);
+      }
+    }
+    if (budget.idle(tid, counted)) {
+      idle.emplace_hint(idle.end(), tid);
+    }
+  }
+  return idle;
+}
+
+// The threads of the table any of whose events failed to open.
+template <class Table> std::set<pid_t> failedThreads(const Table &counters) {
+  std::set<pid_t> failed{};
+  for (size_t i = 0U; i < counters.size(); i++) {
+    for (const int fd : counters.group_fds[i]) {
+      if (fd <= STDERR_FILENO) {
+        failed.emplace_hint(failed.end(), counters.tids[i]);
+        break;
+      }
+    }
+  }
+  return failed;
+}
+
+// Give counters to as many of the waiting threads which ran as the budget
+// allows.  Threads whose groups do not open, for example because they just
+// exited, lose them again rather than keeping broken counters.  If the process
+// or the system ran out of descriptors, the budget was too large, and shrinks
+// to the descriptors which remain in use.  setupCounter() clears errno for
+// each group, so errno is that of the last group, which is the first to run
+// out.
+template <class... Tables>
+void attachCounters(fd_budget &budget, Tables &...counters) {
+  const size_t used = (fdsInUse(counters) + ...);
+  const size_t per_thread = (fdsPerThread(counters) + ...);
+  const size_t room =
+      (budget.max_fds > used) ? (budget.max_fds - used) / per_thread : 0U;
+  const std::set<pid_t> attached = budget.attach(room);
+  if (attached.empty()) {
+    return;
+  }
+  bool exhausted = false;
+  ((createCounters(counters, attached),
+    exhausted = exhausted || (EMFILE == errno) || (ENFILE == errno)),
+   ...);
+  std::set<pid_t> failed{};
+  for (const std::set<pid_t> &table_failed : {failedThreads(counters)...}) {
+    failed.insert(table_failed.begin(), table_failed.end());
+  }
+  (cullCounters(counters, failed), ...);
+  budget.requeue(failed);
+  if (exhausted) {
+    budget.shrink((fdsInUse(counters) + ...));
+  }
+}
+
+// updateCounters() within a budget.  Exited threads are culled, the threads
+// of the first table which were idle for long enough are evicted, and the
+// freed descriptors go to the busiest waiting threads.
+template <class Table, class... Tables>
+void updateBudgetedCounters(thread_tracker &tracker, fd_budget &budget,
+                            Table &first, Tables &...rest) {
+  std::set<pid_t> started{};
+  std::set<pid_t> exited{};
+  tracker.poll(started, exited);
+  cullCounters(first, exited);
+  (cullCounters(rest, exited), ...);
+  budget.remove(exited);
+  budget.add(started);
+  const std::set<pid_t> idle = idleThreads(budget, first);
+  cullCounters(first, idle);
+  (cullCounters(rest, idle), ...);
+  budget.evict(idle);
+  attachCounters(budget, first, rest...);
+}
+
+// How many of the threads have counters, and how much of the budget they use.
+void printCoverage(const fd_budget &budget, const size_t fds);
+
+#endif // FD_BUDGET_HPP
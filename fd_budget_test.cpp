@@ -0,0 +1,221 @@
+#include "fd_budget.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+constexpr pid_t FAKE_PID = 1234;
+
+namespace local_testing {
+
+// Threads with schedstat and stat files in a fake procfs.
+struct FdBudgetTest : public ::testing::Test {
+  void SetUp() {
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(TEST_PATH);
+    ASSERT_TRUE(fs::create_directories(TEST_PATH));
+  }
+  void TearDown() { ASSERT_NE(-1, fs::remove_all(TEST_PATH)); }
+  void setRuntime(const pid_t tid, const uint64_t runtime) {
+    fs::create_directories(TEST_PATH + to_string(tid));
+    std::ofstream{TEST_PATH + to_string(tid) + "/schedstat"}
+        << runtime << " 500 7" << std::endl;
+  }
+  void setState(const pid_t tid, const char state) {
+    fs::create_directories(TEST_PATH + to_string(tid));
+    std::ofstream{TEST_PATH + to_string(tid) + "/stat"}
+        << tid << " (a (b) c) " << state << " 1 2 3" << std::endl;
+  }
+  // Counters which failed to open, for the threads in tids.
+  void insertFakeCounters(const std::vector<pid_t> &tids) {
+    std::vector<default_pcounter> staged{};
+    for (const pid_t tid : tids) {
+      staged.emplace_back(tid);
+      staged.back().group_fd = {-1, -1};
+    }
+    insertCounters(counters, staged);
+  }
+  default_counter_table counters{};
+};
+
+TEST_F(FdBudgetTest, threadRan) {
+  setRuntime(10, 1000U);
+  uint64_t runtime = 0U;
+  EXPECT_TRUE(threadRan(TEST_PATH, 10, runtime));
+  EXPECT_EQ(1000U, runtime);
+  EXPECT_FALSE(threadRan(TEST_PATH, 10, runtime));
+  setRuntime(10, 1500U);
+  EXPECT_TRUE(threadRan(TEST_PATH, 10, runtime));
+  EXPECT_EQ(1500U, runtime);
+
+  // Without schedstat, only running threads count as having run.
+  setState(20, 'R');
+  runtime = 0U;
+  EXPECT_TRUE(threadRan(TEST_PATH, 20, runtime));
+  setState(20, 'S');
+  EXPECT_FALSE(threadRan(TEST_PATH, 20, runtime));
+  // Gone.
+  EXPECT_FALSE(threadRan(TEST_PATH, 30, runtime));
+}
+
+TEST_F(FdBudgetTest, attachBusiestFirst) {
+  fd_budget budget(TEST_PATH, 100U, 2U);
+  budget.add({10, 20, 30, 40});
+  setRuntime(10, 100U);
+  setRuntime(20, 300U);
+  setRuntime(30, 200U);
+  setRuntime(40, 0U);
+  EXPECT_TRUE(budget.attach(0U).empty());
+  EXPECT_EQ((std::set<pid_t>{20, 30}), budget.attach(2U));
+  EXPECT_EQ(2U, budget.counted.size());
+  EXPECT_EQ(2U, budget.waiting.size());
+  EXPECT_EQ(4U, budget.threads());
+  // Thread 10 ran before the last check but not since, and 40 never ran.
+  EXPECT_TRUE(budget.attach(2U).empty());
+  setRuntime(40, 5U);
+  EXPECT_EQ((std::set<pid_t>{40}), budget.attach(2U));
+
+  // Counted threads are not waiting, however often they are added.
+  budget.add({20, 50});
+  EXPECT_EQ(0U, budget.waiting.count(20));
+  EXPECT_EQ(1U, budget.waiting.count(50));
+  budget.remove({20, 50});
+  EXPECT_EQ(0U, budget.counted.count(20));
+  EXPECT_EQ(0U, budget.waiting.count(50));
+}
+
+TEST_F(FdBudgetTest, evictIdleThreads) {
+  fd_budget budget(TEST_PATH, 100U, 2U);
+  insertFakeCounters({10, 20, 20, 30});
+  budget.counted = {{10, 0U}, {20, 0U}, {30, 0U}};
+  // Thread 20's second group, on another core PMU, counted.
+  counters.values = {{0U, 0U}, {0U, 0U}, {5U, 1U}, {0U, 0U}};
+  EXPECT_TRUE(idleThreads(budget, counters).empty());
+  EXPECT_EQ(1U, budget.counted[10]);
+  EXPECT_EQ(0U, budget.counted[20]);
+  counters.values[0] = {7U, 7U};
+  EXPECT_EQ((std::set<pid_t>{30}), idleThreads(budget, counters));
+  // Counting ends a run of idle intervals.
+  EXPECT_EQ(0U, budget.counted[10]);
+
+  // An evicted thread must run again to get counters back.
+  setRuntime(30, 800U);
+  budget.evict({30});
+  EXPECT_EQ(1U, budget.evictions);
+  EXPECT_EQ(0U, budget.counted.count(30));
+  EXPECT_EQ(800U, budget.waiting[30]);
+  EXPECT_TRUE(budget.attach(5U).empty());
+  setRuntime(30, 900U);
+  EXPECT_EQ((std::set<pid_t>{30}), budget.attach(5U));
+
+  budget.requeue({10});
+  EXPECT_EQ(0U, budget.waiting[10]);
+  EXPECT_EQ(0U, budget.counted.count(10));
+}
+
+TEST_F(FdBudgetTest, fdsPerThread) {
+  EXPECT_EQ(2U, fdsPerThread(counters));
+  counters.core_pmus = {{"cpu_atom", 10U, {}}, {"cpu_core", 4U, {}}};
+  EXPECT_EQ(4U, fdsPerThread(counters));
+  insertFakeCounters({10, 10, 20, 20, 30});
+  EXPECT_EQ(10U, fdsInUse(counters));
+  // A group whose leader opened but whose other event did not fails too.
+  counters.group_fds[2] = {100, 101};
+  counters.group_fds[3] = {102, 103};
+  counters.group_fds[4] = {104, -1};
+  EXPECT_EQ((std::set<pid_t>{10, 30}), failedThreads(counters));
+}
+
+// The fake tids have no counters to open, so every group fails, and the
+// threads wait for another turn instead of keeping broken counters.
+TEST_F(FdBudgetTest, attachCounters) {
+  for (const pid_t tid : {10, 20, 30}) {
+    setRuntime(tid, 100U * tid);
+  }
+  // Room for one thread's groups in both tables.
+  fd_budget budget(TEST_PATH, 5U, 2U);
+  budget.add({10, 20, 30});
+  using branch_table =
+      counter_table<branch_instructions_event, branch_misses_event>;
+  branch_table branches{};
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  attachCounters(budget, counters, branches);
+  cout.rdbuf(old_cout);
+  EXPECT_EQ(0U, counters.size());
+  EXPECT_EQ(0U, branches.size());
+  EXPECT_TRUE(budget.counted.empty());
+  ASSERT_EQ(3U, budget.waiting.size());
+  // Only the busiest thread was tried, and it is eligible again at once.
+  EXPECT_EQ(0U, budget.waiting[30]);
+  EXPECT_EQ(2000U, budget.waiting[20]);
+}
+
+// Running out of descriptors below the budget caps it at those in use, so the
+// threads which failed are not retried every interval.
+TEST_F(FdBudgetTest, shrink) {
+  setRuntime(10, 100U);
+  fd_budget budget(TEST_PATH, 100U, 2U);
+  budget.shrink(400U);
+  EXPECT_EQ(100U, budget.max_fds);
+  budget.shrink(40U);
+  EXPECT_EQ(40U, budget.max_fds);
+  budget.add({10});
+  insertFakeCounters(std::vector<pid_t>(20U, 20));
+  attachCounters(budget, counters);
+  // The waiting thread was not even checked.
+  EXPECT_EQ(1U, budget.waiting.size());
+  EXPECT_EQ(0U, budget.waiting[10]);
+}
+
+TEST_F(FdBudgetTest, updateBudgetedCounters) {
+  const std::string task_path =
+      TEST_PATH + to_string(FAKE_PID) + "/task/";
+  for (const pid_t tid : {FAKE_PID, FAKE_PID + 1}) {
+    ASSERT_TRUE(fs::create_directories(task_path + to_string(tid)));
+    setRuntime(tid, 1000U);
+  }
+  thread_tracker tracker(TEST_PATH, FAKE_PID, false);
+  fd_budget budget(TEST_PATH, 100U, 2U);
+  budget.add(tracker.tids);
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  ASSERT_TRUE(fs::create_directories(task_path + to_string(FAKE_PID + 2)));
+  fs::remove_all(task_path + to_string(FAKE_PID + 1));
+  updateBudgetedCounters(tracker, budget, counters);
+  cout.rdbuf(old_cout);
+  EXPECT_EQ((std::set<pid_t>{FAKE_PID, FAKE_PID + 2}),
+            (std::set<pid_t>{budget.waiting.begin()->first,
+                             budget.waiting.rbegin()->first}));
+  EXPECT_EQ(2U, budget.threads());
+}
+
+TEST(FdBudgetSimpleTest, printCoverage) {
+  fd_budget budget("nonexistent/", 400U, 3U);
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printCoverage(budget, 0U);
+  EXPECT_TRUE(out.str().empty());
+  budget.add({1, 2, 3});
+  budget.counted = {{4, 0U}};
+  budget.evictions = 6U;
+  printCoverage(budget, 2U);
+  cout.rdbuf(old_cout);
+  EXPECT_EQ("Counting 1 of 4 threads (25%) with 2 of 400 descriptors, 6 "
+            "evicted while idle\n",
+            out.str());
+}
+
+TEST(FdBudgetSimpleTest, counterFdLimit) {
+  struct rlimit rlimits;
+  ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &rlimits));
+  EXPECT_EQ(rlimits.rlim_cur - 10U, counterFdLimit(10U));
+  EXPECT_EQ(0U, counterFdLimit(rlimits.rlim_cur + 1U));
+}
+
+} // namespace local_testing
@@ -0,0 +1,70 @@
+#include "interval_timer.hpp"
+
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include <cstring>
+#include <thread>
+
+namespace {
+struct timespec toTimespec(const std::chrono::nanoseconds ns) {
+  struct timespec ts;
+  ts.tv_sec = ns.count() / 1000000000LL;
+  ts.tv_nsec = ns.count() % 1000000000LL;
+  return ts;
+}
+} // namespace
+
+std::chrono::nanoseconds monotonicNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+// The first deadline is one period from now and the kernel adds the period to
+// the previous deadline, not to the time of expiry, for every later one.
+interval_timer::interval_timer(const std::chrono::nanoseconds p)
+    : period(p), timer_fd(-1) {
+  errno = 0;
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timer_fd < 0) {
+    std::cerr << "timerfd unavailable, using sleep: " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  struct itimerspec spec;
+  spec.it_value = toTimespec(monotonicNow() + period);
+  spec.it_interval = toTimespec(period);
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+    std::cerr << "Failed to arm timerfd, using sleep: " << strerror(errno)
+              << std::endl;
+    close(timer_fd);
+    timer_fd = -1;
+  }
+}
+
+interval_timer::~interval_timer() {
+  if (timer_fd >= 0) {
+    close(timer_fd);
+  }
+}
+
+uint64_t interval_timer::wait() {
+  if (timer_fd < 0) {
+    std::this_thread::sleep_for(period);
+    return 1U;
+  }
+  uint64_t expirations = 0U;
+  while (true) {
+    errno = 0;
+    const ssize_t res = read(timer_fd, &expirations, sizeof(expirations));
+    if (res == sizeof(expirations)) {
+      return expirations;
+    }
+    if (EINTR != errno) {
+      std::cerr << "Failed to read timerfd: " << strerror(errno) << std::endl;
+      std::this_thread::sleep_for(period);
+      return 1U;
+    }
+  }
+}
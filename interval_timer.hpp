@@ -0,0 +1,35 @@
+#ifndef INTERVAL_TIMER_HPP
+#define INTERVAL_TIMER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <chrono>
+#include <cstdint>
+
+// A periodic CLOCK_MONOTONIC timerfd whose deadlines are absolute, so the
+// intervals do not drift by the time spent reading and rescanning, however
+// short the period.  The kernel counts the deadlines which pass while the
+// caller is busy, so an overrun shows up as a skipped interval instead of
+// silently stretching the next one.
+struct interval_timer {
+  explicit interval_timer(const std::chrono::nanoseconds period);
+  ~interval_timer();
+  interval_timer(const interval_timer &) = delete;
+  interval_timer &operator=(const interval_timer &) = delete;
+
+  // False if the kernel refused to create the timer, in which case wait()
+  // sleeps for one period instead.
+  bool available() const { return timer_fd >= 0; }
+  // Block until the next deadline.  Returns the number of deadlines which
+  // passed since the last call, which is more than one if the caller overran.
+  uint64_t wait();
+
+  const std::chrono::nanoseconds period;
+  int timer_fd;
+};
+
+// The current CLOCK_MONOTONIC time, for measuring how long counters actually
+// counted.
+std::chrono::nanoseconds monotonicNow();
+
+#endif // INTERVAL_TIMER_HPP
@@ -0,0 +1,38 @@
+#include "interval_timer.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <thread>
+
+using namespace std;
+
+constexpr std::chrono::milliseconds PERIOD = std::chrono::milliseconds(2);
+
+namespace local_testing {
+
+TEST(IntervalTimerTest, periodic) {
+  const std::chrono::nanoseconds start = monotonicNow();
+  interval_timer timer(PERIOD);
+  uint64_t expirations = 0U;
+  for (int i = 0; i < 5; i++) {
+    expirations += timer.wait();
+  }
+  // The deadlines are fixed at creation, so five of them take at least five
+  // periods however late each wait() returns.
+  EXPECT_GE(expirations, 5U);
+  EXPECT_GE(monotonicNow() - start, 5 * PERIOD);
+}
+
+TEST(IntervalTimerTest, overrun) {
+  interval_timer timer(PERIOD);
+  if (!timer.available()) {
+    GTEST_SKIP() << "timerfd is not available";
+  }
+  timer.wait();
+  std::this_thread::sleep_for(5 * PERIOD);
+  // The deadlines which passed during the sleep are reported at once.
+  EXPECT_GE(timer.wait(), 4U);
+}
+
+} // namespace local_testing
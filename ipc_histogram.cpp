@@ -0,0 +1,78 @@
+#include "ipc_histogram.hpp"
+
+#include <cmath>
+
+// Bucket b above the first 2 * HALF_BUCKETS holds the values whose top
+// SIGNIFICANT_BITS are b % HALF_BUCKETS + HALF_BUCKETS, shifted left by
+// b / HALF_BUCKETS - 1.
+uint64_t log_histogram::lowest(const size_t b) {
+  if (b < (2U * HALF_BUCKETS)) {
+    return b;
+  }
+  const uint32_t shift = (b / HALF_BUCKETS) - 1U;
+  return ((b % HALF_BUCKETS) + HALF_BUCKETS) << shift;
+}
+
+uint64_t log_histogram::highest(const size_t b) {
+  if (b < (2U * HALF_BUCKETS)) {
+    return b;
+  }
+  const uint32_t shift = (b / HALF_BUCKETS) - 1U;
+  return lowest(b) + ((1ULL << shift) - 1U);
+}
+
+void log_histogram::merge(const log_histogram &other) {
+  for (size_t b = 0U; b < BUCKETS; b++) {
+    counts[b] += other.counts[b];
+  }
+  total += other.total;
+  max = std::max(max, other.max);
+}
+
+void log_histogram::clear() {
+  counts = {};
+  total = 0U;
+  max = 0U;
+}
+
+uint64_t log_histogram::percentile(const double p) const {
+  if (0U == total) {
+    return 0U;
+  }
+  // The rank of the sample at the percentile, counting from 1.
+  const uint64_t rank = std::max<uint64_t>(
+      static_cast<uint64_t>(std::ceil((std::clamp(p, 0.0, 100.0) / 100.0) *
+                                      static_cast<double>(total))),
+      1U);
+  uint64_t seen = 0U;
+  for (size_t b = 0U; b < BUCKETS; b++) {
+    seen += counts[b];
+    if (seen >= rank) {
+      return std::min(highest(b), max);
+    }
+  }
+  return max;
+}
+
+void printIpcDistribution(const ipc_distribution &dist) {
+  if (0U == dist.ipc.total) {
+    return;
+  }
+  const double percentiles[] = {50.0, 90.0, 99.0};
+  std::cout << "Per-thread IPC over " << dist.ipc.total << " samples:";
+  for (const double p : percentiles) {
+    std::cout << " p" << p << " "
+              << static_cast<double>(dist.ipc.percentile(p)) / IPC_SCALE;
+  }
+  std::cout << " max " << static_cast<double>(dist.ipc.max) / IPC_SCALE
+            << std::endl;
+  std::cout << "Per-thread billion cycles per second:";
+  for (const double p : percentiles) {
+    std::cout << " p" << p << " "
+              << static_cast<double>(dist.cycle_rate.percentile(p)) /
+                     BILLION;
+  }
+  std::cout << " max "
+            << static_cast<double>(dist.cycle_rate.max) / BILLION
+            << std::endl;
+}
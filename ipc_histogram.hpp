@@ -0,0 +1,100 @@
+#ifndef IPC_HISTOGRAM_HPP
+#define IPC_HISTOGRAM_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// IPC is recorded in thousandths, since the histogram holds integers.
+constexpr uint64_t IPC_SCALE = 1000U;
+
+// A histogram of 64-bit values whose buckets grow with the value, as in
+// HdrHistogram: values below 2^SIGNIFICANT_BITS have a bucket each, and above
+// that each power of two is split into 2^(SIGNIFICANT_BITS - 1) buckets.  A
+// value's bucket is therefore at most 1/32 of the value wide, whatever its
+// magnitude, and the memory is fixed.  Recording is a few shifts and an
+// increment, and merging adds the bucket arrays.
+struct log_histogram {
+  static constexpr uint32_t SIGNIFICANT_BITS = 6U;
+  static constexpr uint64_t HALF_BUCKETS = 1ULL << (SIGNIFICANT_BITS - 1U);
+  static constexpr size_t BUCKETS =
+      (64U - SIGNIFICANT_BITS + 2U) * HALF_BUCKETS;
+
+  static size_t bucket(const uint64_t value) {
+    if (value < (2U * HALF_BUCKETS)) {
+      return value;
+    }
+    const uint32_t shift = 64U - __builtin_clzll(value) - SIGNIFICANT_BITS;
+    return (shift * HALF_BUCKETS) + (value >> shift);
+  }
+  // The lowest and the highest value which map to bucket b.
+  static uint64_t lowest(const size_t b);
+  static uint64_t highest(const size_t b);
+
+  void record(const uint64_t value, const uint64_t n = 1U) {
+    counts[bucket(value)] += n;
+    total += n;
+    max = std::max(max, value);
+  }
+  void merge(const log_histogram &other);
+  void clear();
+  // The highest value of the bucket which holds the pth percentile, which
+  // overstates the value by at most the bucket's width, but never more than
+  // the largest value recorded.  0 if the histogram is empty.
+  uint64_t percentile(const double p) const;
+
+  std::array<uint64_t, BUCKETS> counts{};
+  uint64_t total = 0U;
+  uint64_t max = 0U;
+};
+
+// The distributions of the per-thread IPC and cycles per second over any
+// number of intervals.  Each thread contributes one sample of each per
+// interval.
+struct ipc_distribution {
+  void merge(const ipc_distribution &other) {
+    ipc.merge(other.ipc);
+    cycle_rate.merge(other.cycle_rate);
+  }
+  void clear() {
+    ipc.clear();
+    cycle_rate.clear();
+  }
+
+  log_histogram ipc;
+  log_histogram cycle_rate;
+};
+
+// Record the table entries in [begin, end), so that shards can each record
+// their own range and merge the results.  As in worstIpcThreads(), threads
+// which ran for fewer than min_cycles are left out.  The table must count
+// cycles and instructions in the CYCLES and INSTRUCTIONS slots.
+template <class Table>
+void recordIpc(ipc_distribution &dist, const Table &counters,
+               const std::chrono::nanoseconds elapsed,
+               const uint64_t min_cycles, const size_t begin = 0U,
+               const size_t end = SIZE_MAX) {
+  const uint64_t ns = std::max<int64_t>(elapsed.count(), 1);
+  for (size_t i = begin; i < std::min(end, counters.size()); i++) {
+    const uint64_t cycles = counters.values[i][CYCLES];
+    if (cycles < std::max<uint64_t>(min_cycles, 1U)) {
+      continue;
+    }
+    dist.ipc.record((static_cast<unsigned __int128>(
+                         counters.values[i][INSTRUCTIONS]) *
+                     IPC_SCALE) /
+                    cycles);
+    dist.cycle_rate.record(
+        (static_cast<unsigned __int128>(scaleCount(cycles, counters.times[i])) *
+         BILLION) /
+        ns);
+  }
+}
+
+// p50, p90, p99 and the maximum of both distributions.
+void printIpcDistribution(const ipc_distribution &dist);
+
+#endif // IPC_HISTOGRAM_HPP
@@ -0,0 +1,130 @@
+#include "ipc_histogram.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <limits>
+#include <sstream>
+
+using namespace std;
+
+namespace local_testing {
+
+// What percentile() reports for a percentile which falls on value.
+uint64_t reported(const uint64_t value) {
+  return log_histogram::highest(log_histogram::bucket(value));
+}
+
+TEST(IpcHistogramSimpleTest, buckets) {
+  // Every value lies within its bucket, whose width is at most 1/32 of the
+  // value, and the buckets are in the order of the values.
+  size_t prev = 0U;
+  for (uint64_t value = 1U; value < (1ULL << 62); value += (value / 2U) + 1U) {
+    for (const uint64_t v : {value, value + 1U}) {
+      const size_t b = log_histogram::bucket(v);
+      ASSERT_LT(b, log_histogram::BUCKETS);
+      EXPECT_LE(log_histogram::lowest(b), v);
+      EXPECT_GE(log_histogram::highest(b), v);
+      EXPECT_LE(log_histogram::highest(b) - log_histogram::lowest(b), v / 32U);
+      EXPECT_GE(b, prev);
+      prev = b;
+    }
+  }
+  // The buckets tile the values without gaps.
+  for (size_t b = 1U; b < log_histogram::BUCKETS; b++) {
+    EXPECT_EQ(log_histogram::highest(b - 1U) + 1U, log_histogram::lowest(b));
+  }
+  EXPECT_EQ(log_histogram::BUCKETS - 1U,
+            log_histogram::bucket(std::numeric_limits<uint64_t>::max()));
+  EXPECT_EQ(std::numeric_limits<uint64_t>::max(),
+            log_histogram::highest(log_histogram::BUCKETS - 1U));
+}
+
+TEST(IpcHistogramSimpleTest, percentile) {
+  log_histogram hist{};
+  EXPECT_EQ(0U, hist.percentile(50.0));
+  for (uint64_t v = 1U; v <= 1000U; v++) {
+    hist.record(v);
+  }
+  EXPECT_EQ(1000U, hist.total);
+  EXPECT_EQ(1000U, hist.max);
+  EXPECT_NEAR(500.0, hist.percentile(50.0), 500.0 / 32.0);
+  EXPECT_NEAR(900.0, hist.percentile(90.0), 900.0 / 32.0);
+  EXPECT_NEAR(990.0, hist.percentile(99.0), 990.0 / 32.0);
+  EXPECT_EQ(1000U, hist.percentile(100.0));
+  EXPECT_EQ(1U, hist.percentile(0.0));
+  hist.clear();
+  EXPECT_EQ(0U, hist.total);
+  EXPECT_EQ(0U, hist.percentile(99.0));
+}
+
+TEST(IpcHistogramSimpleTest, bimodal) {
+  // The mean of these is 1, which no thread has.
+  log_histogram hist{};
+  hist.record(500U, 90U);
+  hist.record(5500U, 10U);
+  EXPECT_EQ(reported(500U), hist.percentile(50.0));
+  EXPECT_EQ(reported(500U), hist.percentile(90.0));
+  EXPECT_EQ(5500U, hist.percentile(99.0));
+}
+
+TEST(IpcHistogramSimpleTest, merge) {
+  log_histogram all{};
+  log_histogram even{};
+  log_histogram odd{};
+  for (uint64_t v = 0U; v < 100000U; v += 7U) {
+    all.record(v);
+    ((v % 2U) ? odd : even).record(v);
+  }
+  even.merge(odd);
+  EXPECT_EQ(all.counts, even.counts);
+  EXPECT_EQ(all.total, even.total);
+  EXPECT_EQ(all.max, even.max);
+}
+
+TEST(IpcHistogramSimpleTest, recordIpc) {
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  for (pid_t tid = 10; tid < 14; tid++) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {-1, -1};
+  }
+  insertCounters(counters, staged);
+  // IPCs of 2, 0.5 and 1.  The last thread barely ran.
+  counters.values = {{1000U, 2000U}, {4000U, 2000U}, {3000U, 3000U}, {5U, 1U}};
+  // The third thread was on the PMU half the time.
+  counters.times[2] = {200U, 100U};
+  ipc_distribution whole{};
+  recordIpc(whole, counters, std::chrono::microseconds(1), 100U);
+  EXPECT_EQ(3U, whole.ipc.total);
+  EXPECT_EQ(2000U, whole.ipc.max);
+  EXPECT_EQ(reported(1000U), whole.ipc.percentile(50.0));
+  EXPECT_EQ(reported(500U), whole.ipc.percentile(1.0));
+  // 6000 scaled cycles in a microsecond.
+  EXPECT_EQ(6000000000U, whole.cycle_rate.max);
+
+  // Two shards merge into the same distribution.
+  ipc_distribution sharded{};
+  ipc_distribution second{};
+  recordIpc(sharded, counters, std::chrono::microseconds(1), 100U, 0U, 2U);
+  recordIpc(second, counters, std::chrono::microseconds(1), 100U, 2U, 4U);
+  sharded.merge(second);
+  EXPECT_EQ(whole.ipc.counts, sharded.ipc.counts);
+  EXPECT_EQ(whole.cycle_rate.counts, sharded.cycle_rate.counts);
+}
+
+TEST(IpcHistogramSimpleTest, printIpcDistribution) {
+  ipc_distribution dist{};
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printIpcDistribution(dist);
+  EXPECT_EQ("", out.str());
+  dist.ipc.record(1500U);
+  dist.cycle_rate.record(2000000000U);
+  printIpcDistribution(dist);
+  cout.rdbuf(old_cout);
+  EXPECT_THAT(out.str(), testing::HasSubstr("p50 1.5 p90 1.5 p99 1.5 max 1.5"));
+  EXPECT_THAT(out.str(), testing::HasSubstr("max 2\n"));
+}
+
+} // namespace local_testing
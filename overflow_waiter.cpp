@@ -0,0 +1,129 @@
+#include "overflow_waiter.hpp"
+
+#include "interval_timer.hpp"
+
+#include <cstring>
+
+overflow_waiter::overflow_waiter() : epoll_fd(-1), events{}, nready(0) {
+  errno = 0;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    std::cerr << "epoll unavailable: " << strerror(errno) << std::endl;
+  }
+}
+
+overflow_waiter::~overflow_waiter() {
+  if (epoll_fd >= 0) {
+    close(epoll_fd);
+  }
+}
+
+bool overflow_waiter::add(const int fd) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    std::cerr << "Failed to watch fd " << fd << " " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// perf clears an event's readiness when it is polled, so the ready events
+// need not be read.  A signal ends the wait early, as an overflow would.  The
+// event of a thread which exited reports EPOLLHUP for as long as it is
+// watched, so it is dropped rather than returned, and the wait goes on.
+bool overflow_waiter::wait(const std::chrono::nanoseconds timeout) {
+  const std::chrono::nanoseconds deadline = monotonicNow() + timeout;
+  nready = 0;
+  while (0 == nready) {
+    const std::chrono::nanoseconds left = deadline - monotonicNow();
+    const int ms = static_cast<int>(std::max<int64_t>(
+        std::chrono::ceil<std::chrono::milliseconds>(left).count(), 0));
+    errno = 0;
+    nready = epoll_wait(epoll_fd, events.data(), events.size(), ms);
+    if (nready < 0) {
+      if (EINTR != errno) {
+        std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+      }
+      return true;
+    }
+    if (0 == nready) {
+      return false;
+    }
+    int kept = 0;
+    for (int i = 0; i < nready; i++) {
+      if ((events[i].events & (EPOLLHUP | EPOLLERR)) &&
+          !(events[i].events & EPOLLIN)) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, events[i].data.fd, nullptr);
+      } else {
+        events[kept++] = events[i];
+      }
+    }
+    nready = kept;
+    if ((0 == nready) && (0 == ms)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool overflow_waiter::ready(const int fd) const {
+  for (int i = 0; i < nready; i++) {
+    if (events[i].data.fd == fd) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The kernel writes records at data_head and the reader releases them by
+// advancing data_tail.  Records are 8-byte aligned, so neither a header nor
+// any other u64 field wraps, but the fields after the header may lie at the
+// start of the ring.
+uint64_t drainRing(const struct perf_ring &ring) {
+  if (nullptr == ring.page) {
+    return 0U;
+  }
+  struct perf_event_mmap_page *meta = ring.page;
+  const uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = meta->data_tail;
+  const uint64_t data_offset =
+      meta->data_offset ? meta->data_offset : sysconf(_SC_PAGESIZE);
+  const uint64_t data_size =
+      meta->data_size ? meta->data_size : (ring.size - data_offset);
+  const char *data = reinterpret_cast<const char *>(meta) + data_offset;
+  uint64_t overflows = 0U;
+  while (tail < head) {
+    struct perf_event_header header;
+    memcpy(&header, data + (tail % data_size), sizeof(header));
+    if (0U == header.size) {
+      break;
+    }
+    if (PERF_RECORD_SAMPLE == header.type) {
+      overflows++;
+    } else if (PERF_RECORD_LOST == header.type) {
+      // struct { header; u64 id; u64 lost; }
+      uint64_t lost = 0U;
+      memcpy(&lost,
+             data + ((tail + sizeof(header) + sizeof(uint64_t)) % data_size),
+             sizeof(lost));
+      overflows += lost;
+    }
+    tail += header.size;
+  }
+  __atomic_store_n(&meta->data_tail, head, __ATOMIC_RELEASE);
+  return overflows;
+}
+
+void printOverflows(const uint64_t overflows, const uint64_t sample_period,
+                    const std::chrono::nanoseconds elapsed) {
+  if (0U == overflows) {
+    return;
+  }
+  const double ms = std::chrono::duration<double, std::milli>(elapsed).count();
+  std::cout << overflows << " periods of " << sample_period << " in " << ms
+            << " ms, " << (ms / overflows) << " ms per period" << std::endl;
+}
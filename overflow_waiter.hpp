@@ -0,0 +1,78 @@
+#ifndef OVERFLOW_WAITER_HPP
+#define OVERFLOW_WAITER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <sys/epoll.h>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Sleeps in epoll_wait() on the sampled events of a table until one of them
+// overflows, so that the caller wakes after a fixed amount of work by some
+// thread rather than after a fixed time.  An idle target costs nothing
+// between the overflows.
+struct overflow_waiter {
+  overflow_waiter();
+  ~overflow_waiter();
+  overflow_waiter(const overflow_waiter &) = delete;
+  overflow_waiter &operator=(const overflow_waiter &) = delete;
+
+  bool available() const { return epoll_fd >= 0; }
+  // Wake when fd is readable.  The registration lasts until the last
+  // reference to fd's file, including any mapping of it, is gone.
+  bool add(const int fd);
+  // Block until a watched fd is readable or timeout passes.  Returns false on
+  // a timeout.
+  bool wait(const std::chrono::nanoseconds timeout);
+  // Whether fd was among the readable fds when the last wait() returned.
+  bool ready(const int fd) const;
+
+  int epoll_fd;
+  std::array<struct epoll_event, 64> events;
+  int nready;
+};
+
+// Count the overflow records in ring and consume them, along with any other
+// records, so that the kernel can reuse the space.  The overflows whose
+// records were lost because the ring was full count as well.
+uint64_t drainRing(const struct perf_ring &ring);
+
+// Map the ring buffer of the sampled event of every group which does not
+// have one yet, with the table's sampling.ring_pages, and watch it.
+// closeCounterFds() unmaps the ring, which also ends the watch.
+template <class Table>
+void watchOverflows(overflow_waiter &waiter, Table &counters) {
+  if (0U == counters.sampling.period) {
+    return;
+  }
+  for (size_t i = 0U; i < counters.size(); i++) {
+    const int fd = counters.group_fds[i][counters.sampling.slot];
+    if ((nullptr != counters.rings[i].page) || (fd <= STDERR_FILENO)) {
+      continue;
+    }
+    counters.rings[i] = mapRing(fd, counters.sampling.ring_pages);
+    if (nullptr != counters.rings[i].page) {
+      waiter.add(fd);
+    }
+  }
+}
+
+// The number of times the sampled events of the table overflowed since the
+// last call.
+template <class Table> uint64_t drainOverflows(const Table &counters) {
+  uint64_t overflows = 0U;
+  for (const struct perf_ring &ring : counters.rings) {
+    overflows += drainRing(ring);
+  }
+  return overflows;
+}
+
+// How long the work of one sample period took, given that the sampled events
+// overflowed overflows times in elapsed.
+void printOverflows(const uint64_t overflows, const uint64_t sample_period,
+                    const std::chrono::nanoseconds elapsed);
+
+#endif // OVERFLOW_WAITER_HPP
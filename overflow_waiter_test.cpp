@@ -0,0 +1,106 @@
+#include "overflow_waiter.hpp"
+
+#include "fake_ring.hpp"
+#include "interval_timer.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace local_testing {
+
+struct OverflowWaiterTest : public FakeRingTest {};
+
+TEST_F(OverflowWaiterTest, drainRing) {
+  writeRecord(PERF_RECORD_SAMPLE, 8U);
+  writeLost(5U);
+  writeRecord(PERF_RECORD_SAMPLE, 8U);
+  publish();
+  EXPECT_EQ(2U + 5U, drainRing(ring));
+  EXPECT_EQ(40U, ring.page->data_tail);
+  // Nothing new.
+  EXPECT_EQ(0U, drainRing(ring));
+
+  // Records continue at the start of the page once they reach its end.
+  seek(3U * page_size - 8U);
+  writeRecord(PERF_RECORD_SAMPLE, 8U);
+  writeRecord(PERF_RECORD_SAMPLE, 8U);
+  writeRecord(PERF_RECORD_THROTTLE, 24U);
+  publish();
+  EXPECT_EQ(2U, drainRing(ring));
+  EXPECT_EQ(head, ring.page->data_tail);
+  // So do the fields after a header.
+  seek(5U * page_size - 16U);
+  writeLost(4U);
+  publish();
+  EXPECT_EQ(4U, drainRing(ring));
+
+  EXPECT_EQ(0U, drainRing(perf_ring{nullptr, 0U}));
+}
+
+TEST_F(OverflowWaiterTest, drainOverflows) {
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  for (const pid_t tid : {10, 20}) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {-1, -1};
+  }
+  insertCounters(counters, staged);
+  // Groups which failed to open have no ring.
+  counters.sampling.period = 1000U;
+  overflow_waiter waiter{};
+  watchOverflows(waiter, counters);
+  EXPECT_EQ(nullptr, counters.rings[0].page);
+
+  counters.rings[1] = ring;
+  writeRecord(PERF_RECORD_SAMPLE, 8U);
+  publish();
+  EXPECT_EQ(1U, drainOverflows(counters));
+  EXPECT_EQ(0U, drainOverflows(counters));
+  // The ring is not a real mapping.
+  counters.rings[1] = {};
+}
+
+TEST(OverflowWaiterSimpleTest, wait) {
+  overflow_waiter waiter{};
+  ASSERT_TRUE(waiter.available());
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_TRUE(waiter.add(fds[0]));
+  EXPECT_FALSE(waiter.wait(std::chrono::milliseconds(10)));
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  EXPECT_TRUE(waiter.wait(std::chrono::seconds(10)));
+  EXPECT_TRUE(waiter.ready(fds[0]));
+  EXPECT_FALSE(waiter.ready(fds[1]));
+  char byte = 0;
+  EXPECT_EQ(1, read(fds[0], &byte, 1));
+
+  // A hung-up fd is dropped instead of waking every wait at once.
+  close(fds[1]);
+  const std::chrono::nanoseconds start = monotonicNow();
+  EXPECT_FALSE(waiter.wait(std::chrono::milliseconds(20)));
+  EXPECT_FALSE(waiter.wait(std::chrono::milliseconds(20)));
+  EXPECT_GE(monotonicNow() - start, std::chrono::milliseconds(20));
+  EXPECT_FALSE(waiter.ready(fds[0]));
+  close(fds[0]);
+
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  EXPECT_FALSE(waiter.add(-1));
+  cerr.rdbuf(old_cerr);
+  EXPECT_THAT(errors.str(), testing::HasSubstr("Failed to watch fd -1"));
+}
+
+TEST(OverflowWaiterSimpleTest, printOverflows) {
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printOverflows(0U, 1000U, std::chrono::milliseconds(10));
+  printOverflows(4U, 1000U, std::chrono::milliseconds(10));
+  cout.rdbuf(old_cout);
+  EXPECT_EQ("4 periods of 1000 in 10 ms, 2.5 ms per period\n", out.str());
+}
+
+} // namespace local_testing
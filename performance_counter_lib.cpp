@@ -1,40 +1,65 @@
 #include "performance_counter_lib.hpp"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <cstddef>
 #include <cstring>
+#include <fstream>
 
-constexpr uint32_t BILLION = 1e9;
+void closeCounterFd(const int fd) {
+  if (fd > STDERR_FILENO) {
+    // std::cout << "closing fd " << filedescriptor << std::endl;
+    // events, and performance counters as a  whole, are nothing but
+    // file descriptors,  so we can simply close them to get rid of
+    // counters
+    errno = 0;
+    int res = close(fd);
+    if (res) {
+      std::cerr << "Error closing fd " << fd << " " << strerror(errno)
+                << std::endl;
+    }
+  }
+}
 
-namespace {
-std::pair<bool, uint64_t> safe_strtoul(const std::string &str) {
-  std::pair<bool, uint64_t> retval;
-  errno = 0;
-  retval.second = strtoul(str.c_str(), NULL, 10);
-  if (errno) {
-    retval.first = false;
-    return retval;
+// Only the first page is needed: it holds the index and offset which the rdpmc
+// read path uses.  The ring buffer pages which follow it are needed only for
+// sampling.
+struct perf_event_mmap_page *mapCounterPage(const int fd) {
+  void *page = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd,
+                    0);
+  if (MAP_FAILED == page) {
+    std::cerr << "Failed to map counter page for fd " << fd << " "
+              << strerror(errno) << std::endl;
+    return nullptr;
   }
-  retval.first = true;
-  return retval;
+  return static_cast<struct perf_event_mmap_page *>(page);
 }
 
-void close_counter_fds(const std::array<int, 2u> &fds) {
-  for (const int fd : fds) {
-    if (fd > STDERR_FILENO) {
-      // std::cout << "closing fd " << filedescriptor << std::endl;
-      // events, and performance counters as a  whole, are nothing but
-      // file descriptors,  so we can simply close them to get rid of
-      // counters
-      errno = 0;
-      int res = close(fd);
-      if (res) {
-        std::cerr << "Error closing fd " << fd << " " << strerror(errno)
-                  << std::endl;
-      }
-    }
+void unmapCounterPage(struct perf_event_mmap_page *page) {
+  if (nullptr != page) {
+    munmap(page, sysconf(_SC_PAGESIZE));
   }
 }
 
-} // namespace
+// mmap() fails unless the data pages are a power of two.
+struct perf_ring mapRing(const int fd, const size_t data_pages) {
+  const size_t size = (data_pages + 1U) * sysconf(_SC_PAGESIZE);
+  void *page = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == page) {
+    std::cerr << "Failed to map ring buffer for fd " << fd << " "
+              << strerror(errno) << std::endl;
+    return {nullptr, 0U};
+  }
+  return {static_cast<struct perf_event_mmap_page *>(page), size};
+}
+
+void unmapRing(const struct perf_ring &ring) {
+  if (nullptr != ring.page) {
+    munmap(ring.page, ring.size);
+  }
+}
 
 std::string lookupErrorMessage(const int errnum) {
   switch (errnum) {
@@ -70,62 +95,170 @@ std::string lookupErrorMessage(const int errnum) {
   }
 }
 
+task_enumerator::task_enumerator(const size_t bufsize) : buf(bufsize) {}
+
+// Each record getdents64() returns is a struct linux_dirent64, whose layout
+// glibc's struct dirent64 matches.
+bool task_enumerator::enumerate(const std::string &proc_path, const pid_t pid,
+                                std::vector<pid_t> &tids) {
+  tids.clear();
+  char task_path[PATH_MAX];
+  int pathlen = snprintf(task_path, sizeof(task_path), "%s%d/task",
+                         proc_path.c_str(), pid);
+  if ((pathlen < 0) || (static_cast<size_t>(pathlen) >= sizeof(task_path))) {
+    return false;
+  }
+  int fd = open(task_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  long nread;
+  while ((nread = syscall(SYS_getdents64, fd, buf.data(), buf.size())) > 0) {
+    for (long pos = 0; pos < nread;) {
+      const char *dirent = buf.data() + pos;
+      unsigned short reclen;
+      memcpy(&reclen, dirent + offsetof(struct dirent64, d_reclen),
+             sizeof(reclen));
+      const char *name = dirent + offsetof(struct dirent64, d_name);
+      // Parse the name in place.  "." and "..", the only non-numeric entries
+      // in a task directory, are skipped.
+      pid_t tid = 0;
+      bool numeric = ('\0' != *name);
+      for (const char *c = name; numeric && ('\0' != *c); c++) {
+        numeric = (*c >= '0') && (*c <= '9');
+        tid = (tid * 10) + (*c - '0');
+      }
+      if (numeric) {
+        tids.push_back(tid);
+      }
+      pos += reclen;
+    }
+  }
+  if (nread < 0) {
+    std::cerr << "Failed to read " << task_path << " " << strerror(errno)
+              << std::endl;
+  }
+  close(fd);
+  // procfs usually lists tasks in ascending order already.
+  if (!std::is_sorted(tids.begin(), tids.end())) {
+    std::sort(tids.begin(), tids.end());
+  }
+  return (nread >= 0);
+}
+
 std::set<pid_t> getProcessChildPids(const std::string &proc_path,
                                     const pid_t pid) {
-  std::set<pid_t> pids{};
-  const fs::path task_path{proc_path + std::to_string(pid) + "/task"};
-  if (!fs::exists(task_path)) {
+  static thread_local task_enumerator enumerator{};
+  static thread_local std::vector<pid_t> tids{};
+  if (!enumerator.enumerate(proc_path, pid, tids)) {
     std::cout << "No such PID " << pid
               << std::endl; // we need better error handling here, but this
                             // works fine for a demo
-  } else {
-    std::regex re(proc_path + "\\d+/task/", std::regex_constants::optimize);
-    for (const auto &dir :
-         fs::directory_iterator{proc_path + std::to_string(pid) + "/task"}) {
-      // the full value of dir.path().string() looks like
-      // /proc/the_PID/task/some_number. Remove /proc/the_PID/task/ to yield
-      // just the number of the child PID, then add it to our list of the found
-      // child(ren)
-      std::string pidstr = std::regex_replace(dir.path().string(), re, "");
-      std::pair<bool, uint64_t> res = safe_strtoul(pidstr);
-      if (!res.first) {
-        std::cerr << "Failed numeric conversion of " << dir.path().string()
-                  << " with " << strerror(errno) << std::endl;
-        exit(EXIT_FAILURE);
-      }
-      pids.emplace(res.second);
-    }
+    return std::set<pid_t>{};
+  }
+  // The input is sorted, so every insertion is at the end.
+  std::set<pid_t> pids{};
+  for (const pid_t tid : tids) {
+    pids.emplace_hint(pids.end(), tid);
   }
   return pids;
 }
 
-// The only user of the second event group_fd is the ioctl that associates the
-// second event with the group created when the first event was enabled.
-void setupEvent(struct pcounter &s, uint32_t event_num, int group_fd) {
-  // pid > 0 and cpu == -1 measures the specified process/thread on any CPU.
-  s.group_fd[event_num] = syscall(SYS_perf_event_open, &s.perfstruct[event_num],
-                                  s.pid, -1, group_fd, 0);
-  // std::cout << "fd = " << fd << std::endl;
-  if (s.group_fd[event_num] > STDERR_FILENO) {
-    //  PERF_EVENT_IOC_ID returns the event ID value for the given event file
-    //  descriptor.
-    // The argument is a pointer to a 64-bit unsigned integer to hold the
-    // result.
-    ioctl(s.group_fd[event_num], PERF_EVENT_IOC_ID, &s.event_id[event_num]);
-  } else {
-    std::cout << lookupErrorMessage(errno) << std::endl;
+namespace {
+// The file holds a list of ranges like "0-3,6,8-11".
+std::set<int> readCpuList(const std::string &path) {
+  std::set<int> cpus{};
+  std::ifstream list{path};
+  std::string range;
+  while (std::getline(list, range, ',')) {
+    int first = 0;
+    int last = 0;
+    int matched = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (matched < 1) {
+      std::cerr << "Failed to parse " << path << std::endl;
+      return std::set<int>{};
+    }
+    if (1 == matched) {
+      last = first;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.emplace(cpu);
+    }
+  }
+  return cpus;
+}
+} // namespace
+
+std::set<int> getOnlineCpus(const std::string &sys_path) {
+  return readCpuList(sys_path + "devices/system/cpu/online");
+}
+
+// Uncore and software PMUs have a cpumask file, if any, rather than cpus.
+std::vector<struct core_pmu> getCorePmus(const std::string &sys_path) {
+  std::vector<struct core_pmu> pmus{};
+  std::error_code ec{};
+  for (const fs::directory_entry &device : fs::directory_iterator(
+           sys_path + "bus/event_source/devices", ec)) {
+    const fs::path cpus_path = device.path() / "cpus";
+    if (!fs::exists(cpus_path, ec)) {
+      continue;
+    }
+    std::ifstream type_file{device.path() / "type"};
+    uint32_t type = 0U;
+    if (!(type_file >> type)) {
+      std::cerr << "Failed to read the type of PMU " << device.path()
+                << std::endl;
+      continue;
+    }
+    pmus.push_back(
+        {device.path().filename().string(), type, readCpuList(cpus_path)});
+  }
+  if (pmus.size() < 2U) {
+    return std::vector<struct core_pmu>{};
   }
+  std::sort(pmus.begin(), pmus.end(),
+            [](const struct core_pmu &a, const struct core_pmu &b) {
+              return a.name < b.name;
+            });
+  return pmus;
+}
+
+uint32_t corePmuType(const std::vector<struct core_pmu> &pmus, const int cpu) {
+  for (const struct core_pmu &pmu : pmus) {
+    if (pmu.cpus.count(cpu)) {
+      return pmu.type;
+    }
+  }
+  return 0U;
+}
+
+int openCgroup(const std::string &cgroup_path) {
+  errno = 0;
+  int fd = open(cgroup_path.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    std::cerr << "Failed to open cgroup " << cgroup_path << " "
+              << strerror(errno) << std::endl;
+  }
+  return fd;
 }
 
 // these are common settings for each event.
 // Changing a setting here will apply everywhere
+// Generic hardware and cache events name their PMU in the upper half of the
+// config, and raw events take the PMU's own type.
 void configureStruct(struct perf_event_attr &st, const perf_type_id perftype,
-                     const perf_hw_id config) {
+                     const uint64_t config, const bool inherit,
+                     const uint32_t pmu_type) {
   memset(&(st), 0,
          sizeof(struct perf_event_attr)); // fill the struct with 0s
   st.type = perftype;                     // the type of event
   st.size = sizeof(struct perf_event_attr);
   st.config = config; // the event we want to measure
+  if (pmu_type && (PERF_TYPE_RAW == perftype)) {
+    st.type = pmu_type;
+  } else if (pmu_type && pmuRetargetable(perftype)) {
+    st.config |= static_cast<uint64_t>(pmu_type) << PERF_PMU_TYPE_SHIFT;
+  }
   st.disabled = true; // start disabled by default to not count, and skip
                       // extra syscalls to disable upon creation
   /* Specifies the format of the data returned by read(2) on a perf_event_open()
@@ -135,176 +268,87 @@ void configureStruct(struct perf_event_attr &st, const perf_type_id perftype,
   st.read_format =
       PERF_FORMAT_GROUP |
       PERF_FORMAT_ID; // format the result in our all-in-one data struct
+  // The times show whether the kernel had to multiplex the group, and by how
+  // much to scale its counts if so.
+  st.read_format |=
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  // Count new child tasks as well, if the rest of the settings permit it.
+  st.inherit = inherit && inheritSupported(st);
 }
 
-void setupCounter(struct pcounter &s) {
-  // std::cout << "setting up counters for pid " << s.pid << std::endl;
-  errno = 0;
-  // PERF_COUNT_HW_CPU_CYCLES works on Intel and AMD (and wherever else this
-  // event is supported) but could be inaccurate. PERF_COUNT_HW_REF_CPU_CYCLES
-  // only works on Intel (unsure? needs more testing) but is more accurate
-  configureStruct(s.perfstruct[CYCLES], PERF_TYPE_HARDWARE,
-                  PERF_COUNT_HW_CPU_CYCLES);
-  // Create the event group with s.group_fd[CYCLES] and associate the CYCLES
-  // event_id with it.
-  setupEvent(s, CYCLES, -1);
-  configureStruct(s.perfstruct[INSTRUCTIONS], PERF_TYPE_HARDWARE,
-                  PERF_COUNT_HW_INSTRUCTIONS);
-  // Associate the event_id for the INSTRUCTIONS event with the group_fd created
-  // for the CYCLES event.
-  setupEvent(s, INSTRUCTIONS, s.group_fd[CYCLES]);
+void configureEvent(struct perf_event_attr &st, const struct event_config &ev,
+                    const bool inherit, const uint32_t pmu_type) {
+  configureStruct(st, static_cast<perf_type_id>(ev.type), ev.config, inherit,
+                  pmu_type);
+  st.config1 = ev.config1;
+  st.config2 = ev.config2;
 }
 
-void createCounters(std::map<pid_t, struct pcounter> &counters,
-                    const std::set<pid_t> &pids) {
-  for (const auto &pid : pids) {
-    struct pcounter newpc(pid);
-    setupCounter(newpc);
-    counters.insert(std::pair<pid_t, struct pcounter>{pid, newpc});
-    // std::cout << "creating counter for pid " << counters.back()->pid <<
-    // std::endl;
-  }
-}
-
-void cullCounters(std::map<pid_t, struct pcounter> &counters,
-                  const std::set<pid_t> &pids) {
-  for (const auto culledpid : pids) {
-    for (auto it = counters.begin(); it != counters.end(); it++) {
-      // First element is the key, which is the PID.
-      if (it->first == culledpid) {
-        // Second element is the pcounter associated with the PID.
-        close_counter_fds(it->second.group_fd);
-        // std::cout << "culling counter for pid " << counter.pid << std::endl;
-        counters.erase(it);
-        // A given PID can occur only once in a std::map or std::set, so exit
-        // the loop.
-        break;
-      }
-    }
-  }
-}
-
-void resetAndEnableCounters(const std::map<pid_t, struct pcounter> &counters) {
-  for (auto &counter : counters) {
-    // Second element is the pcounter associated with the PID.
-    for (const auto &group : counter.second.group_fd) {
-      // reset the counters for ALL the events that are members of the group
-      ioctl(group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
-      // enable all the events that are members of the group
-      ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
-    }
+void configureSampling(struct perf_event_attr &st,
+                       const struct sampling_spec &spec) {
+  st.sample_period = spec.period;
+  st.sample_type = spec.period ? spec.type : 0U;
+  if (spec.period && spec.watermark) {
+    st.watermark = 1U;
+    st.wakeup_watermark = spec.watermark;
+  } else {
+    st.watermark = 0U;
+    st.wakeup_events = spec.period ? 1U : 0U;
   }
+  st.inherit = st.inherit && inheritSupported(st);
 }
 
-void disableCounters(const std::map<pid_t, struct pcounter> &counters) {
-  for (auto &counter : counters) {
-    // Second element is the pcounter associated with the PID.
-    for (const auto &group : counter.second.group_fd) {
-      // disable all counters in the groups
-      ioctl(group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
-    }
-  }
+// the frontend
+// in real programs, this section should be in the calling thread
+// we only access our frontend variables here, as everything having to do
+// with counters is abstracted away elsewhere
+void printRate(const uint64_t count, const std::string &name,
+               const std::chrono::nanoseconds elapsed) {
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  std::cout << "Got " << static_cast<uint64_t>(count / seconds) << " ("
+            << (count / seconds) / BILLION << " billion) " << name
+            << " per second" << std::endl;
 }
 
-void readCounters(std::map<pid_t, struct pcounter> &counters) {
-  for (auto &counter : counters) {
-    // checks if this fd is "good." If  it's an unused file descriptor, then
-    // Linux will deallocate memory for cin instead which leads to segmentation
-    // faults (borrow checkers can't prevent  this because it happens in the
-    // kernel)
-    if (counter.second.group_fd[CYCLES] > STDERR_FILENO) {
-      errno = 0;
-      // The second event's counts are available via the group to which it and
-      // the first event belong.   It's not obvious that a read to the second
-      // event's group_fd will even succeeed.
-      ssize_t size =
-          read(counter.second.group_fd[CYCLES], counter.second.event_data.buf,
-               sizeof(counter.second.event_data.buf));
-      //  If false, reading could give us false counter values.
-      if (size == COUNTER_READSIZE) {
-        for (int i = 0; i < static_cast<int>(
-                                counter.second.event_data.per_event_values.nr);
-             i++) {
-          //  Match the cycle count for an event with its instruction count.
-          if (counter.second.event_data.per_event_values.values[i].id ==
-              counter.second.event_id[CYCLES]) {
-            counter.second.event_value[CYCLES] =
-                counter.second.event_data.per_event_values.values[i].value;
-          } else if (counter.second.event_data.per_event_values.values[i].id ==
-                     counter.second.event_id[INSTRUCTIONS]) {
-            counter.second.event_value[INSTRUCTIONS] =
-                counter.second.event_data.per_event_values.values[i].value;
-          }
-        }
-      } else {
-        if (errno) {
-          std::cerr << strerror(errno) << " " << counter.second.group_fd[CYCLES]
-                    << std::endl;
-        } else {
-          std::cerr << "Insufficient data " << size << " bytes for group "
-                    << counter.second.group_fd[CYCLES] << std::endl;
-        }
-      }
-    } else {
-      std::cerr << "Bad file descriptor for task " << counter.second.pid
-                << std::endl;
-    }
+// Scaled estimates are flagged, since they are only as good as the
+// assumption that the workload did not change while the group was off the PMU.
+void printConfidence(const double confidence) {
+  if (confidence < 1.0) {
+    std::cout << "Counted " << confidence * 100.0
+              << "% of the time; values are scaled estimates" << std::endl;
   }
 }
 
-// Why not simply create a new map container for the new task list and ignore
-// the exited tasks? Two reasons:
-// clang-format off
-// 0. The list of exited tasks is needed to close their file descriptors.
-// 1. Creating new counters involves a fair amount of overhead, so destroying
-//    and then recreating counters for ongoing tasks would be wasteful.
-// clang-format on
-void getPidDelta(const std::string &proc_path, const pid_t pid,
-                 std::map<pid_t, struct pcounter> &MyCounters,
-                 std::set<pid_t> &currentPids) {
-  std::set<pid_t> diffPids{};
-
-  // Reread the child tasks of the provided parent PID from procfs.
-  std::set<pid_t> newPids = getProcessChildPids(proc_path, pid);
-
-  // Find PIDs of newly running tasks.
-  std::set_difference(newPids.begin(), newPids.end(), currentPids.begin(),
-                      currentPids.end(),
-                      std::inserter(diffPids, diffPids.begin()));
-  // Create new counters for tasks which started since last iteration.
-  createCounters(MyCounters, diffPids);
-  diffPids.clear();
-
-  // Find PIDs of tasks which exited since last iteration.
-  std::set_difference(currentPids.begin(), currentPids.end(), newPids.begin(),
-                      newPids.end(), std::inserter(diffPids, diffPids.begin()));
-
-  // Close file descriptors associated with tasks that have exited and remove
-  // their counters from the map.
-  cullCounters(MyCounters, diffPids);
-  currentPids = std::move(newPids);
-}
-
-// the frontend
-// in real programs, this section should be in the calling thread
-// we only access our frontend variables here, as everything having to do
-// with counters is abstracted away elsewhere
-void printResults(const uint64_t cycles, const uint64_t instructions) {
-  if (!cycles) {
+void printResults(const uint64_t cycles, const uint64_t instructions,
+                  const std::chrono::nanoseconds elapsed,
+                  const double confidence) {
+  // An empty interval has no rates.
+  if (!cycles || (elapsed.count() <= 0)) {
     return;
   }
+  // divide our data variables by the measured time to get per-second
+  // measurements, rather than by the requested interval, which the loop
+  // never hits exactly
   std::cout << "----------------------------------------------------"
             << std::endl;
-  std::cout << "Got " << cycles / SLEEPCOUNT << " ("
-            << (float)(cycles / SLEEPCOUNT) / BILLION
-            << " billion) cycles per second"
-            << std::endl; // divide our data variables by the sleep time to
-                          // get per-second measurements (you could make this
-                          // a constexpr variable or a macro)
-  std::cout << "Got " << instructions / SLEEPCOUNT << " ("
-            << (float)(instructions / SLEEPCOUNT) / BILLION
-            << " billion) instructions per second" << std::endl;
+  printRate(cycles, "cycles", elapsed);
+  printRate(instructions, "instructions", elapsed);
   std::cout << "IPC: " << (float)instructions / (float)cycles
             << std::endl; // footgun: never forget to convert to float (or
                           // double) when dividing to get a result with decimals
+  printConfidence(confidence);
+}
+
+void printBranchResults(const uint64_t branches, const uint64_t misses,
+                        const std::chrono::nanoseconds elapsed,
+                        const double confidence) {
+  if (!branches || (elapsed.count() <= 0)) {
+    return;
+  }
+  std::cout << "----------------------------------------------------"
+            << std::endl;
+  printRate(branches, "branches", elapsed);
+  std::cout << "Branch miss rate: " << (float)misses / (float)branches
+            << std::endl;
+  printConfidence(confidence);
 }
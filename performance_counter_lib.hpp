@@ -1,29 +1,78 @@
+#ifndef PERFORMANCE_COUNTER_LIB_HPP
+#define PERFORMANCE_COUNTER_LIB_HPP
+
 #include <linux/hw_breakpoint.h> //defines several necessary macros
 #include <linux/perf_event.h>    //defines performance counter events
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h> //defines the rlimit struct and getrlimit
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
-#include <map>
-#include <regex>
 #include <set>
 #include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 
+// The default interval between reads.
 constexpr std::chrono::seconds SLEEPTIME = std::chrono::seconds(5);
-constexpr uint64_t SLEEPCOUNT = std::chrono::seconds(5).count();
 
-// The two kinds of perf events that are observed.
+// Where the config of a generic event names the core PMU which should count
+// it, for kernels whose headers predate hybrid support.
+#ifndef PERF_PMU_TYPE_SHIFT
+#define PERF_PMU_TYPE_SHIFT 32
+#endif
+
+constexpr uint32_t BILLION = 1e9;
+
+// Slots of the events in the default cycles/instructions group.
 constexpr uint32_t CYCLES = 0U;
 constexpr uint32_t INSTRUCTIONS = 1U;
-constexpr uint32_t OBSERVED_EVENTS = 2U;
-constexpr uint32_t COUNTER_READSIZE = OBSERVED_EVENTS * 16U + 8U;
+
+// An observed event.  The perf type and config are template parameters so that
+// the layout of a counter group, and the calls which set it up, are fixed at
+// compile time.
+template <perf_type_id Type, uint64_t Config> struct event_spec {
+  static constexpr perf_type_id type = Type;
+  static constexpr uint64_t config = Config;
+};
+
+// An event chosen at run time rather than by a template argument, in the
+// terms of perf_event_attr.  See event_table.
+struct event_config {
+  uint32_t type;
+  uint64_t config;
+  uint64_t config1;
+  uint64_t config2;
+};
+
+// PERF_COUNT_HW_CPU_CYCLES works on Intel and AMD (and wherever else this
+// event is supported) but could be inaccurate. PERF_COUNT_HW_REF_CPU_CYCLES
+// only works on Intel (unsure? needs more testing) but is more accurate
+using cycles_event = event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES>;
+using instructions_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS>;
+using cache_references_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES>;
+using cache_misses_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES>;
+using branch_instructions_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS>;
+using branch_misses_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES>;
+using stalled_cycles_frontend_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND>;
+using stalled_cycles_backend_event =
+    event_spec<PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND>;
 
 /*
   From "man perf_event_open:"
@@ -32,67 +81,791 @@ constexpr uint32_t COUNTER_READSIZE = OBSERVED_EVENTS * 16U + 8U;
          group at once:
              struct read_format {
                  u64 nr;             The number of events
+                 u64 time_enabled;   if PERF_FORMAT_TOTAL_TIME_ENABLED
+                 u64 time_running;   if PERF_FORMAT_TOTAL_TIME_RUNNING
                  struct {
                      u64 value;      The value of the event
                      u64 id;         if PERF_FORMAT_ID
                  } values[nr];
              };
 */
-struct read_format {
-  read_format() {}
+template <uint32_t N> struct read_format {
+  read_format() : nr(0U), time_enabled(0U), time_running(0U), values{} {}
 
   // nr     The number of events in this file descriptor.
   uint64_t nr;
+  // time_enabled, time_running  How long the group was enabled and how long
+  // it was actually on the PMU.  They differ when the kernel multiplexes
+  // more events than there are hardware counters.
+  uint64_t time_enabled;
+  uint64_t time_running;
   struct {
     // value  An unsigned 64-bit value containing the counter result.
     uint64_t value;
     // id     A globally unique value for this particular event
     uint64_t id;
-  } values[OBSERVED_EVENTS];
+  } values[N];
+};
+
+// The nanoseconds for which a group was enabled and running.  Both are zero if
+// they are unknown, in which case the counts are taken as they are.
+struct group_times {
+  uint64_t enabled;
+  uint64_t running;
 };
 
+// The mapping of an event's metadata page followed by its ring buffer of
+// samples, which is size bytes long.  page is nullptr if nothing is mapped.
+struct perf_ring {
+  struct perf_event_mmap_page *page;
+  size_t size;
+};
+
+// How one event of each group samples.  If period is not zero, the event in
+// slot overflows every period counts and writes a sample with the fields in
+// type to its ring buffer.  The kernel wakes the readers of the ring once
+// watermark bytes are waiting or, if watermark is zero, after every sample.
+// The ring holds ring_pages pages, which must be a power of two.
+struct sampling_spec {
+  uint64_t period = 0U;
+  uint32_t slot = 0U;
+  uint32_t watermark = 0U;
+  uint64_t type = 0U;
+  uint32_t ring_pages = 1U;
+};
+
+// The specification of one counter group, which setupCounter() opens.  Once
+// the group is open, its file descriptors and ids move into a counter_table
+// and the pcounter, with its setup-only perf_event_attr array, is discarded.
+template <class... Events>
 struct pcounter { // our Modern C++ abstraction for a generic performance
                   // counter group for a PID
-  pcounter(pid_t p)
-      : pid(p), perfstruct{}, event_id{}, event_value{}, group_fd{},
-        event_data{} {}
+  static constexpr uint32_t OBSERVED_EVENTS = sizeof...(Events);
+  static constexpr uint32_t COUNTER_READSIZE = OBSERVED_EVENTS * 16U + 24U;
+  static_assert(OBSERVED_EVENTS > 0U, "A counter group needs an event");
+  static_assert(sizeof(struct read_format<OBSERVED_EVENTS>) ==
+                COUNTER_READSIZE);
+
+  pcounter(pid_t p, int c = -1, unsigned long f = 0UL)
+      : pid(p), cpu(c), open_flags(f), sampling{}, pmu_type(0U),
+        events(nullptr), perfstruct{}, event_id{}, group_fd{} {}
 
+  // The thread to observe, or -1 to observe every task on cpu.  With
+  // PERF_FLAG_PID_CGROUP in open_flags, a file descriptor for a cgroup
+  // directory instead.
   pid_t pid;
+  // The CPU to observe, or -1 to follow pid onto any CPU.
+  int cpu;
+  unsigned long open_flags;
+  struct sampling_spec sampling;
+  // The type of the core PMU which should count the events, or 0 for the one
+  // which the generic events select.
+  uint32_t pmu_type;
+  // OBSERVED_EVENTS events which replace the template's Events, or nullptr.
+  const struct event_config *events;
 
-  // The array contains a pair of specifications for the two observed events.
-  std::array<struct perf_event_attr, 2> perfstruct;
-  // The id pair is associated with the two events in the group.
-  std::array<uint64_t, 2> event_id{0, 0};
-  // The array holds the measured values of the events.
-  std::array<uint64_t, 2> event_value{0, 0};
+  // The array contains the specifications for the observed events.
+  std::array<struct perf_event_attr, OBSERVED_EVENTS> perfstruct;
+  // The ids are associated with the events in the group.
+  std::array<uint64_t, OBSERVED_EVENTS> event_id;
   // Each file descriptor corresponds to one event that is measured; these can
-  // be grouped  together  to  measure multiple events simultaneously.
-  std::array<int, 2> group_fd{0, 0};
+  // be grouped  together  to  measure multiple events simultaneously.  The
+  // first one is the group leader.
+  std::array<int, OBSERVED_EVENTS> group_fd;
+};
+
+// A core PMU of a hybrid CPU, such as cpu_core or cpu_atom: the type by
+// which perf_event_open() knows it and the CPUs which it covers.
+struct core_pmu {
+  std::string name;
+  uint32_t type;
+  std::set<int> cpus;
+};
+
+// The counter groups of all observed threads, stored as parallel vectors
+// sorted by tid.  Reads and aggregation stream through the leader fds and
+// values in contiguous memory, and culling is a single merge pass.
+template <class... Events> struct counter_table {
+  using counter_type = pcounter<Events...>;
+  static constexpr uint32_t OBSERVED_EVENTS = counter_type::OBSERVED_EVENTS;
+  static constexpr uint32_t COUNTER_READSIZE = counter_type::COUNTER_READSIZE;
+  using values_type = std::array<uint64_t, OBSERVED_EVENTS>;
+
+  size_t size() const { return tids.size(); }
+
+  // Used on every interval.
+  // The observed threads, or the CPUs if per_cpu is set.
+  std::vector<pid_t> tids;
+  std::vector<int> leader_fds;
+  // The measured values of the events.  With free_running, the counts since
+  // the previous takeDeltas() instead.
+  std::vector<values_type> values;
+  // The times which scale values to estimates of the full counts.
+  std::vector<struct group_times> times;
+  // The raw counts and times at the previous takeDeltas().
+  std::vector<values_type> prev_values;
+  std::vector<struct group_times> prev_times;
+  std::vector<std::array<uint64_t, OBSERVED_EVENTS>> event_ids;
+
+  // Used only at setup and cull time, and by the rdpmc read path.
+  std::vector<std::array<int, OBSERVED_EVENTS>> group_fds;
+  // The per-event metadata pages which mapCounters() maps for the userspace
+  // rdpmc read path.  nullptr if the event is not mapped.
+  std::vector<std::array<struct perf_event_mmap_page *, OBSERVED_EVENTS>>
+      mmap_pages;
+  // The ring buffers of the sampled events, which watchOverflows() maps.
+  std::vector<struct perf_ring> rings;
+  bool per_cpu = false;
+  // Set by startFreeRunning().  The counters are never disabled, and groups
+  // which are added later are enabled as soon as they are opened.
+  bool free_running = false;
+  // Copied into the groups which are created after it is set.
+  struct sampling_spec sampling;
+  // The core PMUs which getCorePmus() found, if the CPU is hybrid.  Each
+  // thread then gets one group per PMU, in adjacent entries, so that it is
+  // counted whichever type of core it runs on, and mergePmuGroups() adds them
+  // up.  A CPU's group counts with the PMU which covers that CPU.
+  std::vector<struct core_pmu> core_pmus;
+  // The events in the slots, if they were chosen at run time, and nullptr if
+  // they are the template's Events.  The array must outlive the table.
+  const struct event_config *events = nullptr;
+};
+
+// The group which Demo.cpp observes.
+using default_pcounter = pcounter<cycles_event, instructions_event>;
+using default_counter_table = counter_table<cycles_event, instructions_event>;
+
+std::string lookupErrorMessage(const int errnum);
+
+void closeCounterFd(const int fd);
+
+// Whether the kernel accepts attr.inherit together with the other settings in
+// st.  Group reads of inherited counters work since Linux 4.4, but inherited
+// events cannot report PERF_SAMPLE_READ.
+constexpr bool inheritSupported(const struct perf_event_attr &st) {
+  return !(st.sample_type & PERF_SAMPLE_READ);
+}
+
+// Whether configureStruct() can direct an event of type perftype to one core
+// PMU.  Other events name their PMU themselves, or are counted by none.
+constexpr bool pmuRetargetable(const uint32_t perftype) {
+  return (PERF_TYPE_HARDWARE == perftype) || (PERF_TYPE_HW_CACHE == perftype) ||
+         (PERF_TYPE_RAW == perftype);
+}
+
+// pmu_type, if not 0, directs the event to one core PMU of a hybrid CPU.
+void configureStruct(struct perf_event_attr &st, const perf_type_id perftype,
+                     const uint64_t config, const bool inherit = false,
+                     const uint32_t pmu_type = 0U);
+
+// configureStruct() for an event chosen at run time.
+void configureEvent(struct perf_event_attr &st, const struct event_config &ev,
+                    const bool inherit = false, const uint32_t pmu_type = 0U);
+
+// Make the event sample as spec says.  A period of zero leaves the event
+// counting only.  Events which read their group in each sample cannot be
+// inherited, so inherit is cleared for them.
+void configureSampling(struct perf_event_attr &st,
+                       const struct sampling_spec &spec);
+
+struct perf_event_mmap_page *mapCounterPage(const int fd);
+
+void unmapCounterPage(struct perf_event_mmap_page *page);
+
+// Map the metadata page and data_pages pages of ring buffer, which must be a
+// power of two.  An event can have only one such mapping.
+struct perf_ring mapRing(const int fd, const size_t data_pages);
+
+void unmapRing(const struct perf_ring &ring);
+
+#if defined(__x86_64__) || defined(__i386__)
+// Read hardware counter number idx directly.  The kernel permits the
+// instruction only for events whose page has cap_user_rdpmc set.
+inline uint64_t rdpmc(const uint32_t idx) {
+  uint32_t low, high;
+  __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(idx));
+  return (static_cast<uint64_t>(high) << 32U) | low;
+}
+#endif
+
+// Read an event's count from its metadata page without a syscall, following
+// the seqlock protocol from "man perf_event_open".  The first element is false
+// if the caller must fall back to read(), because userspace reads are not
+// permitted or the event is not currently scheduled on a PMU counter.  The
+// count is only meaningful for events which count the calling thread or the
+// CPU it is running on.
+inline std::pair<bool, uint64_t>
+readMmapPage(const volatile struct perf_event_mmap_page *pc) {
+  std::pair<bool, uint64_t> retval{false, 0U};
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t seq;
+  do {
+    seq = pc->lock;
+    __asm__ volatile("" ::: "memory");
+    const uint32_t idx = pc->index;
+    retval.first = pc->cap_user_rdpmc && idx;
+    if (retval.first) {
+      // The counter is pmc_width bits wide, so sign-extend it before adding
+      // it to the kernel's offset.
+      const uint16_t width = pc->pmc_width;
+      const uint64_t pmc = rdpmc(idx - 1U) << (64U - width);
+      retval.second =
+          pc->offset + (static_cast<int64_t>(pmc) >> (64U - width));
+    }
+    __asm__ volatile("" ::: "memory");
+  } while (pc->lock != seq);
+#else
+  (void)pc;
+#endif
+  return retval;
+}
+
+// Lists the tasks of a process with getdents64() into a buffer which is reused
+// across calls, parsing the TIDs in place, so that a scan allocates nothing
+// once the buffer and the caller's vector have grown to size.
+struct task_enumerator {
+  explicit task_enumerator(const size_t bufsize = 32768U);
+
+  // Fill tids with the sorted TIDs in <proc_path><pid>/task.  Returns false if
+  // the directory cannot be read.
+  bool enumerate(const std::string &proc_path, const pid_t pid,
+                 std::vector<pid_t> &tids);
 
-  union {
-    char buf[COUNTER_READSIZE];
-    struct read_format per_event_values;
-  } event_data;
+  std::vector<char> buf;
 };
 
 std::set<pid_t> getProcessChildPids(const std::string &proc_path, pid_t pid);
 
-void setupCounter(struct pcounter &s);
+std::set<int> getOnlineCpus(const std::string &sys_path);
 
-void createCounters(std::map<pid_t, struct pcounter> &counters,
-                    const std::set<pid_t> &pids);
+// The core PMUs under <sys_path>bus/event_source/devices, sorted by name.
+// Only hybrid CPUs have more than one, and on other machines the result is
+// empty, since the generic events already select the only core PMU.  The
+// result does not change while the system runs, so callers look it up once.
+std::vector<struct core_pmu> getCorePmus(const std::string &sys_path);
 
-void resetAndEnableCounters(const std::map<pid_t, struct pcounter> &counters);
+// The type of the PMU among pmus which covers cpu, or 0 if none does.
+uint32_t corePmuType(const std::vector<struct core_pmu> &pmus, const int cpu);
 
-void disableCounters(const std::map<pid_t, struct pcounter> &counters);
+int openCgroup(const std::string &cgroup_path);
 
-void readCounters(std::map<pid_t, struct pcounter> &counters);
+template <class Table> void closeCounterFds(const Table &t, const size_t i) {
+  for (struct perf_event_mmap_page *page : t.mmap_pages[i]) {
+    unmapCounterPage(page);
+  }
+  unmapRing(t.rings[i]);
+  for (const int fd : t.group_fds[i]) {
+    closeCounterFd(fd);
+  }
+}
 
-void cullCounters(std::map<pid_t, struct pcounter> &counters,
-                  const std::set<pid_t> &pids);
+template <class Table> void resizeTable(Table &t, const size_t n) {
+  t.tids.resize(n);
+  t.leader_fds.resize(n);
+  t.values.resize(n);
+  t.prev_values.resize(n);
+  t.times.resize(n);
+  t.prev_times.resize(n);
+  t.event_ids.resize(n);
+  t.group_fds.resize(n);
+  t.mmap_pages.resize(n);
+  t.rings.resize(n);
+}
 
-void printResults(const uint64_t cycles, const uint64_t instructions);
+template <class Table>
+void moveEntry(Table &t, const size_t from, const size_t to) {
+  t.tids[to] = t.tids[from];
+  t.leader_fds[to] = t.leader_fds[from];
+  t.values[to] = t.values[from];
+  t.prev_values[to] = t.prev_values[from];
+  t.times[to] = t.times[from];
+  t.prev_times[to] = t.prev_times[from];
+  t.event_ids[to] = t.event_ids[from];
+  t.group_fds[to] = t.group_fds[from];
+  t.mmap_pages[to] = t.mmap_pages[from];
+  t.rings[to] = t.rings[from];
+}
 
+// The only user of the sibling events' group_fd is the ioctl that associates
+// the event with the group created when the first event was enabled.
+template <class Counter>
+void setupEvent(Counter &s, uint32_t event_num, int group_fd) {
+  // pid > 0 and cpu == -1 measures the specified process/thread on any CPU.
+  // pid == -1 and cpu >= 0 measures all processes/threads on the specified
+  // CPU.
+  s.group_fd[event_num] = syscall(SYS_perf_event_open, &s.perfstruct[event_num],
+                                  s.pid, s.cpu, group_fd, s.open_flags);
+  // std::cout << "fd = " << fd << std::endl;
+  if (s.group_fd[event_num] > STDERR_FILENO) {
+    //  PERF_EVENT_IOC_ID returns the event ID value for the given event file
+    //  descriptor.
+    // The argument is a pointer to a 64-bit unsigned integer to hold the
+    // result.
+    ioctl(s.group_fd[event_num], PERF_EVENT_IOC_ID, &s.event_id[event_num]);
+  } else {
+    std::cout << lookupErrorMessage(errno) << std::endl;
+  }
+}
+
+// The fold expression expands to one configureEvent()/setupEvent() pair per
+// event, in the order of the template arguments.  The first event creates the
+// group and the rest join it.  Events chosen at run time are indexed by slot,
+// so setting up a group costs the same either way.
+template <class... Events, size_t... I>
+void setupEvents(struct pcounter<Events...> &s, const bool inherit,
+                 std::index_sequence<I...>) {
+  ((configureEvent(s.perfstruct[I],
+                   s.events ? s.events[I]
+                            : event_config{Events::type, Events::config, 0U,
+                                           0U},
+                   inherit, s.pmu_type),
+    configureSampling(s.perfstruct[I], (I == s.sampling.slot)
+                                           ? s.sampling
+                                           : sampling_spec{}),
+    setupEvent(s, I, (0U == I) ? -1 : s.group_fd[0])),
+   ...);
+}
+
+// With inherit, the counters also count the threads which s.pid creates after
+// this call, and the counts of those threads fold into s.pid's counters when
+// they exit, so the threads need not be discovered in procfs.
+template <class... Events>
+void setupCounter(struct pcounter<Events...> &s, const bool inherit = false) {
+  // std::cout << "setting up counters for pid " << s.pid << std::endl;
+  errno = 0;
+  setupEvents(s, inherit, std::index_sequence_for<Events...>{});
+}
+
+// Add the already opened groups in staged, which must be sorted and must not
+// already be in the table.  The merge runs from the back so that each entry
+// moves at most once without scratch space.  New threads usually have the
+// highest tids, in which case nothing moves at all.
+template <class... Events>
+void insertCounters(struct counter_table<Events...> &t,
+                    const std::vector<struct pcounter<Events...>> &staged) {
+  size_t i = t.size();
+  size_t j = staged.size();
+  resizeTable(t, i + j);
+  for (size_t k = t.size(); j > 0U;) {
+    k--;
+    const struct pcounter<Events...> &pc = staged[j - 1U];
+    const pid_t key = t.per_cpu ? pc.cpu : pc.pid;
+    if ((i > 0U) && (t.tids[i - 1U] > key)) {
+      i--;
+      moveEntry(t, i, k);
+    } else {
+      j--;
+      t.tids[k] = key;
+      t.leader_fds[k] = pc.group_fd[0];
+      t.values[k] = {};
+      t.prev_values[k] = {};
+      t.times[k] = {};
+      t.prev_times[k] = {};
+      t.event_ids[k] = pc.event_id;
+      t.group_fds[k] = pc.group_fd;
+      t.mmap_pages[k] = {};
+      t.rings[k] = {};
+    }
+  }
+}
+
+// New groups sample, and count the events, which the table does.
+template <class Table>
+void copyGroupSettings(const Table &counters,
+                       typename Table::counter_type &pc) {
+  pc.sampling = counters.sampling;
+  pc.events = counters.events;
+}
+
+// Free-running tables enable new groups at once, rather than at the start of
+// the next interval.
+template <class Table>
+void enableIfFreeRunning(const Table &counters,
+                         const typename Table::counter_type &pc) {
+  if (counters.free_running && (pc.group_fd[0] > STDERR_FILENO)) {
+    ioctl(pc.group_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+template <class Table>
+void createCounters(Table &counters, const std::set<pid_t> &pids,
+                    const bool inherit = false) {
+  std::vector<typename Table::counter_type> staged{};
+  const size_t pmus = std::max<size_t>(counters.core_pmus.size(), 1U);
+  staged.reserve(pids.size() * pmus);
+  for (const auto &pid : pids) {
+    for (size_t p = 0U; p < pmus; p++) {
+      staged.emplace_back(pid);
+      staged.back().pmu_type =
+          counters.core_pmus.empty() ? 0U : counters.core_pmus[p].type;
+      copyGroupSettings(counters, staged.back());
+      setupCounter(staged.back(), inherit);
+      // std::cout << "creating counter for pid " << counters.back()->pid <<
+      // std::endl;
+      enableIfFreeRunning(counters, staged.back());
+    }
+  }
+  insertCounters(counters, staged);
+}
+
+// System-wide mode: one group per CPU, so the number of file descriptors and
+// reads per interval depends on the number of cores rather than on the number
+// of threads.  The counters are keyed by CPU number.  If cgroup_fd is a valid
+// file descriptor, only tasks in that cgroup are counted.
+template <class Table>
+void createCpuCounters(Table &counters, const std::set<int> &cpus,
+                       const int cgroup_fd = -1) {
+  const bool cgroup = (cgroup_fd > STDERR_FILENO);
+  counters.per_cpu = true;
+  std::vector<typename Table::counter_type> staged{};
+  staged.reserve(cpus.size());
+  for (const int cpu : cpus) {
+    staged.emplace_back(cgroup ? cgroup_fd : -1, cpu,
+                        cgroup ? PERF_FLAG_PID_CGROUP : 0UL);
+    staged.back().pmu_type = corePmuType(counters.core_pmus, cpu);
+    copyGroupSettings(counters, staged.back());
+    setupCounter(staged.back());
+    enableIfFreeRunning(counters, staged.back());
+  }
+  insertCounters(counters, staged);
+}
+
+// Both the table and pids are sorted, so one pass closes the culled groups and
+// compacts the rest.
+template <class Table>
+void cullCounters(Table &counters, const std::set<pid_t> &pids) {
+  auto culled = pids.begin();
+  size_t kept = 0U;
+  for (size_t i = 0U; i < counters.size(); i++) {
+    while ((culled != pids.end()) && (*culled < counters.tids[i])) {
+      culled++;
+    }
+    if ((culled != pids.end()) && (*culled == counters.tids[i])) {
+      closeCounterFds(counters, i);
+      // std::cout << "culling counter for pid " << counter.pid << std::endl;
+      continue;
+    }
+    if (kept != i) {
+      moveEntry(counters, i, kept);
+    }
+    kept++;
+  }
+  resizeTable(counters, kept);
+}
+
+// PERF_IOC_FLAG_GROUP applies an ioctl to every member of the group, so only
+// the group leader needs it, however many events the group has.
+template <class Table> void resetAndEnableCounters(const Table &counters) {
+  for (const int leader : counters.leader_fds) {
+    // reset the counters for ALL the events that are members of the group
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    // enable all the events that are members of the group
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+template <class Table> void disableCounters(const Table &counters) {
+  for (const int leader : counters.leader_fds) {
+    // disable all counters in the group
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+// Enable the counters once and leave them running, so that nothing which
+// happens between intervals goes uncounted.  Each interval then needs only
+// the reads and takeDeltas().
+template <class Table> void startFreeRunning(Table &counters) {
+  resetAndEnableCounters(counters);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    counters.prev_values[i] = {};
+    counters.prev_times[i] = {};
+  }
+  counters.free_running = true;
+}
+
+// Turn the raw counts which were just read into the counts since the previous
+// call, remembering the raw counts for the next one.  The counts of a running
+// group never decrease, so a count below the previous one means that the read
+// failed and left an old value behind, and the interval reports nothing for
+// that event.  The times become deltas in the same way, so that the scaling
+// applies to the interval alone.
+template <class Table> void takeDeltas(Table &counters) {
+  auto delta = [](uint64_t &value, uint64_t &prev) {
+    const uint64_t raw = value;
+    value = (raw > prev) ? raw - prev : 0U;
+    prev = std::max(raw, prev);
+  };
+  for (size_t i = 0U; i < counters.size(); i++) {
+    typename Table::values_type &values = counters.values[i];
+    typename Table::values_type &prev = counters.prev_values[i];
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      delta(values[ev], prev[ev]);
+    }
+    delta(counters.times[i].enabled, counters.prev_times[i].enabled);
+    delta(counters.times[i].running, counters.prev_times[i].running);
+  }
+}
+
+// A thread's group for one core PMU of a hybrid CPU runs only while the thread
+// is on a core of that type, so the time on the other cores would look like
+// multiplexing and be scaled up.  Fold the counts and running times of each
+// thread's groups into its first entry instead, and zero the other entries,
+// after the reads and any takeDeltas().
+template <class Table> void mergePmuGroups(Table &counters) {
+  if (counters.per_cpu || (counters.core_pmus.size() < 2U)) {
+    return;
+  }
+  size_t first = 0U;
+  for (size_t i = 1U; i < counters.size(); i++) {
+    if (counters.tids[i] != counters.tids[first]) {
+      first = i;
+      continue;
+    }
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      counters.values[first][ev] += counters.values[i][ev];
+    }
+    counters.times[first].enabled =
+        std::max(counters.times[first].enabled, counters.times[i].enabled);
+    counters.times[first].running += counters.times[i].running;
+    counters.values[i] = {};
+    counters.times[i] = {};
+  }
+}
+
+// Check and store the result of reading group leader i into buf.  size is the
+// return value of the read, or -errno.
+template <class Table>
+void storeCounterRead(Table &t, const size_t i, const char *buf,
+                      const ssize_t size) {
+  const int leader = t.leader_fds[i];
+  struct read_format<Table::OBSERVED_EVENTS> per_event_values;
+  //  If false, reading could give us false counter values.
+  if (size == Table::COUNTER_READSIZE) {
+    memcpy(&per_event_values, buf, Table::COUNTER_READSIZE);
+  }
+  if ((size == Table::COUNTER_READSIZE) &&
+      (per_event_values.nr == Table::OBSERVED_EVENTS)) {
+    // The kernel reports the members of a group in the order in which they
+    // joined it, which setupCounter() fixes at compile time, so value i always
+    // belongs to event i.  The ids are only checked, not searched.
+    uint64_t mismatch = 0U;
+    t.times[i] = {per_event_values.time_enabled, per_event_values.time_running};
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      t.values[i][ev] = per_event_values.values[ev].value;
+      mismatch |= per_event_values.values[ev].id ^ t.event_ids[i][ev];
+    }
+    if (mismatch) {
+      std::cerr << "Unexpected event ids for group " << leader << std::endl;
+    }
+  } else if (size < 0) {
+    std::cerr << strerror(-size) << " " << leader << std::endl;
+  } else {
+    std::cerr << "Insufficient data " << size << " bytes for group " << leader
+              << std::endl;
+  }
+}
+
+template <class Table> void readCounter(Table &t, const size_t i) {
+  const int leader = t.leader_fds[i];
+  // checks if this fd is "good." If  it's an unused file descriptor, then
+  // Linux will deallocate memory for cin instead which leads to segmentation
+  // faults (borrow checkers can't prevent  this because it happens in the
+  // kernel)
+  if (leader > STDERR_FILENO) {
+    char buf[Table::COUNTER_READSIZE];
+    errno = 0;
+    // The sibling events' counts are available via the group to which they
+    // and the first event belong.   It's not obvious that a read to a
+    // sibling's group_fd will even succeeed.
+    ssize_t size = read(leader, buf, sizeof(buf));
+    storeCounterRead(t, i, buf, (size < 0) ? -errno : size);
+  } else {
+    std::cerr << "Bad file descriptor for task " << t.tids[i] << std::endl;
+  }
+}
+
+template <class Table> void readCounters(Table &counters) {
+  for (size_t i = 0U; i < counters.size(); i++) {
+    readCounter(counters, i);
+  }
+}
+
+// mmap() the metadata page of every event so that readCountersRdpmc() can read
+// the counts in userspace.  Events whose page cannot be mapped keep using
+// read().
+template <class Table> void mapCounters(Table &counters) {
+  for (size_t i = 0U; i < counters.size(); i++) {
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      if ((nullptr == counters.mmap_pages[i][ev]) &&
+          (counters.group_fds[i][ev] > STDERR_FILENO)) {
+        counters.mmap_pages[i][ev] = mapCounterPage(counters.group_fds[i][ev]);
+      }
+    }
+  }
+}
+
+// Userspace rdpmc reads are valid only for the thread which executes them, so
+// counters of other threads, and counters whose events are not all mapped and
+// scheduled, are read with read() instead.
+template <class Table> void readCountersRdpmc(Table &counters) {
+  const pid_t self = static_cast<pid_t>(syscall(SYS_gettid));
+  for (size_t i = 0U; i < counters.size(); i++) {
+    const pid_t tid = counters.tids[i];
+    bool read_all = !counters.per_cpu && ((tid == self) || (0 == tid));
+    typename Table::values_type values{};
+    for (uint32_t ev = 0U; read_all && (ev < Table::OBSERVED_EVENTS); ev++) {
+      if (nullptr == counters.mmap_pages[i][ev]) {
+        read_all = false;
+        break;
+      }
+      std::pair<bool, uint64_t> res = readMmapPage(counters.mmap_pages[i][ev]);
+      read_all = res.first;
+      values[ev] = res.second;
+    }
+    if (read_all) {
+      // The page's times are only updated when the event is scheduled, so
+      // they are left out and the counts are not scaled.
+      counters.values[i] = values;
+      counters.times[i] = {};
+    } else {
+      readCounter(counters, i);
+    }
+  }
+}
+
+// Sum each event over all groups in the table.
+template <class Table>
+typename Table::values_type sumCounters(const Table &counters) {
+  typename Table::values_type sums{};
+  for (const auto &values : counters.values) {
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      sums[ev] += values[ev];
+    }
+  }
+  return sums;
+}
+
+// The count which the group would have reached had it been on the PMU for
+// all of the time it was enabled.  Counts of groups which never ran, or whose
+// times are unknown, are returned as they are.
+inline uint64_t scaleCount(const uint64_t value,
+                           const struct group_times &times) {
+  if ((0U == times.running) || (times.running >= times.enabled)) {
+    return value;
+  }
+  // The product can exceed 64 bits after a few seconds at GHz rates.
+  return static_cast<uint64_t>((static_cast<unsigned __int128>(value) *
+                                times.enabled) /
+                               times.running);
+}
+
+template <uint32_t N> struct scaled_totals {
+  std::array<uint64_t, N> estimates;
+  // The fraction of the enabled time for which the groups were counting,
+  // weighted by how long each was enabled.  1.0 means that no estimate was
+  // extrapolated; lower values mean that the estimates are less certain.
+  double confidence;
+};
+
+// Sum the scaled estimate of each event over all groups in the table.
+template <class Table>
+struct scaled_totals<Table::OBSERVED_EVENTS>
+sumScaledCounters(const Table &counters) {
+  struct scaled_totals<Table::OBSERVED_EVENTS> totals{};
+  uint64_t enabled = 0U;
+  uint64_t running = 0U;
+  for (size_t i = 0U; i < counters.size(); i++) {
+    const struct group_times &times = counters.times[i];
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      totals.estimates[ev] += scaleCount(counters.values[i][ev], times);
+    }
+    enabled += std::max(times.enabled, times.running);
+    running += times.running;
+  }
+  totals.confidence =
+      enabled ? static_cast<double>(running) / static_cast<double>(enabled)
+              : 1.0;
+  return totals;
+}
+
+// Counts more events than the PMU has counters by giving the tables, each of
+// which holds one group per thread, the counters one interval at a time.
+// Unlike the kernel's own multiplexing, every group has the PMU to itself
+// while it is enabled, so its counts need no scaling, but each table only
+// samples one interval in GROUPS.  All tables must observe the same threads.
+template <class... Tables> struct event_rotation {
+  static constexpr size_t GROUPS = sizeof...(Tables);
+  static_assert(GROUPS > 0U, "A rotation needs a table");
+
+  // Call f(table) for every table.
+  template <class F> void forEach(F f) {
+    std::apply([&f](Tables &...t) { (f(t), ...); }, tables);
+  }
+  // Call f(table) for the table whose turn it is.
+  template <class F> void withActive(F f) {
+    withActive(f, std::index_sequence_for<Tables...>{});
+  }
+  // Hand the counters to the next table.
+  void rotate() { active = (active + 1U) % GROUPS; }
+
+  std::tuple<Tables...> tables;
+  size_t active = 0U;
+
+private:
+  template <class F, size_t... I>
+  void withActive(F &f, std::index_sequence<I...>) {
+    ((I == active ? (void)f(std::get<I>(tables)) : void()), ...);
+  }
+};
+
+// Why not simply create a new table for the new task list and ignore the
+// exited tasks? Two reasons:
+// clang-format off
+// 0. The list of exited tasks is needed to close their file descriptors.
+// 1. Creating new counters involves a fair amount of overhead, so destroying
+//    and then recreating counters for ongoing tasks would be wasteful.
+// clang-format on
+template <class Table>
 void getPidDelta(const std::string &proc_path, const pid_t pid,
-                 std::map<pid_t, struct pcounter> &MyCounters,
-                 std::set<pid_t> &currentPids);
+                 Table &MyCounters, std::set<pid_t> &currentPids) {
+  std::set<pid_t> diffPids{};
+
+  // Reread the child tasks of the provided parent PID from procfs.
+  std::set<pid_t> newPids = getProcessChildPids(proc_path, pid);
+
+  // Find PIDs of newly running tasks.
+  std::set_difference(newPids.begin(), newPids.end(), currentPids.begin(),
+                      currentPids.end(),
+                      std::inserter(diffPids, diffPids.begin()));
+  // Create new counters for tasks which started since last iteration.
+  createCounters(MyCounters, diffPids);
+  diffPids.clear();
+
+  // Find PIDs of tasks which exited since last iteration.
+  std::set_difference(currentPids.begin(), currentPids.end(), newPids.begin(),
+                      newPids.end(), std::inserter(diffPids, diffPids.begin()));
+
+  // Close file descriptors associated with tasks that have exited and remove
+  // their counters from the table.
+  cullCounters(MyCounters, diffPids);
+  currentPids = std::move(newPids);
+}
+
+// Print count over elapsed as a rate of the event called name.
+void printRate(const uint64_t count, const std::string &name,
+               const std::chrono::nanoseconds elapsed);
+
+// Note that the counts are scaled estimates, if confidence is below 1.
+void printConfidence(const double confidence);
+
+// elapsed is how long the counters counted, which turns the counts into
+// rates.  confidence is that of scaled_totals.
+void printResults(const uint64_t cycles, const uint64_t instructions,
+                  const std::chrono::nanoseconds elapsed = SLEEPTIME,
+                  const double confidence = 1.0);
+
+void printBranchResults(const uint64_t branches, const uint64_t misses,
+                        const std::chrono::nanoseconds elapsed = SLEEPTIME,
+                        const double confidence = 1.0);
+
+#endif // PERFORMANCE_COUNTER_LIB_HPP
@@ -5,6 +5,7 @@
 
 #include <fcntl.h>
 #include <limits.h>
+#include <fstream>
 #include <sstream>
 #include <sys/stat.h>
 
@@ -13,6 +14,8 @@ using namespace std;
 constexpr char TEST_PATH[] = "testdata/";
 constexpr int32_t NUMDIRS = 20;
 constexpr pid_t FAKE_PID = 1234;
+constexpr uint32_t OBSERVED_EVENTS = default_pcounter::OBSERVED_EVENTS;
+using fake_read_format = struct read_format<OBSERVED_EVENTS>;
 
 namespace local_testing {
 
@@ -31,8 +34,9 @@ struct PcLibTest : public ::testing::Test {
     }
   }
   void createFakeCounters() {
+    std::vector<default_pcounter> staged{};
     for (int i = 0; i < NUMDIRS; i++) {
-      struct pcounter pc(static_cast<pid_t>(i));
+      default_pcounter pc(static_cast<pid_t>(i));
       std::string task_path = test_path.string() + "/" + to_string(i);
       ASSERT_TRUE(fs::exists(task_path));
       std::string afile_path = task_path + "/afile";
@@ -46,19 +50,19 @@ struct PcLibTest : public ::testing::Test {
       pc.group_fd[INSTRUCTIONS] =
           open(bfile_path.c_str(), O_RDWR | O_CREAT, 0744);
       EXPECT_EQ(pc.group_fd[INSTRUCTIONS], STDERR_FILENO + (2 * i) + 2);
-      counters.insert(
-          std::pair<pid_t, struct pcounter>{static_cast<pid_t>(i), pc});
+      staged.push_back(pc);
     }
+    insertCounters(counters, staged);
   }
 
   ssize_t tryWriteCounterFds(const int group_leader_fd,
-                             const unique_ptr<struct read_format> event_data) {
+                             const unique_ptr<fake_read_format> event_data) {
     // event_data.release() results in a memory leak, as there is no longer a
     // reference to the pointer.
     errno = 0;
     ssize_t written =
-        write(group_leader_fd, event_data.get(), sizeof(struct read_format));
-    if ((errno) || (written != sizeof(struct read_format))) {
+        write(group_leader_fd, event_data.get(), sizeof(fake_read_format));
+    if ((errno) || (written != sizeof(fake_read_format))) {
       std::cerr << "Write failed: " << strerror(errno) << std::endl;
       return -1;
     }
@@ -74,19 +78,19 @@ struct PcLibTest : public ::testing::Test {
 
   void writeFakeCounters() {
     uint32_t ctr = 0u;
-    for (auto it = counters.begin(); it != counters.end(); it++) {
-      unique_ptr<struct read_format> per_event_values(new struct read_format);
+    for (size_t i = 0U; i < counters.size(); i++) {
+      unique_ptr<fake_read_format> per_event_values(new fake_read_format);
       per_event_values->nr = OBSERVED_EVENTS;
       per_event_values->values[CYCLES].id = ctr + 1;
-      it->second.event_id[CYCLES] = per_event_values->values[CYCLES].id;
+      counters.event_ids[i][CYCLES] = per_event_values->values[CYCLES].id;
       per_event_values->values[CYCLES].value = ctr + 2;
       per_event_values->values[INSTRUCTIONS].id = ctr + 3;
       per_event_values->values[INSTRUCTIONS].value = ctr + 4;
-      it->second.event_id[INSTRUCTIONS] =
+      counters.event_ids[i][INSTRUCTIONS] =
           per_event_values->values[INSTRUCTIONS].id;
-      ASSERT_EQ(tryWriteCounterFds(it->second.group_fd[CYCLES],
+      ASSERT_EQ(tryWriteCounterFds(counters.leader_fds[i],
                                    move(per_event_values)),
-                sizeof(struct read_format));
+                sizeof(fake_read_format));
       ctr++;
     }
   }
@@ -98,22 +102,130 @@ struct PcLibTest : public ::testing::Test {
   }
   fs::path test_path;
   pid_t pid = INT_MIN;
-  std::map<pid_t, struct pcounter> counters{};
+  default_counter_table counters{};
 };
 
 TEST(PcLibSimpleTest, setupCounter) {
-  struct pcounter acounter(FAKE_PID);
+  default_pcounter acounter(FAKE_PID);
   setupCounter(acounter);
   for (const auto &ps : acounter.perfstruct) {
     EXPECT_EQ(PERF_TYPE_HARDWARE, ps.type);
     EXPECT_EQ(sizeof(struct perf_event_attr), ps.size);
     EXPECT_EQ(true, ps.disabled);
-    EXPECT_EQ(PERF_FORMAT_GROUP | PERF_FORMAT_ID, ps.read_format);
+    EXPECT_EQ(PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                  PERF_FORMAT_TOTAL_TIME_ENABLED |
+                  PERF_FORMAT_TOTAL_TIME_RUNNING,
+              ps.read_format);
   }
   EXPECT_EQ(PERF_COUNT_HW_CPU_CYCLES, acounter.perfstruct[0].config);
   EXPECT_EQ(PERF_COUNT_HW_INSTRUCTIONS, acounter.perfstruct[1].config);
 }
 
+TEST(PcLibSimpleTest, setupCounterInherit) {
+  default_pcounter acounter(FAKE_PID);
+  setupCounter(acounter, true);
+  for (const auto &ps : acounter.perfstruct) {
+    EXPECT_EQ(1U, ps.inherit);
+    EXPECT_TRUE(inheritSupported(ps));
+  }
+
+  struct perf_event_attr sampled;
+  configureStruct(sampled, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  EXPECT_EQ(0U, sampled.inherit);
+  sampled.sample_type = PERF_SAMPLE_READ;
+  EXPECT_FALSE(inheritSupported(sampled));
+}
+
+TEST(PcLibSimpleTest, setupCounterSampled) {
+  // Only the event in the sample slot overflows.
+  default_pcounter acounter(FAKE_PID);
+  acounter.sampling.period = 1000000U;
+  acounter.sampling.slot = INSTRUCTIONS;
+  setupCounter(acounter, true);
+  EXPECT_EQ(0U, acounter.perfstruct[CYCLES].sample_period);
+  EXPECT_EQ(0U, acounter.perfstruct[CYCLES].wakeup_events);
+  EXPECT_EQ(1000000U, acounter.perfstruct[INSTRUCTIONS].sample_period);
+  EXPECT_EQ(1U, acounter.perfstruct[INSTRUCTIONS].wakeup_events);
+  EXPECT_EQ(0U, acounter.perfstruct[INSTRUCTIONS].watermark);
+  EXPECT_EQ(1U, acounter.perfstruct[INSTRUCTIONS].inherit);
+
+  // Samples which read the group wake the reader by the byte.
+  default_pcounter reader(FAKE_PID);
+  reader.sampling = {4000U, CYCLES, 8192U, PERF_SAMPLE_IP | PERF_SAMPLE_READ};
+  setupCounter(reader, true);
+  EXPECT_EQ(PERF_SAMPLE_IP | PERF_SAMPLE_READ,
+            reader.perfstruct[CYCLES].sample_type);
+  EXPECT_EQ(1U, reader.perfstruct[CYCLES].watermark);
+  EXPECT_EQ(8192U, reader.perfstruct[CYCLES].wakeup_watermark);
+  EXPECT_EQ(0U, reader.perfstruct[CYCLES].inherit);
+  EXPECT_EQ(0U, reader.perfstruct[INSTRUCTIONS].sample_type);
+  EXPECT_EQ(1U, reader.perfstruct[INSTRUCTIONS].inherit);
+
+  // Tables pass their settings on to the groups they create.
+  default_counter_table table{};
+  table.sampling.period = 5000U;
+  table.sampling.slot = CYCLES;
+  default_pcounter staged(FAKE_PID);
+  copyGroupSettings(table, staged);
+  EXPECT_EQ(5000U, staged.sampling.period);
+  EXPECT_EQ(CYCLES, staged.sampling.slot);
+  EXPECT_EQ(nullptr, staged.events);
+}
+
+TEST(PcLibSimpleTest, mapRingFailure) {
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  const struct perf_ring ring = mapRing(-1, 1U);
+  cerr.rdbuf(old_cerr);
+  EXPECT_EQ(nullptr, ring.page);
+  EXPECT_EQ(0U, ring.size);
+  EXPECT_THAT(errors.str(), testing::HasSubstr("Failed to map ring buffer"));
+  // Unmapping nothing is harmless.
+  unmapRing(ring);
+}
+
+TEST(PcLibSimpleTest, setupCounterCustomGroup) {
+  using miss_counter = pcounter<cache_misses_event, branch_misses_event,
+                                stalled_cycles_backend_event>;
+  EXPECT_EQ(3U, miss_counter::OBSERVED_EVENTS);
+  EXPECT_EQ(3U * 16U + 24U, miss_counter::COUNTER_READSIZE);
+  miss_counter acounter(FAKE_PID);
+  setupCounter(acounter);
+  for (const auto &ps : acounter.perfstruct) {
+    EXPECT_EQ(PERF_TYPE_HARDWARE, ps.type);
+    EXPECT_EQ(PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                  PERF_FORMAT_TOTAL_TIME_ENABLED |
+                  PERF_FORMAT_TOTAL_TIME_RUNNING,
+              ps.read_format);
+  }
+  EXPECT_EQ(PERF_COUNT_HW_CACHE_MISSES, acounter.perfstruct[0].config);
+  EXPECT_EQ(PERF_COUNT_HW_BRANCH_MISSES, acounter.perfstruct[1].config);
+  EXPECT_EQ(PERF_COUNT_HW_STALLED_CYCLES_BACKEND,
+            acounter.perfstruct[2].config);
+}
+
+TEST(PcLibSimpleTest, setupCounterRuntimeEvents) {
+  const std::array<struct event_config, OBSERVED_EVENTS> events = {{
+      {PERF_TYPE_RAW, 0x3cU, 0U, 0U},
+      {8U, 0x1c0U, 0x5U, 0x7U},
+  }};
+  default_counter_table table{};
+  table.events = events.data();
+  default_pcounter acounter(FAKE_PID);
+  copyGroupSettings(table, acounter);
+  setupCounter(acounter);
+  EXPECT_EQ(PERF_TYPE_RAW, acounter.perfstruct[0].type);
+  EXPECT_EQ(0x3cU, acounter.perfstruct[0].config);
+  EXPECT_EQ(8U, acounter.perfstruct[1].type);
+  EXPECT_EQ(0x1c0U, acounter.perfstruct[1].config);
+  EXPECT_EQ(0x5U, acounter.perfstruct[1].config1);
+  EXPECT_EQ(0x7U, acounter.perfstruct[1].config2);
+  EXPECT_EQ(PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                PERF_FORMAT_TOTAL_TIME_ENABLED |
+                PERF_FORMAT_TOTAL_TIME_RUNNING,
+            acounter.perfstruct[1].read_format);
+}
+
 TEST_F(PcLibTest, getProcessChildPids) {
   fs::current_path(fs::temp_directory_path());
   ASSERT_TRUE(fs::exists(test_path));
@@ -128,6 +240,138 @@ TEST_F(PcLibTest, getProcessChildPids) {
   ASSERT_EQ(0u, pids.size());
 }
 
+TEST_F(PcLibTest, taskEnumerator) {
+  // A buffer this small holds only a couple of entries, so enumerate() must
+  // call getdents64() repeatedly.
+  task_enumerator enumerator(64U);
+  std::vector<pid_t> tids{42};
+  ASSERT_TRUE(enumerator.enumerate(TEST_PATH, pid, tids));
+  ASSERT_EQ(NUMDIRS, tids.size());
+  EXPECT_TRUE(std::is_sorted(tids.begin(), tids.end()));
+  for (int i = 0; i < NUMDIRS; i++) {
+    EXPECT_EQ(i, tids[i]);
+  }
+
+  EXPECT_FALSE(enumerator.enumerate(TEST_PATH, 4321, tids));
+  EXPECT_TRUE(tids.empty());
+}
+
+TEST_F(PcLibTest, getOnlineCpus) {
+  fs::path cpu_path{std::string(TEST_PATH) + "devices/system/cpu"};
+  ASSERT_TRUE(fs::create_directories(cpu_path));
+  {
+    std::ofstream online{cpu_path / "online"};
+    online << "0-3,6,8-9" << std::endl;
+  }
+  std::set<int> cpus = getOnlineCpus(TEST_PATH);
+  EXPECT_EQ((std::set<int>{0, 1, 2, 3, 6, 8, 9}), cpus);
+
+  default_counter_table cpu_counters{};
+  createCpuCounters(cpu_counters, cpus);
+  EXPECT_TRUE(cpu_counters.per_cpu);
+  EXPECT_EQ(std::vector<pid_t>(cpus.begin(), cpus.end()), cpu_counters.tids);
+  for (size_t i = 0U; i < cpu_counters.size(); i++) {
+    closeCounterFds(cpu_counters, i);
+  }
+
+  EXPECT_TRUE(getOnlineCpus("nonexistent/").empty());
+}
+
+// A hybrid CPU's PMUs, one of which is an uncore PMU with no cpus file.
+TEST_F(PcLibTest, getCorePmus) {
+  const fs::path devices{std::string(TEST_PATH) + "bus/event_source/devices"};
+  auto addPmu = [&devices](const std::string &name, const std::string &type,
+                           const char *cpus_file, const std::string &cpus) {
+    ASSERT_TRUE(fs::create_directories(devices / name));
+    std::ofstream{devices / name / "type"} << type << std::endl;
+    std::ofstream{devices / name / cpus_file} << cpus << std::endl;
+  };
+  addPmu("cpu_core", "4", "cpus", "0-3");
+  // A lone core PMU is left to the generic events.
+  EXPECT_TRUE(getCorePmus(TEST_PATH).empty());
+  addPmu("uncore_imc_0", "17", "cpumask", "0");
+  addPmu("cpu_atom", "10", "cpus", "4-7,9");
+
+  const std::vector<struct core_pmu> pmus = getCorePmus(TEST_PATH);
+  ASSERT_EQ(2U, pmus.size());
+  EXPECT_EQ("cpu_atom", pmus[0].name);
+  EXPECT_EQ(10U, pmus[0].type);
+  EXPECT_EQ((std::set<int>{4, 5, 6, 7, 9}), pmus[0].cpus);
+  EXPECT_EQ("cpu_core", pmus[1].name);
+  EXPECT_EQ(4U, pmus[1].type);
+  EXPECT_EQ(4U, corePmuType(pmus, 2));
+  EXPECT_EQ(10U, corePmuType(pmus, 9));
+  EXPECT_EQ(0U, corePmuType(pmus, 8));
+
+  // A CPU's group counts with the PMU which covers it.
+  default_counter_table cpu_counters{};
+  cpu_counters.core_pmus = pmus;
+  std::ostringstream errors{};
+  std::streambuf *old_cout = cout.rdbuf(errors.rdbuf());
+  createCpuCounters(cpu_counters, std::set<int>{3, 4});
+  cout.rdbuf(old_cout);
+  ASSERT_EQ(2U, cpu_counters.size());
+  for (size_t i = 0U; i < cpu_counters.size(); i++) {
+    closeCounterFds(cpu_counters, i);
+  }
+
+  EXPECT_TRUE(getCorePmus("nonexistent/").empty());
+}
+
+TEST(PcLibSimpleTest, setupCounterHybrid) {
+  default_pcounter acounter(FAKE_PID);
+  acounter.pmu_type = 8U;
+  setupCounter(acounter);
+  EXPECT_EQ(PERF_TYPE_HARDWARE, acounter.perfstruct[CYCLES].type);
+  EXPECT_EQ((8ULL << 32U) | PERF_COUNT_HW_CPU_CYCLES,
+            acounter.perfstruct[CYCLES].config);
+  EXPECT_EQ((8ULL << 32U) | PERF_COUNT_HW_INSTRUCTIONS,
+            acounter.perfstruct[INSTRUCTIONS].config);
+
+  // Raw events go to the PMU itself.
+  struct perf_event_attr raw;
+  configureStruct(raw, PERF_TYPE_RAW, 0x3cU, false, 8U);
+  EXPECT_EQ(8U, raw.type);
+  EXPECT_EQ(0x3cU, raw.config);
+  configureStruct(raw, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, false,
+                  8U);
+  EXPECT_EQ(PERF_TYPE_SOFTWARE, raw.type);
+  EXPECT_EQ(PERF_COUNT_SW_TASK_CLOCK, raw.config);
+}
+
+// Each thread has one group per core PMU, and the groups' counts and running
+// times add up.
+TEST(PcLibSimpleTest, mergePmuGroups) {
+  default_counter_table table{};
+  table.core_pmus = {{"cpu_atom", 10U, {}}, {"cpu_core", 4U, {}}};
+  std::ostringstream errors{};
+  std::streambuf *old_cout = cout.rdbuf(errors.rdbuf());
+  createCounters(table, std::set<pid_t>{FAKE_PID, FAKE_PID + 1});
+  cout.rdbuf(old_cout);
+  ASSERT_EQ(4U, table.size());
+  EXPECT_EQ((std::vector<pid_t>{FAKE_PID, FAKE_PID, FAKE_PID + 1,
+                                FAKE_PID + 1}),
+            table.tids);
+  for (size_t i = 0U; i < table.size(); i++) {
+    closeCounterFds(table, i);
+  }
+
+  table.values = {{100U, 50U}, {300U, 600U}, {7U, 8U}, {0U, 0U}};
+  table.times = {{1000U, 250U}, {1000U, 750U}, {1000U, 500U}, {1000U, 0U}};
+  mergePmuGroups(table);
+  EXPECT_EQ((default_counter_table::values_type{400U, 650U}), table.values[0]);
+  EXPECT_EQ(1000U, table.times[0].enabled);
+  EXPECT_EQ(1000U, table.times[0].running);
+  EXPECT_EQ((default_counter_table::values_type{0U, 0U}), table.values[1]);
+  EXPECT_EQ(0U, table.times[1].enabled);
+  // A thread which stayed on one type of core is scaled by its share of the
+  // enabled time.
+  EXPECT_EQ((default_counter_table::values_type{7U, 8U}), table.values[2]);
+  EXPECT_EQ(500U, table.times[2].running);
+  const auto totals = sumScaledCounters(table);
+  EXPECT_EQ(414U, totals.estimates[CYCLES]);
+}
+
 TEST_F(PcLibTest, cullCounter) {
   // Setup
   std::set<pid_t> to_cull;
@@ -142,6 +386,10 @@ TEST_F(PcLibTest, cullCounter) {
 
   // Test
   EXPECT_EQ(NUMDIRS / 2U, counters.size());
+  for (size_t i = 0U; i < counters.size(); i++) {
+    EXPECT_EQ(static_cast<pid_t>(2U * i + 1U), counters.tids[i]);
+    EXPECT_EQ(counters.group_fds[i][CYCLES], counters.leader_fds[i]);
+  }
   // Iterate over original counters array.
   for (int i = 0; i < NUMDIRS; i++) {
     // Should have been culled, so file descriptors are already closed.
@@ -165,56 +413,214 @@ TEST_F(PcLibTest, cullCounter) {
   }
 }
 
+TEST(PcLibSimpleTest, insertCounters) {
+  default_counter_table table{};
+  std::vector<default_pcounter> staged{};
+  for (const pid_t tid : {10, 20, 30}) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {tid, tid + 1};
+  }
+  insertCounters(table, staged);
+  staged.clear();
+  // Interleaved with and beyond the existing entries.
+  for (const pid_t tid : {5, 25, 40}) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {tid, tid + 1};
+  }
+  insertCounters(table, staged);
+  ASSERT_EQ(6U, table.size());
+  EXPECT_EQ((std::vector<pid_t>{5, 10, 20, 25, 30, 40}), table.tids);
+  for (size_t i = 0U; i < table.size(); i++) {
+    EXPECT_EQ(table.tids[i], table.leader_fds[i]);
+    EXPECT_EQ(table.tids[i] + 1, table.group_fds[i][INSTRUCTIONS]);
+    EXPECT_EQ(nullptr, table.mmap_pages[i][CYCLES]);
+    EXPECT_EQ(nullptr, table.rings[i].page);
+  }
+}
+
 TEST_F(PcLibTest, readCounters) {
   createFakeCounters();
   ASSERT_EQ(NUMDIRS, counters.size());
   writeFakeCounters();
   int ctr = 0;
-  for (auto it = counters.begin(); it != counters.end(); it++) {
-    ASSERT_EQ(ctr + STDERR_FILENO + 1, it->second.group_fd[0]);
-    ASSERT_EQ(ctr + STDERR_FILENO + 2, it->second.group_fd[1]);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    ASSERT_EQ(ctr + STDERR_FILENO + 1, counters.group_fds[i][0]);
+    ASSERT_EQ(ctr + STDERR_FILENO + 2, counters.group_fds[i][1]);
+    ASSERT_EQ(counters.group_fds[i][CYCLES], counters.leader_fds[i]);
     errno = 0;
     std::unique_ptr<struct stat> cycles_buf(new struct stat);
-    EXPECT_EQ(0, fstat(it->second.group_fd[CYCLES], cycles_buf.get()));
-    EXPECT_EQ(sizeof(struct read_format), cycles_buf->st_size);
+    EXPECT_EQ(0, fstat(counters.group_fds[i][CYCLES], cycles_buf.get()));
+    EXPECT_EQ(sizeof(fake_read_format), cycles_buf->st_size);
     std::unique_ptr<struct stat> instructions_buf(new struct stat);
-    EXPECT_EQ(0,
-              fstat(it->second.group_fd[INSTRUCTIONS], instructions_buf.get()));
-    EXPECT_EQ(0, fstat(it->second.group_fd[CYCLES], instructions_buf.get()));
-    EXPECT_EQ(sizeof(struct read_format), instructions_buf->st_size);
+    EXPECT_EQ(0, fstat(counters.group_fds[i][INSTRUCTIONS],
+                       instructions_buf.get()));
+    EXPECT_EQ(0, fstat(counters.group_fds[i][CYCLES], instructions_buf.get()));
+    EXPECT_EQ(sizeof(fake_read_format), instructions_buf->st_size);
 
     // The write() syscall that populates the file data leaves the  file offset
     // at the end, with the result that read() syscall in readIt->Seconds()
     // reports that the file is empty.
-    ASSERT_EQ(0u, lseek(it->second.group_fd[0], 0u, SEEK_SET));
-    ASSERT_EQ(0u, lseek(it->second.group_fd[1], 0u, SEEK_SET));
+    ASSERT_EQ(0u, lseek(counters.group_fds[i][0], 0u, SEEK_SET));
+    ASSERT_EQ(0u, lseek(counters.group_fds[i][1], 0u, SEEK_SET));
 
     ctr += 2;
   }
   readCounters(counters);
 
   int idx = 0;
-  for (auto it = counters.begin(); it != counters.end(); it++) {
-    // First element of the map element is the key = PID.
-    EXPECT_EQ(idx, it->first);
-    EXPECT_EQ(OBSERVED_EVENTS, it->second.event_data.per_event_values.nr);
-    EXPECT_EQ(idx + 1,
-              it->second.event_data.per_event_values.values[CYCLES].id);
-    EXPECT_EQ(it->second.event_id[CYCLES],
-              it->second.event_data.per_event_values.values[CYCLES].id);
-    EXPECT_EQ(idx + 2,
-              it->second.event_data.per_event_values.values[CYCLES].value);
-    EXPECT_EQ(idx + 3,
-              it->second.event_data.per_event_values.values[INSTRUCTIONS].id);
-    EXPECT_EQ(it->second.event_id[INSTRUCTIONS],
-              it->second.event_data.per_event_values.values[INSTRUCTIONS].id);
-    EXPECT_EQ(
-        idx + 4,
-        it->second.event_data.per_event_values.values[INSTRUCTIONS].value);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    EXPECT_EQ(idx, counters.tids[i]);
+    EXPECT_EQ(idx + 1, counters.event_ids[i][CYCLES]);
+    EXPECT_EQ(idx + 2, counters.values[i][CYCLES]);
+    EXPECT_EQ(idx + 3, counters.event_ids[i][INSTRUCTIONS]);
+    EXPECT_EQ(idx + 4, counters.values[i][INSTRUCTIONS]);
 
     errno = 0;
-    EXPECT_EQ(0, close(it->second.group_fd[CYCLES]));
-    EXPECT_EQ(0, close(it->second.group_fd[INSTRUCTIONS]));
+    EXPECT_EQ(0, close(counters.group_fds[i][CYCLES]));
+    EXPECT_EQ(0, close(counters.group_fds[i][INSTRUCTIONS]));
+    idx++;
+  }
+  // The sum of idx + 2 and idx + 4 for idx from 0 to NUMDIRS - 1.
+  default_counter_table::values_type totals = sumCounters(counters);
+  EXPECT_EQ(NUMDIRS * (NUMDIRS - 1) / 2 + 2 * NUMDIRS, totals[CYCLES]);
+  EXPECT_EQ(NUMDIRS * (NUMDIRS - 1) / 2 + 4 * NUMDIRS, totals[INSTRUCTIONS]);
+}
+
+TEST(PcLibSimpleTest, takeDeltas) {
+  default_counter_table table{};
+  std::vector<default_pcounter> staged{};
+  for (const pid_t tid : {10, 20}) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {-1, -1};
+  }
+  insertCounters(table, staged);
+  table.prev_values[0] = {7U, 7U};
+  startFreeRunning(table);
+  EXPECT_TRUE(table.free_running);
+  EXPECT_EQ((default_counter_table::values_type{0U, 0U}),
+            table.prev_values[0]);
+
+  table.values = {{100U, 200U}, {10U, 20U}};
+  takeDeltas(table);
+  EXPECT_EQ((default_counter_table::values_type{100U, 200U}),
+            table.values[0]);
+  table.values = {{150U, 260U}, {10U, 25U}};
+  takeDeltas(table);
+  EXPECT_EQ((default_counter_table::values_type{50U, 60U}), table.values[0]);
+  EXPECT_EQ((default_counter_table::values_type{0U, 5U}), table.values[1]);
+  // A failed read leaves the last delta behind, which is below the raw count.
+  takeDeltas(table);
+  EXPECT_EQ((default_counter_table::values_type{0U, 0U}), table.values[0]);
+  EXPECT_EQ((default_counter_table::values_type{150U, 260U}),
+            table.prev_values[0]);
+
+  // A new thread's first interval counts from when its group was opened.
+  staged.clear();
+  staged.emplace_back(15);
+  staged.back().group_fd = {-1, -1};
+  insertCounters(table, staged);
+  ASSERT_EQ(15, table.tids[1]);
+  table.values = {{170U, 280U}, {3U, 4U}, {10U, 25U}};
+  takeDeltas(table);
+  EXPECT_EQ((default_counter_table::values_type{20U, 20U}), table.values[0]);
+  EXPECT_EQ((default_counter_table::values_type{3U, 4U}), table.values[1]);
+  EXPECT_EQ((default_counter_table::values_type{0U, 0U}), table.values[2]);
+}
+
+TEST(PcLibSimpleTest, scaleCount) {
+  EXPECT_EQ(100U, scaleCount(100U, {0U, 0U}));
+  EXPECT_EQ(100U, scaleCount(100U, {50U, 50U}));
+  EXPECT_EQ(0U, scaleCount(0U, {50U, 0U}));
+  EXPECT_EQ(400U, scaleCount(100U, {200U, 50U}));
+  // The intermediate product does not fit in 64 bits.
+  EXPECT_EQ(3U * (UINT64_MAX / 4U),
+            scaleCount(UINT64_MAX / 4U, {3000000000U, 1000000000U}));
+}
+
+TEST(PcLibSimpleTest, sumScaledCounters) {
+  default_counter_table table{};
+  std::vector<default_pcounter> staged{};
+  for (const pid_t tid : {10, 20}) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {-1, -1};
+  }
+  insertCounters(table, staged);
+  table.values = {{100U, 200U}, {10U, 20U}};
+  table.times = {{1000U, 1000U}, {1000U, 1000U}};
+  auto totals = sumScaledCounters(table);
+  EXPECT_EQ(110U, totals.estimates[CYCLES]);
+  EXPECT_EQ(220U, totals.estimates[INSTRUCTIONS]);
+  EXPECT_DOUBLE_EQ(1.0, totals.confidence);
+
+  // The second group was on the PMU for half of its time.
+  table.times[1] = {1000U, 500U};
+  totals = sumScaledCounters(table);
+  EXPECT_EQ(120U, totals.estimates[CYCLES]);
+  EXPECT_EQ(240U, totals.estimates[INSTRUCTIONS]);
+  EXPECT_DOUBLE_EQ(0.75, totals.confidence);
+
+  // Free-running tables scale each interval by its own times.
+  startFreeRunning(table);
+  table.times = {{1000U, 1000U}, {1000U, 500U}};
+  takeDeltas(table);
+  table.values = {{300U, 600U}, {40U, 80U}};
+  table.times = {{2000U, 2000U}, {2000U, 1500U}};
+  takeDeltas(table);
+  EXPECT_EQ(1000U, table.times[1].running);
+  totals = sumScaledCounters(table);
+  EXPECT_EQ(230U, totals.estimates[CYCLES]);
+  EXPECT_DOUBLE_EQ(1.0, totals.confidence);
+}
+
+TEST(PcLibSimpleTest, eventRotation) {
+  using branch_table =
+      counter_table<branch_instructions_event, branch_misses_event>;
+  event_rotation<default_counter_table, branch_table, default_counter_table>
+      rotation{};
+  EXPECT_EQ(3U, rotation.GROUPS);
+  std::vector<size_t> sizes{};
+  rotation.forEach([&sizes](auto &table) {
+    resizeTable(table, sizes.size() + 1U);
+    sizes.push_back(table.size());
+  });
+  EXPECT_EQ((std::vector<size_t>{1U, 2U, 3U}), sizes);
+  std::vector<size_t> turns{};
+  for (int interval = 0; interval < 4; interval++) {
+    rotation.withActive(
+        [&turns](auto &table) { turns.push_back(table.size()); });
+    rotation.rotate();
+  }
+  EXPECT_EQ((std::vector<size_t>{1U, 2U, 3U, 1U}), turns);
+}
+
+TEST(PcLibSimpleTest, readMmapPage) {
+  std::unique_ptr<struct perf_event_mmap_page> page(
+      new struct perf_event_mmap_page);
+  memset(page.get(), 0, sizeof(struct perf_event_mmap_page));
+  page->offset = 42;
+  // Userspace reads not permitted.
+  page->index = 1;
+  EXPECT_FALSE(readMmapPage(page.get()).first);
+  // Permitted, but the event is not scheduled on a counter.
+  page->cap_user_rdpmc = 1;
+  page->index = 0;
+  EXPECT_FALSE(readMmapPage(page.get()).first);
+}
+
+TEST_F(PcLibTest, readCountersRdpmcFallback) {
+  createFakeCounters();
+  writeFakeCounters();
+  for (const int leader : counters.leader_fds) {
+    ASSERT_EQ(0u, lseek(leader, 0u, SEEK_SET));
+  }
+  // No pages are mapped, so every counter, including the one for pid 0, which
+  // is the calling thread, is read with read().
+  readCountersRdpmc(counters);
+  int idx = 0;
+  for (size_t i = 0U; i < counters.size(); i++) {
+    EXPECT_EQ(idx + 2, counters.values[i][CYCLES]);
+    EXPECT_EQ(idx + 4, counters.values[i][INSTRUCTIONS]);
+    closeCounterFds(counters, i);
     idx++;
   }
 }
@@ -281,13 +687,14 @@ TEST_F(PcLibErrorTest, BadFileDescriptors) {
   readCounters(counters);
   EXPECT_EQ(0u, counters.size());
 
+  std::vector<default_pcounter> staged{};
   for (int i = 0; i < NUMDIRS; i++) {
-    struct pcounter pc(static_cast<pid_t>(i));
+    default_pcounter pc(static_cast<pid_t>(i));
     pc.group_fd[CYCLES] = STDIN_FILENO;
     pc.group_fd[INSTRUCTIONS] = STDOUT_FILENO;
-    counters.insert(
-        std::pair<pid_t, struct pcounter>{static_cast<pid_t>(i), pc});
+    staged.push_back(pc);
   }
+  insertCounters(counters, staged);
   readCounters(counters);
   for (int i = 0; i < NUMDIRS; i++) {
     EXPECT_THAT(cerrStringstream->str(),
@@ -296,4 +703,25 @@ TEST_F(PcLibErrorTest, BadFileDescriptors) {
   }
 }
 
+TEST(PcLibSimpleTest, printResultsEmptyInterval) {
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printResults(100U, 200U, std::chrono::nanoseconds(0));
+  printBranchResults(100U, 10U, std::chrono::nanoseconds(0));
+  cout.rdbuf(old_cout);
+  EXPECT_TRUE(out.str().empty());
+}
+
+TEST(PcLibSimpleTest, printRate) {
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printRate(3000000000U, "cycles", std::chrono::seconds(2));
+  printConfidence(1.0);
+  printConfidence(0.5);
+  cout.rdbuf(old_cout);
+  EXPECT_EQ("Got 1500000000 (1.5 billion) cycles per second\n"
+            "Counted 50% of the time; values are scaled estimates\n",
+            out.str());
+}
+
 } // namespace local_testing
@@ -0,0 +1,136 @@
+#include "region_profiler.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+namespace {
+// The registered regions and the live threads, and the counts of the threads
+// which exited.  Only registration, thread start and exit and
+// regionTotals() take the lock, never entering or leaving a region.
+std::mutex registry_lock;
+std::vector<std::string> region_names;
+std::vector<region_thread_state *> live_threads;
+struct retired_totals {
+  uint64_t calls;
+  default_counter_table::values_type values;
+};
+std::vector<struct retired_totals> retired(MAX_REGIONS);
+
+void addSlot(const region_slot &slot, uint64_t &calls,
+             default_counter_table::values_type &values) {
+  calls += slot.calls.load(std::memory_order_relaxed);
+  for (uint32_t ev = 0U; ev < default_counter_table::OBSERVED_EVENTS; ev++) {
+    values[ev] += slot.values[ev].load(std::memory_order_relaxed);
+  }
+}
+} // namespace
+
+// The group counts the calling thread (pid 0) on any CPU and runs from now
+// on, so that regions need no ioctl()s.
+region_thread_state::region_thread_state()
+    : counters{}, counting(false), slots{} {
+  std::vector<default_pcounter> staged{};
+  staged.emplace_back(0);
+  setupCounter(staged.back());
+  if (staged.back().group_fd[0] > STDERR_FILENO) {
+    insertCounters(counters, staged);
+    ioctl(counters.leader_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    mapCounters(counters);
+    counting = true;
+  } else {
+    for (const int fd : staged.back().group_fd) {
+      closeCounterFd(fd);
+    }
+  }
+  std::lock_guard<std::mutex> guard(registry_lock);
+  live_threads.push_back(this);
+}
+
+region_thread_state::~region_thread_state() {
+  {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    for (size_t region = 0U; region < MAX_REGIONS; region++) {
+      addSlot(slots[region], retired[region].calls, retired[region].values);
+    }
+    live_threads.erase(
+        std::find(live_threads.begin(), live_threads.end(), this));
+  }
+  if (counting) {
+    closeCounterFds(counters, 0U);
+  }
+}
+
+default_counter_table::values_type region_thread_state::read() {
+  default_counter_table::values_type values{};
+  if (!counting) {
+    return values;
+  }
+  bool read_all = true;
+  for (uint32_t ev = 0U; ev < default_counter_table::OBSERVED_EVENTS; ev++) {
+    if (nullptr == counters.mmap_pages[0][ev]) {
+      read_all = false;
+      break;
+    }
+    const std::pair<bool, uint64_t> res =
+        readMmapPage(counters.mmap_pages[0][ev]);
+    if (!res.first) {
+      read_all = false;
+      break;
+    }
+    values[ev] = res.second;
+  }
+  if (read_all) {
+    return values;
+  }
+  readCounter(counters, 0U);
+  return counters.values[0];
+}
+
+region_thread_state &regionThreadState() {
+  thread_local region_thread_state state;
+  return state;
+}
+
+// A name which is registered twice, for example by two call sites, gets the
+// same id.  Regions beyond MAX_REGIONS share the last slot.
+size_t registerRegion(const char *name) {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  auto it = std::find(region_names.begin(), region_names.end(), name);
+  if (it != region_names.end()) {
+    return it - region_names.begin();
+  }
+  if (region_names.size() == MAX_REGIONS) {
+    std::cerr << "Too many regions, counting " << name << " as "
+              << region_names.back() << std::endl;
+    return MAX_REGIONS - 1U;
+  }
+  region_names.emplace_back(name);
+  return region_names.size() - 1U;
+}
+
+std::vector<struct region_totals> regionTotals() {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  std::vector<struct region_totals> totals(region_names.size());
+  for (size_t region = 0U; region < region_names.size(); region++) {
+    struct region_totals &t = totals[region];
+    t.name = region_names[region];
+    t.calls = retired[region].calls;
+    t.values = retired[region].values;
+    for (const region_thread_state *state : live_threads) {
+      addSlot(state->slots[region], t.calls, t.values);
+    }
+  }
+  return totals;
+}
+
+void printRegionTotals(const std::vector<struct region_totals> &totals) {
+  for (const struct region_totals &t : totals) {
+    std::cout << t.name << ": " << t.calls << " calls, " << t.values[CYCLES]
+              << " cycles, " << t.values[INSTRUCTIONS] << " instructions";
+    if (t.values[CYCLES]) {
+      std::cout << ", IPC "
+                << (float)t.values[INSTRUCTIONS] / (float)t.values[CYCLES];
+    }
+    std::cout << std::endl;
+  }
+}
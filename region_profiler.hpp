@@ -0,0 +1,98 @@
+#ifndef REGION_PROFILER_HPP
+#define REGION_PROFILER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The most regions a program can name.  Slots are preallocated, so entering a
+// region never allocates.
+constexpr size_t MAX_REGIONS = 256U;
+constexpr size_t CACHE_LINE_SIZE = 64U;
+
+// One region's counts in one thread.  Only the owning thread writes them, so
+// relaxed loads and stores suffice and no locked instructions are needed; the
+// atomics only keep the reads of regionTotals() well-defined.  Each slot has a
+// cache line of its own so that neighbouring slots do not falsely share.
+struct alignas(CACHE_LINE_SIZE) region_slot {
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> values[default_counter_table::OBSERVED_EVENTS];
+};
+
+// The counter group of the calling thread and its region slots.  Created on a
+// thread's first region and merged into the retired totals when the thread
+// exits, so that no counts are lost.
+struct region_thread_state {
+  region_thread_state();
+  ~region_thread_state();
+  region_thread_state(const region_thread_state &) = delete;
+  region_thread_state &operator=(const region_thread_state &) = delete;
+
+  // Read the thread's counts, with rdpmc if the kernel permits it and with
+  // read() otherwise.  All zero if the counters could not be opened.
+  default_counter_table::values_type read();
+
+  // One entry, for the calling thread.
+  default_counter_table counters;
+  bool counting;
+  region_slot slots[MAX_REGIONS];
+};
+
+// The state of the calling thread.
+region_thread_state &regionThreadState();
+
+// The id of the region called name, which is registered on first use.
+size_t registerRegion(const char *name);
+
+struct region_totals {
+  std::string name;
+  uint64_t calls;
+  default_counter_table::values_type values;
+};
+
+// Merge the slots of all threads, live and exited, into one entry per
+// registered region.
+std::vector<struct region_totals> regionTotals();
+
+void printRegionTotals(const std::vector<struct region_totals> &totals);
+
+// Counts the cycles and instructions of the calling thread from construction
+// to destruction, and adds them to a region's slot.  Nested regions each
+// count their whole extent.
+struct scoped_counter {
+  explicit scoped_counter(const size_t region)
+      : state(regionThreadState()), slot(state.slots[region]),
+        start(state.read()) {}
+  ~scoped_counter() {
+    const default_counter_table::values_type end = state.read();
+    slot.calls.store(slot.calls.load(std::memory_order_relaxed) + 1U,
+                     std::memory_order_relaxed);
+    for (uint32_t ev = 0U; ev < default_counter_table::OBSERVED_EVENTS; ev++) {
+      slot.values[ev].store(slot.values[ev].load(std::memory_order_relaxed) +
+                                (end[ev] - start[ev]),
+                            std::memory_order_relaxed);
+    }
+  }
+  scoped_counter(const scoped_counter &) = delete;
+  scoped_counter &operator=(const scoped_counter &) = delete;
+
+  region_thread_state &state;
+  region_slot &slot;
+  const default_counter_table::values_type start;
+};
+
+#define PERF_REGION_CONCAT_(a, b) a##b
+#define PERF_REGION_CONCAT(a, b) PERF_REGION_CONCAT_(a, b)
+// Count the rest of the enclosing scope as region name, which must be a
+// string literal.  The region is looked up once per call site.
+#define PERF_REGION(name)                                                      \
+  static const size_t PERF_REGION_CONCAT(perf_region_id_, __LINE__) =          \
+      registerRegion(name);                                                    \
+  scoped_counter PERF_REGION_CONCAT(perf_region_, __LINE__)(                   \
+      PERF_REGION_CONCAT(perf_region_id_, __LINE__))
+
+#endif // REGION_PROFILER_HPP
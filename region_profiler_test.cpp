@@ -0,0 +1,95 @@
+#include "region_profiler.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <sstream>
+#include <thread>
+
+using namespace std;
+
+namespace local_testing {
+
+// The totals of the named region, or all zero if it is not registered.
+struct region_totals findRegion(const std::string &name) {
+  for (const struct region_totals &t : regionTotals()) {
+    if (t.name == name) {
+      return t;
+    }
+  }
+  return {name, 0U, {}};
+}
+
+// Whether perf_event_open() is permitted or not, calls are always counted.
+void spin(const int iterations) {
+  PERF_REGION("spin");
+  volatile int sink = 0;
+  for (int i = 0; i < iterations; i++) {
+    sink = sink + i;
+  }
+}
+
+TEST(RegionProfilerSimpleTest, slotsArePadded) {
+  EXPECT_EQ(0U, sizeof(region_slot) % CACHE_LINE_SIZE);
+  EXPECT_EQ(0U, alignof(region_slot) % CACHE_LINE_SIZE);
+}
+
+TEST(RegionProfilerSimpleTest, registerRegion) {
+  const size_t first = registerRegion("registered");
+  EXPECT_EQ(first, registerRegion("registered"));
+  EXPECT_NE(first, registerRegion("registered too"));
+}
+
+TEST(RegionProfilerSimpleTest, countCalls) {
+  const uint64_t before = findRegion("spin").calls;
+  for (int i = 0; i < 10; i++) {
+    spin(1000);
+  }
+  const struct region_totals after = findRegion("spin");
+  EXPECT_EQ(before + 10U, after.calls);
+  // A thread which can count sees the work inside the region.
+  if (regionThreadState().counting) {
+    EXPECT_GT(after.values[INSTRUCTIONS], 10000U);
+  }
+}
+
+TEST(RegionProfilerSimpleTest, nestedRegions) {
+  const uint64_t outer_before = findRegion("outer").calls;
+  const uint64_t spin_before = findRegion("spin").calls;
+  {
+    PERF_REGION("outer");
+    spin(100);
+    spin(100);
+  }
+  EXPECT_EQ(outer_before + 1U, findRegion("outer").calls);
+  EXPECT_EQ(spin_before + 2U, findRegion("spin").calls);
+}
+
+TEST(RegionProfilerSimpleTest, exitedThreads) {
+  // The counts of the threads survive their exit.
+  const uint64_t before = findRegion("spin").calls;
+  std::vector<std::thread> threads{};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 25; i++) {
+        spin(100);
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(before + 100U, findRegion("spin").calls);
+}
+
+TEST(RegionProfilerSimpleTest, printRegionTotals) {
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printRegionTotals({{"printed", 3U, {200U, 100U}}});
+  cout.rdbuf(old_cout);
+  EXPECT_THAT(out.str(),
+              testing::StartsWith("printed: 3 calls, 200 cycles, 100 "
+                                  "instructions, IPC 0.5"));
+}
+
+} // namespace local_testing
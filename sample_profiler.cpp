@@ -0,0 +1,56 @@
+#include "sample_profiler.hpp"
+
+#include <iomanip>
+
+// The watermark is in bytes.
+struct sampling_spec profileSampling(const uint64_t period, const uint32_t slot,
+                                     const uint32_t ring_pages) {
+  struct sampling_spec spec{};
+  spec.period = period;
+  spec.slot = slot;
+  spec.type = PROFILE_SAMPLE_TYPE;
+  spec.ring_pages = ring_pages;
+  spec.watermark = (ring_pages * sysconf(_SC_PAGESIZE)) / 2U;
+  return spec;
+}
+
+// struct {
+//   struct perf_event_header header;
+//   u64 ip;                    PERF_SAMPLE_IP
+//   u32 pid, tid;              PERF_SAMPLE_TID
+//   u64 time;                  PERF_SAMPLE_TIME
+//   struct read_format values; PERF_SAMPLE_READ
+// };
+bool parseSample(const char *record, struct sample_view &sample) {
+  constexpr size_t FIXED_SIZE = sizeof(struct perf_event_header) +
+                                (6U * sizeof(uint64_t));
+  struct perf_event_header header;
+  memcpy(&header, record, sizeof(header));
+  if (header.size < FIXED_SIZE) {
+    return false;
+  }
+  const char *field = record + sizeof(header);
+  memcpy(&sample.ip, field, sizeof(sample.ip));
+  memcpy(&sample.pid, field + 8U, sizeof(sample.pid));
+  memcpy(&sample.tid, field + 12U, sizeof(sample.tid));
+  memcpy(&sample.time, field + 16U, sizeof(sample.time));
+  memcpy(&sample.nr, field + 24U, sizeof(sample.nr));
+  memcpy(&sample.time_enabled, field + 32U, sizeof(sample.time_enabled));
+  memcpy(&sample.time_running, field + 40U, sizeof(sample.time_running));
+  if (sample.nr > ((header.size - FIXED_SIZE) / (2U * sizeof(uint64_t)))) {
+    return false;
+  }
+  // Records are 8-byte aligned in the ring and in the scratch buffer.
+  sample.values = reinterpret_cast<const uint64_t *>(field + 48U);
+  return true;
+}
+
+void printHotAddress(const uint64_t ip, const uint64_t samples,
+                     const uint64_t cycles, const uint64_t instructions) {
+  std::cout << "  0x" << std::hex << std::setw(16) << std::setfill('0') << ip
+            << std::dec << std::setfill(' ') << " " << samples << " samples";
+  if (cycles) {
+    std::cout << ", IPC " << (float)instructions / (float)cycles;
+  }
+  std::cout << std::endl;
+}
@@ -0,0 +1,213 @@
+#ifndef SAMPLE_PROFILER_HPP
+#define SAMPLE_PROFILER_HPP
+
+#include "performance_counter_lib.hpp"
+#include "thread_report.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// The fields of each sample, in the order in which the kernel writes them.
+// PERF_SAMPLE_READ appends the group read, in the table's read_format.
+constexpr uint64_t PROFILE_SAMPLE_TYPE =
+    PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_READ;
+
+// The sampling settings for a table whose event in slot samples every period
+// counts.  Each thread's ring holds ring_pages pages, and the kernel wakes the
+// consumer once half of it is full, which leaves the other half for the
+// samples which arrive before the consumer gets to it.
+struct sampling_spec profileSampling(const uint64_t period, const uint32_t slot,
+                                     const uint32_t ring_pages);
+
+// One PERF_RECORD_SAMPLE.  values points into the record, at nr pairs of
+// {value, id}, so the counts are not copied.
+struct sample_view {
+  uint64_t ip;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time;
+  uint64_t nr;
+  uint64_t time_enabled;
+  uint64_t time_running;
+  const uint64_t *values;
+
+  uint64_t value(const uint64_t ev) const { return values[2U * ev]; }
+  uint64_t id(const uint64_t ev) const { return values[(2U * ev) + 1U]; }
+};
+
+// Parse the sample of PROFILE_SAMPLE_TYPE which starts with header at record.
+// False if the record is too short for its group.
+bool parseSample(const char *record, struct sample_view &sample);
+
+// Hand every sample in ring to on_sample and release the space.  Records lie
+// in the ring, which is read in place; only a record which wraps around the
+// end of the ring is first copied into scratch.  Returns the number of
+// samples which the kernel reported lost because the ring was full.
+template <class F>
+uint64_t consumeRing(const struct perf_ring &ring, std::vector<char> &scratch,
+                     F &&on_sample) {
+  if (nullptr == ring.page) {
+    return 0U;
+  }
+  struct perf_event_mmap_page *meta = ring.page;
+  const uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = meta->data_tail;
+  const uint64_t data_offset =
+      meta->data_offset ? meta->data_offset : sysconf(_SC_PAGESIZE);
+  const uint64_t data_size =
+      meta->data_size ? meta->data_size : (ring.size - data_offset);
+  const char *data = reinterpret_cast<const char *>(meta) + data_offset;
+  uint64_t lost = 0U;
+  struct sample_view sample;
+  while (tail < head) {
+    const uint64_t offset = tail % data_size;
+    struct perf_event_header header;
+    memcpy(&header, data + offset, sizeof(header));
+    if (0U == header.size) {
+      break;
+    }
+    const char *record = data + offset;
+    if ((offset + header.size) > data_size) {
+      scratch.resize(header.size);
+      const uint64_t first = data_size - offset;
+      memcpy(scratch.data(), record, first);
+      memcpy(scratch.data() + first, data, header.size - first);
+      record = scratch.data();
+    }
+    if ((PERF_RECORD_SAMPLE == header.type) && parseSample(record, sample)) {
+      on_sample(sample);
+    } else if (PERF_RECORD_LOST == header.type) {
+      // struct { header; u64 id; u64 lost; }
+      uint64_t n = 0U;
+      memcpy(&n, record + sizeof(header) + sizeof(uint64_t), sizeof(n));
+      lost += n;
+    }
+    tail += header.size;
+  }
+  __atomic_store_n(&meta->data_tail, head, __ATOMIC_RELEASE);
+  return lost;
+}
+
+// Per-thread histograms of the sampled instruction addresses.  Each sample
+// also carries its group's counts, and the counts since the previous sample
+// of the same group are charged to the sample's address, so that hot
+// addresses come with their own IPC.
+template <class Table> struct sample_profile {
+  using values_type = typename Table::values_type;
+  struct ip_entry {
+    uint64_t samples;
+    values_type counts;
+  };
+  struct thread_samples {
+    uint64_t samples;
+    std::unordered_map<uint64_t, ip_entry> ips;
+  };
+
+  void add(const struct sample_view &sample) {
+    samples++;
+    thread_samples &thread = threads[static_cast<pid_t>(sample.tid)];
+    thread.samples++;
+    ip_entry &entry = thread.ips[sample.ip];
+    entry.samples++;
+    if (sample.nr != Table::OBSERVED_EVENTS) {
+      return;
+    }
+    // The leader's id tells the groups apart, however many threads share one,
+    // as in per-CPU mode.  A count below the previous one was reset.
+    values_type &prev = previous[sample.id(0U)];
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      const uint64_t count = sample.value(ev);
+      entry.counts[ev] += (count >= prev[ev]) ? (count - prev[ev]) : count;
+      prev[ev] = count;
+    }
+  }
+
+  // Forget the histograms, but not the counts of the groups, which the next
+  // samples are charged against.
+  void clear() {
+    threads.clear();
+    samples = 0U;
+    lost = 0U;
+  }
+
+  // Forget the counts of the groups which are no longer in counters, such as
+  // those of exited threads, after the table was culled.
+  void prune(const Table &counters) {
+    std::unordered_set<uint64_t> ids{};
+    for (const auto &event_ids : counters.event_ids) {
+      ids.insert(event_ids[0]);
+    }
+    for (auto it = previous.begin(); it != previous.end();) {
+      it = ids.count(it->first) ? std::next(it) : previous.erase(it);
+    }
+  }
+
+  std::unordered_map<pid_t, thread_samples> threads;
+  std::unordered_map<uint64_t, values_type> previous;
+  uint64_t samples = 0U;
+  uint64_t lost = 0U;
+};
+
+// Drain the rings of every group in the table into profile.
+template <class Table>
+void consumeSamples(const Table &counters, sample_profile<Table> &profile,
+                    std::vector<char> &scratch) {
+  for (const struct perf_ring &ring : counters.rings) {
+    profile.lost += consumeRing(
+        ring, scratch,
+        [&profile](const struct sample_view &sample) { profile.add(sample); });
+  }
+}
+
+void printHotAddress(const uint64_t ip, const uint64_t samples,
+                     const uint64_t cycles, const uint64_t instructions);
+
+// Print the n threads with the most samples, each with its n hottest
+// addresses.  The table must count cycles and instructions in the CYCLES and
+// INSTRUCTIONS slots.
+template <class Table>
+void printSampleProfile(const sample_profile<Table> &profile,
+                        thread_names &names, const size_t n) {
+  if (0U == profile.samples) {
+    return;
+  }
+  std::cout << profile.samples << " samples";
+  if (profile.lost) {
+    std::cout << ", " << profile.lost << " lost";
+  }
+  std::cout << std::endl;
+  using profile_type = sample_profile<Table>;
+  std::vector<std::pair<pid_t, const typename profile_type::thread_samples *>>
+      threads{};
+  for (const auto &thread : profile.threads) {
+    threads.emplace_back(thread.first, &thread.second);
+  }
+  const size_t k = std::min(n, threads.size());
+  std::partial_sort(threads.begin(), threads.begin() + k, threads.end(),
+                    [](const auto &a, const auto &b) {
+                      return a.second->samples > b.second->samples;
+                    });
+  for (size_t t = 0U; t < k; t++) {
+    const pid_t tid = threads[t].first;
+    std::cout << names.name(tid) << " (" << tid << "): "
+              << threads[t].second->samples << " samples" << std::endl;
+    std::vector<std::pair<uint64_t, typename profile_type::ip_entry>> ips(
+        threads[t].second->ips.begin(), threads[t].second->ips.end());
+    const size_t m = std::min(n, ips.size());
+    std::partial_sort(ips.begin(), ips.begin() + m, ips.end(),
+                      [](const auto &a, const auto &b) {
+                        return a.second.samples > b.second.samples;
+                      });
+    for (size_t i = 0U; i < m; i++) {
+      printHotAddress(ips[i].first, ips[i].second.samples,
+                      ips[i].second.counts[CYCLES],
+                      ips[i].second.counts[INSTRUCTIONS]);
+    }
+  }
+}
+
+#endif // SAMPLE_PROFILER_HPP
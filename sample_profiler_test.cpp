@@ -0,0 +1,196 @@
+#include "sample_profiler.hpp"
+
+#include "fake_ring.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <sstream>
+
+using namespace std;
+
+constexpr uint32_t OBSERVED_EVENTS = default_counter_table::OBSERVED_EVENTS;
+
+namespace local_testing {
+
+// A sample of PROFILE_SAMPLE_TYPE from the default group.
+struct fake_sample {
+  struct perf_event_header header;
+  uint64_t ip;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t time;
+  struct read_format<OBSERVED_EVENTS> group;
+};
+
+// Rings which hold samples of the default group.
+struct SampleProfilerTest : public FakeRingTest {
+  // Append a sample of tid at ip whose group has counted cycles and
+  // instructions.
+  void writeSample(const uint32_t tid, const uint64_t ip,
+                   const uint64_t cycles, const uint64_t instructions) {
+    fake_sample sample{};
+    sample.header = {PERF_RECORD_SAMPLE, 0U, sizeof(sample)};
+    sample.ip = ip;
+    sample.pid = 1U;
+    sample.tid = tid;
+    sample.time = head;
+    sample.group.nr = OBSERVED_EVENTS;
+    sample.group.values[CYCLES] = {cycles, 100U + tid};
+    sample.group.values[INSTRUCTIONS] = {instructions, 200U + tid};
+    write(head, &sample, sizeof(sample));
+    head += sizeof(sample);
+  }
+
+  std::vector<char> scratch{};
+};
+
+TEST(SampleProfilerSimpleTest, parseSample) {
+  fake_sample record{};
+  record.header = {PERF_RECORD_SAMPLE, 0U, sizeof(record)};
+  record.ip = 0x401000U;
+  record.tid = 7U;
+  record.time = 99U;
+  record.group.nr = OBSERVED_EVENTS;
+  record.group.time_enabled = 10U;
+  record.group.time_running = 5U;
+  record.group.values[INSTRUCTIONS] = {300U, 4U};
+  struct sample_view sample {};
+  ASSERT_TRUE(parseSample(reinterpret_cast<const char *>(&record), sample));
+  EXPECT_EQ(0x401000U, sample.ip);
+  EXPECT_EQ(7U, sample.tid);
+  EXPECT_EQ(99U, sample.time);
+  EXPECT_EQ(OBSERVED_EVENTS, sample.nr);
+  EXPECT_EQ(5U, sample.time_running);
+  EXPECT_EQ(300U, sample.value(INSTRUCTIONS));
+  EXPECT_EQ(4U, sample.id(INSTRUCTIONS));
+  // A group larger than the record.
+  record.header.size = sizeof(record) - 8U;
+  EXPECT_FALSE(parseSample(reinterpret_cast<const char *>(&record), sample));
+}
+
+TEST(SampleProfilerSimpleTest, profileSampling) {
+  const struct sampling_spec spec = profileSampling(100000U, CYCLES, 8U);
+  EXPECT_EQ(100000U, spec.period);
+  EXPECT_EQ(CYCLES, spec.slot);
+  EXPECT_EQ(PROFILE_SAMPLE_TYPE, spec.type);
+  EXPECT_EQ(8U, spec.ring_pages);
+  EXPECT_EQ(4U * sysconf(_SC_PAGESIZE), spec.watermark);
+}
+
+TEST_F(SampleProfilerTest, consumeRing) {
+  writeSample(10U, 0x1000U, 100U, 50U);
+  writeLost(3U);
+  writeSample(20U, 0x2000U, 100U, 200U);
+  publish();
+  std::vector<uint64_t> ips{};
+  EXPECT_EQ(3U, consumeRing(ring, scratch,
+                            [&ips](const struct sample_view &sample) {
+                              ips.push_back(sample.ip);
+                            }));
+  EXPECT_THAT(ips, testing::ElementsAre(0x1000U, 0x2000U));
+  EXPECT_EQ(head, ring.page->data_tail);
+  // Records which fit were read in place.
+  EXPECT_TRUE(scratch.empty());
+  ips.clear();
+  EXPECT_EQ(0U, consumeRing(ring, scratch,
+                            [&ips](const struct sample_view &sample) {
+                              ips.push_back(sample.ip);
+                            }));
+  EXPECT_TRUE(ips.empty());
+}
+
+TEST_F(SampleProfilerTest, consumeWrappedRecord) {
+  // The second sample straddles the end of the ring.
+  seek(page_size - sizeof(fake_sample) - 16U);
+  writeSample(10U, 0x1000U, 100U, 50U);
+  writeSample(10U, 0x3000U, 300U, 450U);
+  publish();
+  std::vector<struct sample_view> samples{};
+  std::vector<uint64_t> instructions{};
+  consumeRing(ring, scratch,
+              [&](const struct sample_view &sample) {
+                samples.push_back(sample);
+                instructions.push_back(sample.value(INSTRUCTIONS));
+              });
+  ASSERT_EQ(2U, samples.size());
+  EXPECT_EQ(0x3000U, samples[1].ip);
+  EXPECT_EQ(450U, instructions[1]);
+  EXPECT_EQ(sizeof(fake_sample), scratch.size());
+  EXPECT_EQ(head, ring.page->data_tail);
+}
+
+TEST_F(SampleProfilerTest, profile) {
+  sample_profile<default_counter_table> profile{};
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  staged.emplace_back(10);
+  staged.back().group_fd = {-1, -1};
+  insertCounters(counters, staged);
+  counters.rings[0] = ring;
+
+  // Each sample is charged with the counts since the group's last one.
+  writeSample(10U, 0x1000U, 100U, 50U);
+  writeSample(10U, 0x1000U, 300U, 250U);
+  writeSample(10U, 0x2000U, 400U, 650U);
+  writeSample(20U, 0x2000U, 100U, 100U);
+  writeLost(2U);
+  publish();
+  consumeSamples(counters, profile, scratch);
+  EXPECT_EQ(4U, profile.samples);
+  EXPECT_EQ(2U, profile.lost);
+  ASSERT_EQ(2U, profile.threads.size());
+  const auto &thread = profile.threads.at(10);
+  EXPECT_EQ(3U, thread.samples);
+  EXPECT_EQ(2U, thread.ips.at(0x1000U).samples);
+  EXPECT_EQ(300U, thread.ips.at(0x1000U).counts[CYCLES]);
+  EXPECT_EQ(250U, thread.ips.at(0x1000U).counts[INSTRUCTIONS]);
+  EXPECT_EQ(100U, thread.ips.at(0x2000U).counts[CYCLES]);
+  EXPECT_EQ(400U, thread.ips.at(0x2000U).counts[INSTRUCTIONS]);
+
+  // The group was reset, so its counts start over.
+  profile.clear();
+  writeSample(10U, 0x1000U, 40U, 20U);
+  publish();
+  consumeSamples(counters, profile, scratch);
+  EXPECT_EQ(1U, profile.samples);
+  EXPECT_EQ(0U, profile.lost);
+  EXPECT_EQ(40U, profile.threads.at(10).ips.at(0x1000U).counts[CYCLES]);
+
+  // Only the groups in the table keep their counts.
+  counters.event_ids[0] = {110U, 210U};
+  profile.prune(counters);
+  EXPECT_EQ(1U, profile.previous.size());
+  EXPECT_EQ(1U, profile.previous.count(110U));
+  // The ring is not a real mapping.
+  counters.rings[0] = {nullptr, 0U};
+}
+
+TEST_F(SampleProfilerTest, printSampleProfile) {
+  sample_profile<default_counter_table> profile{};
+  thread_names names("/nonexistent/", {});
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printSampleProfile(profile, names, 3U);
+  EXPECT_TRUE(out.str().empty());
+
+  writeSample(10U, 0x1000U, 100U, 50U);
+  writeSample(10U, 0x2000U, 200U, 450U);
+  writeSample(10U, 0x2000U, 300U, 650U);
+  writeSample(20U, 0x3000U, 100U, 100U);
+  publish();
+  consumeRing(ring, scratch, [&profile](const struct sample_view &sample) {
+    profile.add(sample);
+  });
+  printSampleProfile(profile, names, 1U);
+  cout.rdbuf(old_cout);
+  EXPECT_THAT(out.str(), testing::HasSubstr("4 samples\n"));
+  EXPECT_THAT(out.str(), testing::HasSubstr(" (10): 3 samples\n"));
+  EXPECT_THAT(out.str(),
+              testing::HasSubstr("  0x0000000000002000 2 samples, IPC 3\n"));
+  EXPECT_THAT(out.str(), testing::Not(testing::HasSubstr("(20)")));
+  EXPECT_THAT(out.str(),
+              testing::Not(testing::HasSubstr("0x0000000000001000")));
+}
+
+} // namespace local_testing
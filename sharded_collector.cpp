@@ -0,0 +1,71 @@
+#include "sharded_collector.hpp"
+
+#include <sched.h>
+
+#include <cstring>
+
+// The workers and the calling thread all take part in both barriers.
+sharded_collector::sharded_collector(const std::vector<int> &cpus)
+    : shards(cpus.size()), workers{}, start{}, done{}, job(nullptr),
+      ready(false) {
+  int res = pthread_barrier_init(&start, nullptr, cpus.size() + 1U);
+  if (0 == res) {
+    res = pthread_barrier_init(&done, nullptr, cpus.size() + 1U);
+    if (res) {
+      pthread_barrier_destroy(&start);
+    }
+  }
+  if (res) {
+    std::cerr << "Failed to create the barriers for " << cpus.size()
+              << " workers: " << strerror(res) << std::endl;
+    return;
+  }
+  ready = true;
+  workers.reserve(cpus.size());
+  for (size_t shard = 0U; shard < cpus.size(); shard++) {
+    workers.emplace_back(&sharded_collector::work, this, shard, cpus[shard]);
+  }
+}
+
+// A null job tells the workers to exit.
+sharded_collector::~sharded_collector() {
+  if (!ready) {
+    return;
+  }
+  job = nullptr;
+  pthread_barrier_wait(&start);
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  pthread_barrier_destroy(&start);
+  pthread_barrier_destroy(&done);
+}
+
+void sharded_collector::run(const job_type &next_job) {
+  job = &next_job;
+  pthread_barrier_wait(&start);
+  pthread_barrier_wait(&done);
+  job = nullptr;
+}
+
+void sharded_collector::work(const size_t shard, const int cpu) {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  const int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                         &cpuset);
+  if (res) {
+    std::cerr << "Failed to pin shard " << shard << " to CPU " << cpu << " "
+              << strerror(res) << std::endl;
+  }
+  while (true) {
+    pthread_barrier_wait(&start);
+    // The barrier orders this read after the store in run().
+    const job_type *current = job;
+    if (nullptr == current) {
+      return;
+    }
+    (*current)(shard, shards);
+    pthread_barrier_wait(&done);
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef SHARDED_COLLECTOR_HPP
+#define SHARDED_COLLECTOR_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// The [begin, end) range of table entries which belongs to shard of shards.
+inline std::pair<size_t, size_t> shardRange(const size_t entries,
+                                            const size_t shard,
+                                            const size_t shards) {
+  return {(entries * shard) / shards, (entries * (shard + 1U)) / shards};
+}
+
+// A pool of worker threads, one pinned to each of the given CPUs, which run
+// each job together.  All workers wait at a barrier until the job is posted,
+// so they start it at the same moment, and run() returns only once all of
+// them have finished.  Between jobs the workers are idle, so the caller may
+// change the counter table.
+struct sharded_collector {
+  using job_type = std::function<void(size_t shard, size_t shards)>;
+
+  explicit sharded_collector(const std::vector<int> &cpus);
+  ~sharded_collector();
+  sharded_collector(const sharded_collector &) = delete;
+  sharded_collector &operator=(const sharded_collector &) = delete;
+
+  // False if the barriers could not be created, in which case there are no
+  // workers, and run() must not be called.
+  bool ok() const { return ready; }
+  void run(const job_type &job);
+  size_t size() const { return shards; }
+
+private:
+  void work(const size_t shard, const int cpu);
+
+  // Set before the workers start, which must not read the vector below while
+  // it is growing.
+  const size_t shards;
+  std::vector<std::thread> workers;
+  pthread_barrier_t start;
+  pthread_barrier_t done;
+  const job_type *job;
+  bool ready;
+};
+
+// Each worker resets and enables its shard.  The barrier releases all workers
+// at once, so the counting windows of early and late shards differ by the
+// time to enable one shard rather than the whole table.
+template <class Table>
+void resetAndEnableCountersSharded(sharded_collector &pool,
+                                   const Table &counters) {
+  pool.run([&counters](const size_t shard, const size_t shards) {
+    const std::pair<size_t, size_t> range =
+        shardRange(counters.size(), shard, shards);
+    for (size_t i = range.first; i < range.second; i++) {
+      ioctl(counters.leader_fds[i], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(counters.leader_fds[i], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  });
+}
+
+// Each worker disables its whole shard before reading any of it, so the reads
+// do not lengthen the windows.
+template <class Table>
+void disableAndReadCountersSharded(sharded_collector &pool, Table &counters) {
+  pool.run([&counters](const size_t shard, const size_t shards) {
+    const std::pair<size_t, size_t> range =
+        shardRange(counters.size(), shard, shards);
+    for (size_t i = range.first; i < range.second; i++) {
+      ioctl(counters.leader_fds[i], PERF_EVENT_IOC_DISABLE,
+            PERF_IOC_FLAG_GROUP);
+    }
+    for (size_t i = range.first; i < range.second; i++) {
+      readCounter(counters, i);
+    }
+  });
+}
+
+// For free-running counters, which stay enabled.
+template <class Table>
+void readCountersSharded(sharded_collector &pool, Table &counters) {
+  pool.run([&counters](const size_t shard, const size_t shards) {
+    const std::pair<size_t, size_t> range =
+        shardRange(counters.size(), shard, shards);
+    for (size_t i = range.first; i < range.second; i++) {
+      readCounter(counters, i);
+    }
+  });
+}
+
+#endif // SHARDED_COLLECTOR_HPP
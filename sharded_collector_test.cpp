@@ -0,0 +1,84 @@
+#include "sharded_collector.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <fcntl.h>
+
+#include <atomic>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+constexpr int32_t NUMFILES = 50;
+constexpr uint32_t OBSERVED_EVENTS = default_counter_table::OBSERVED_EVENTS;
+
+namespace local_testing {
+
+TEST(ShardedCollectorSimpleTest, shardRange) {
+  // Shards cover every entry exactly once and differ in size by at most one.
+  for (const size_t entries : {0U, 1U, 7U, 100U}) {
+    size_t next = 0U;
+    for (size_t shard = 0U; shard < 3U; shard++) {
+      const std::pair<size_t, size_t> range = shardRange(entries, shard, 3U);
+      EXPECT_EQ(next, range.first);
+      EXPECT_LE(range.second - range.first, (entries / 3U) + 1U);
+      next = range.second;
+    }
+    EXPECT_EQ(entries, next);
+  }
+}
+
+TEST(ShardedCollectorSimpleTest, run) {
+  // All workers run on CPU 0, which every machine has.
+  sharded_collector pool(std::vector<int>{0, 0, 0});
+  ASSERT_TRUE(pool.ok());
+  ASSERT_EQ(3U, pool.size());
+  std::vector<std::atomic<int>> calls(pool.size());
+  for (int round = 0; round < 5; round++) {
+    pool.run([&calls](const size_t shard, const size_t shards) {
+      EXPECT_EQ(3U, shards);
+      calls[shard]++;
+    });
+  }
+  for (const std::atomic<int> &count : calls) {
+    EXPECT_EQ(5, count.load());
+  }
+}
+
+// Regular files stand in for the group leaders.  ioctl() fails on them, which
+// the collector, like resetAndEnableCounters(), ignores.
+TEST(ShardedCollectorSimpleTest, disableAndRead) {
+  fs::current_path(fs::temp_directory_path());
+  fs::remove_all(TEST_PATH);
+  ASSERT_TRUE(fs::create_directories(TEST_PATH));
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  for (int i = 0; i < NUMFILES; i++) {
+    default_pcounter pc(static_cast<pid_t>(i));
+    const std::string path = TEST_PATH + to_string(i);
+    pc.group_fd[CYCLES] = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    ASSERT_GT(pc.group_fd[CYCLES], STDERR_FILENO);
+    pc.group_fd[INSTRUCTIONS] = -1;
+    struct read_format<OBSERVED_EVENTS> data;
+    data.nr = OBSERVED_EVENTS;
+    data.values[CYCLES] = {static_cast<uint64_t>(i), 0U};
+    data.values[INSTRUCTIONS] = {static_cast<uint64_t>(2 * i), 0U};
+    ASSERT_EQ(sizeof(data),
+              pwrite(pc.group_fd[CYCLES], &data, sizeof(data), 0));
+    staged.push_back(pc);
+  }
+  insertCounters(counters, staged);
+
+  sharded_collector pool(std::vector<int>{0, 0, 0, 0});
+  resetAndEnableCountersSharded(pool, counters);
+  disableAndReadCountersSharded(pool, counters);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    EXPECT_EQ(i, counters.values[i][CYCLES]);
+    EXPECT_EQ(2U * i, counters.values[i][INSTRUCTIONS]);
+    closeCounterFds(counters, i);
+  }
+  ASSERT_NE(-1, fs::remove_all(TEST_PATH));
+}
+
+} // namespace local_testing
@@ -0,0 +1,178 @@
+#include "shm_snapshot.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cstring>
+
+snapshot_publisher::snapshot_publisher(
+    const std::string &n, const std::vector<struct trace_event> &events,
+    const size_t cap)
+    : name(n), nr_events(events.size()), capacity(cap), header(nullptr),
+      entries(nullptr), map_size(0U) {
+  if (events.size() > TRACE_MAX_EVENTS) {
+    std::cerr << "Too many events to publish: " << events.size() << std::endl;
+    return;
+  }
+  // A segment which exists may belong to another collector, whose readers
+  // would see it change shape underneath them, so it is never reused.
+  errno = 0;
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to create shared memory " << name << ": "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  map_size = sizeof(struct snapshot_header) + (capacity * entrySize());
+  void *map = MAP_FAILED;
+  if (0 == ftruncate(fd, map_size)) {
+    map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (MAP_FAILED == map) {
+    std::cerr << "Failed to map shared memory " << name << ": "
+              << strerror(errno) << std::endl;
+    shm_unlink(name.c_str());
+    return;
+  }
+  header = static_cast<struct snapshot_header *>(map);
+  entries = static_cast<char *>(map) + sizeof(struct snapshot_header);
+  // ftruncate() zeroed the segment, so seq starts out even.  The magic goes
+  // last, so that a reader which sees it sees the rest of the header too.
+  header->version = SNAPSHOT_VERSION;
+  header->nr_events = nr_events;
+  header->capacity = capacity;
+  for (size_t ev = 0U; ev < events.size(); ev++) {
+    header->events[ev] = events[ev];
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+}
+
+// Readers which still have the segment mapped keep it until they unmap it.
+snapshot_publisher::~snapshot_publisher() {
+  if (nullptr != header) {
+    munmap(header, map_size);
+    shm_unlink(name.c_str());
+  }
+}
+
+void snapshot_publisher::begin() {
+  const uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&header->seq, seq + 1U, __ATOMIC_RELAXED);
+  // Orders the odd seq before the stores of the data.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void snapshot_publisher::end() {
+  const uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_RELAXED);
+  __atomic_store_n(&header->seq, seq + 1U, __ATOMIC_RELEASE);
+}
+
+void snapshot_publisher::setEntry(const size_t i, const pid_t tid,
+                                  const uint64_t *values) {
+  char *entry = entries + (i * entrySize());
+  const int64_t id = tid;
+  memcpy(entry, &id, sizeof(id));
+  memcpy(entry + sizeof(id), values, nr_events * sizeof(uint64_t));
+}
+
+snapshot_reader::snapshot_reader(const std::string &name)
+    : header(nullptr), entries(nullptr), map_size(0U) {
+  errno = 0;
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    std::cerr << "Failed to open shared memory " << name << ": "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  struct stat st;
+  if ((fstat(fd, &st) < 0) ||
+      (static_cast<size_t>(st.st_size) < sizeof(struct snapshot_header))) {
+    std::cerr << name << " is not a snapshot" << std::endl;
+    close(fd);
+    return;
+  }
+  map_size = st.st_size;
+  void *map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    std::cerr << "Failed to map shared memory " << name << ": "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  const struct snapshot_header *h =
+      static_cast<const struct snapshot_header *>(map);
+  const size_t entry_size = sizeof(int64_t) * (1U + h->nr_events);
+  if ((0 != memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))) ||
+      (SNAPSHOT_VERSION != h->version) || (h->nr_events > TRACE_MAX_EVENTS) ||
+      (map_size <
+       sizeof(struct snapshot_header) + (h->capacity * entry_size))) {
+    std::cerr << name << " is not a snapshot" << std::endl;
+    munmap(map, map_size);
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  header = h;
+  entries = static_cast<const char *>(map) + sizeof(struct snapshot_header);
+}
+
+snapshot_reader::~snapshot_reader() {
+  if (nullptr != header) {
+    munmap(const_cast<struct snapshot_header *>(header), map_size);
+  }
+}
+
+void snapshot_reader::prepare(struct snapshot &snap) const {
+  snap.totals.assign(header->nr_events, 0U);
+  snap.tids.assign(header->capacity, 0);
+  snap.values.assign(header->capacity * header->nr_events, 0U);
+  snap.nr_threads = 0U;
+}
+
+bool snapshot_reader::read(struct snapshot &snap,
+                           const unsigned max_tries) const {
+  const uint32_t nr_events = header->nr_events;
+  const size_t entry_size = sizeof(int64_t) * (1U + nr_events);
+  if ((snap.totals.size() < nr_events) ||
+      (snap.tids.size() < header->capacity) ||
+      (snap.values.size() < (header->capacity * nr_events))) {
+    return false;
+  }
+  for (unsigned tries = 0U; tries < max_tries; tries++) {
+    const uint64_t seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+    if (0U == seq) {
+      // Nothing was published yet.
+      return false;
+    }
+    if (seq & 1U) {
+      continue;
+    }
+    // The copy may be torn by a concurrent write, which the second load of
+    // seq detects, so every field is read into scratch space first.  The
+    // capacity bounds nr_threads even in a torn copy.
+    snap.seq = seq;
+    snap.timestamp = header->timestamp;
+    snap.elapsed = header->elapsed;
+    snap.total_threads = header->total_threads;
+    snap.confidence = header->confidence;
+    memcpy(snap.totals.data(), header->totals, nr_events * sizeof(uint64_t));
+    const size_t n = std::min<uint64_t>(header->nr_threads, header->capacity);
+    snap.nr_threads = n;
+    for (size_t i = 0U; i < n; i++) {
+      const char *entry = entries + (i * entry_size);
+      int64_t id;
+      memcpy(&id, entry, sizeof(id));
+      snap.tids[i] = static_cast<pid_t>(id);
+      memcpy(snap.values.data() + (i * nr_events), entry + sizeof(id),
+             nr_events * sizeof(uint64_t));
+    }
+    // Orders the copies before the second load of seq.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (seq == __atomic_load_n(&header->seq, __ATOMIC_RELAXED)) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,140 @@
+#ifndef SHM_SNAPSHOT_HPP
+#define SHM_SNAPSHOT_HPP
+
+#include "performance_counter_lib.hpp"
+#include "trace_recorder.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+  The layout of a snapshot segment:
+    A snapshot_header.
+    capacity entries, each a tid and nr_events scaled counts.
+  The header's seq is a seqlock: the collector makes it odd before it changes
+  anything and even again afterwards, so a reader which sees the same even
+  value before and after copying the segment has a consistent copy.  Readers
+  never write to the segment, so they cannot hold up the collector.
+*/
+constexpr char SNAPSHOT_MAGIC[8] = {'P', 'C', 'S', 'N', 'A', 'P', '\0', '\0'};
+constexpr uint32_t SNAPSHOT_VERSION = 1U;
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nr_events;
+  uint64_t capacity;
+  uint64_t seq;
+  // CLOCK_MONOTONIC nanoseconds at the end of the interval, and how long it
+  // lasted.
+  uint64_t timestamp;
+  uint64_t elapsed;
+  // The threads in the entries, at most capacity.  total_threads also counts
+  // those which did not fit.
+  uint64_t nr_threads;
+  uint64_t total_threads;
+  double confidence;
+  uint64_t totals[TRACE_MAX_EVENTS];
+  struct trace_event events[TRACE_MAX_EVENTS];
+};
+
+// A consistent copy of a snapshot, which readers own.  The vectors are sized
+// for the segment by snapshot_reader::prepare(), so that reading never
+// allocates, and the first nr_threads entries hold the snapshot's threads.
+struct snapshot {
+  uint64_t seq;
+  uint64_t timestamp;
+  uint64_t elapsed;
+  uint64_t nr_threads;
+  uint64_t total_threads;
+  double confidence;
+  std::vector<uint64_t> totals;
+  std::vector<pid_t> tids;
+  // nr_events counts per thread, thread by thread.
+  std::vector<uint64_t> values;
+};
+
+// Publishes the latest interval in a POSIX shared-memory segment, which
+// dashboards and agents map and read without system calls.  The segment must
+// not exist yet, and is removed again by the destructor.
+struct snapshot_publisher {
+  snapshot_publisher(const std::string &name,
+                     const std::vector<struct trace_event> &events,
+                     const size_t capacity);
+  ~snapshot_publisher();
+  snapshot_publisher(const snapshot_publisher &) = delete;
+  snapshot_publisher &operator=(const snapshot_publisher &) = delete;
+
+  bool ok() const { return nullptr != header; }
+  // Called between begin() and end() only.
+  void setEntry(const size_t i, const pid_t tid, const uint64_t *values);
+  void begin();
+  void end();
+
+  const std::string name;
+  const uint32_t nr_events;
+  const size_t capacity;
+  struct snapshot_header *header;
+
+private:
+  size_t entrySize() const { return sizeof(int64_t) * (1U + nr_events); }
+
+  char *entries;
+  size_t map_size;
+};
+
+// Publish the table's scaled counts and totals.
+template <class Table>
+void publishSnapshot(snapshot_publisher &publisher, const Table &counters,
+                     const std::chrono::nanoseconds timestamp,
+                     const std::chrono::nanoseconds elapsed) {
+  if (!publisher.ok()) {
+    return;
+  }
+  const auto totals = sumScaledCounters(counters);
+  const size_t n = std::min(counters.size(), publisher.capacity);
+  publisher.begin();
+  struct snapshot_header *h = publisher.header;
+  h->timestamp = timestamp.count();
+  h->elapsed = elapsed.count();
+  h->nr_threads = n;
+  h->total_threads = counters.size();
+  h->confidence = totals.confidence;
+  for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+    h->totals[ev] = totals.estimates[ev];
+  }
+  typename Table::values_type scaled{};
+  for (size_t i = 0U; i < n; i++) {
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      scaled[ev] = scaleCount(counters.values[i][ev], counters.times[i]);
+    }
+    publisher.setEntry(i, counters.tids[i], scaled.data());
+  }
+  publisher.end();
+}
+
+// Maps a snapshot segment read-only.
+struct snapshot_reader {
+  explicit snapshot_reader(const std::string &name);
+  ~snapshot_reader();
+  snapshot_reader(const snapshot_reader &) = delete;
+  snapshot_reader &operator=(const snapshot_reader &) = delete;
+
+  bool ok() const { return nullptr != header; }
+  // Size snap for the segment's events and capacity.  Call it once.
+  void prepare(struct snapshot &snap) const;
+  // Copy the latest snapshot into snap, which prepare() sized, retrying while
+  // the collector is writing.  Returns false if snap is too small, if there is
+  // no snapshot yet or if the collector kept writing for max_tries attempts.
+  bool read(struct snapshot &snap, const unsigned max_tries = 1000U) const;
+
+  const struct snapshot_header *header;
+
+private:
+  const char *entries;
+  size_t map_size;
+};
+
+#endif // SHM_SNAPSHOT_HPP
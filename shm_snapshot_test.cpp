@@ -0,0 +1,135 @@
+#include "shm_snapshot.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+
+namespace local_testing {
+
+std::string segmentName() {
+  return "/pclib_snapshot_test_" + to_string(getpid());
+}
+
+void fillTable(default_counter_table &counters, const size_t n,
+               const uint64_t base) {
+  std::vector<default_pcounter> staged{};
+  for (size_t i = counters.size(); i < n; i++) {
+    staged.emplace_back(static_cast<pid_t>(100 + i));
+    staged.back().group_fd = {-1, -1};
+  }
+  insertCounters(counters, staged);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    // Every thread's instructions are twice its cycles.
+    counters.values[i] = {base + i, 2U * (base + i)};
+    counters.times[i] = {};
+  }
+}
+
+TEST(ShmSnapshotTest, publishAndRead) {
+  snapshot_publisher publisher(segmentName(),
+                               traceEvents<default_counter_table>(), 4U);
+  ASSERT_TRUE(publisher.ok());
+  snapshot_reader reader(segmentName());
+  ASSERT_TRUE(reader.ok());
+  struct snapshot snap {};
+  // Not sized for the segment.
+  EXPECT_FALSE(reader.read(snap));
+  reader.prepare(snap);
+  EXPECT_EQ(4U, snap.tids.size());
+  EXPECT_EQ(8U, snap.values.size());
+  // Nothing was published yet.
+  EXPECT_FALSE(reader.read(snap));
+
+  default_counter_table counters{};
+  fillTable(counters, 3U, 10U);
+  counters.times[0] = {100U, 50U};
+  publishSnapshot(publisher, counters, std::chrono::nanoseconds(5),
+                  std::chrono::milliseconds(1));
+  ASSERT_TRUE(reader.read(snap));
+  EXPECT_EQ(2U, snap.seq);
+  EXPECT_EQ(5U, snap.timestamp);
+  EXPECT_EQ(1000000U, snap.elapsed);
+  ASSERT_EQ(3U, snap.nr_threads);
+  EXPECT_EQ((std::vector<pid_t>{100, 101, 102}),
+            std::vector<pid_t>(snap.tids.begin(), snap.tids.begin() + 3));
+  // The first thread counted half of the time.
+  EXPECT_EQ(20U, snap.values[0]);
+  EXPECT_EQ(22U, snap.values[3]);
+  EXPECT_EQ((std::vector<uint64_t>{20U + 11U + 12U, 40U + 22U + 24U}),
+            snap.totals);
+
+  // Threads beyond the capacity count in the totals only.
+  fillTable(counters, 6U, 1U);
+  publishSnapshot(publisher, counters, std::chrono::nanoseconds(6),
+                  std::chrono::milliseconds(1));
+  ASSERT_TRUE(reader.read(snap));
+  EXPECT_EQ(4U, snap.nr_threads);
+  EXPECT_EQ(6U, snap.total_threads);
+  EXPECT_EQ(21U, snap.totals[CYCLES]);
+}
+
+// A reader polling while the collector publishes only ever sees whole
+// snapshots.
+TEST(ShmSnapshotTest, concurrentReads) {
+  snapshot_publisher publisher(segmentName(),
+                               traceEvents<default_counter_table>(), 64U);
+  ASSERT_TRUE(publisher.ok());
+  std::atomic<bool> done{false};
+  std::thread writer([&publisher, &done]() {
+    default_counter_table counters{};
+    for (uint64_t interval = 1U; interval <= 2000U; interval++) {
+      fillTable(counters, 64U, interval);
+      publishSnapshot(publisher, counters, std::chrono::nanoseconds(interval),
+                      std::chrono::nanoseconds(1));
+    }
+    done = true;
+  });
+  snapshot_reader reader(segmentName());
+  ASSERT_TRUE(reader.ok());
+  struct snapshot snap {};
+  reader.prepare(snap);
+  while (!done) {
+    if (!reader.read(snap)) {
+      continue;
+    }
+    const uint64_t base = snap.timestamp;
+    for (size_t i = 0U; i < snap.nr_threads; i++) {
+      ASSERT_EQ(base + i, snap.values[2U * i]);
+      ASSERT_EQ(2U * (base + i), snap.values[(2U * i) + 1U]);
+    }
+  }
+  writer.join();
+  EXPECT_TRUE(reader.read(snap));
+  EXPECT_EQ(2000U, snap.timestamp);
+}
+
+// Another collector's segment is left alone.
+TEST(ShmSnapshotTest, existingSegment) {
+  snapshot_publisher first(segmentName(),
+                           traceEvents<default_counter_table>(), 4U);
+  ASSERT_TRUE(first.ok());
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  snapshot_publisher second(segmentName(),
+                            traceEvents<default_counter_table>(), 8U);
+  cerr.rdbuf(old_cerr);
+  EXPECT_FALSE(second.ok());
+  EXPECT_THAT(errors.str(), testing::HasSubstr("File exists"));
+  snapshot_reader reader(segmentName());
+  ASSERT_TRUE(reader.ok());
+  EXPECT_EQ(4U, reader.header->capacity);
+}
+
+TEST(ShmSnapshotTest, missingSegment) {
+  snapshot_reader reader("/pclib_snapshot_test_missing");
+  EXPECT_FALSE(reader.ok());
+}
+
+} // namespace local_testing
@@ -0,0 +1,79 @@
+#include "thread_report.hpp"
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+// The kernel's TASK_COMM_LEN is 16, including the terminating NUL.
+constexpr size_t COMM_BUFSIZE = 64U;
+} // namespace
+
+thread_names::thread_names(const std::string &path,
+                           const std::vector<std::string> &pats)
+    : proc_path(path), patterns(pats), cache{} {}
+
+const std::string &thread_names::name(const pid_t tid) {
+  return lookup(tid).name;
+}
+
+size_t thread_names::group(const pid_t tid) { return lookup(tid).group; }
+
+void thread_names::prune(const std::vector<pid_t> &tids) {
+  for (auto it = cache.begin(); it != cache.end();) {
+    if (std::binary_search(tids.begin(), tids.end(), it->first)) {
+      ++it;
+    } else {
+      it = cache.erase(it);
+    }
+  }
+}
+
+const thread_names::entry &thread_names::lookup(const pid_t tid) {
+  auto it = cache.find(tid);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  entry e{std::string{}, patterns.size()};
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%d/comm", proc_path.c_str(), tid);
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    char buf[COMM_BUFSIZE];
+    const ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len > 0) {
+      e.name.assign(buf, len);
+      if ('\n' == e.name.back()) {
+        e.name.pop_back();
+      }
+    }
+  }
+  for (size_t g = 0U; g < patterns.size(); g++) {
+    if (0 == fnmatch(patterns[g].c_str(), e.name.c_str(), 0)) {
+      e.group = g;
+      break;
+    }
+  }
+  return cache.emplace(tid, std::move(e)).first->second;
+}
+
+void printThreadLine(const std::string &name, const pid_t tid,
+                     const uint64_t cycles, const uint64_t instructions,
+                     const std::chrono::nanoseconds elapsed) {
+  // An empty interval has no rates.
+  if (elapsed.count() <= 0) {
+    return;
+  }
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  std::cout << "  " << (name.empty() ? "?" : name);
+  if (tid >= 0) {
+    std::cout << " [" << tid << "]";
+  }
+  std::cout << ": " << (cycles / seconds) / BILLION << " billion cycles/s, IPC "
+            << (cycles ? (float)instructions / (float)cycles : 0.0f)
+            << std::endl;
+}
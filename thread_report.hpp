@@ -0,0 +1,152 @@
+#ifndef THREAD_REPORT_HPP
+#define THREAD_REPORT_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The names of the observed threads, read from <proc_path><tid>/comm once per
+// thread, and the first of the given fnmatch() patterns which each name
+// matches.  procfs resolves <proc_path><tid> for any thread, whichever process
+// it belongs to, although it lists only the processes.  Both are cached,
+// since threads rarely rename themselves and matching thousands of names
+// against every pattern on every interval would cost more than the counter
+// reads.
+struct thread_names {
+  thread_names(const std::string &proc_path,
+               const std::vector<std::string> &patterns);
+
+  // The name of tid, or an empty string if it cannot be read.
+  const std::string &name(const pid_t tid);
+  // The index of the first pattern which tid's name matches, or
+  // patterns.size() if none does.
+  size_t group(const pid_t tid);
+  // Forget the threads which are not in the sorted tids, so that a reused tid
+  // is looked up afresh.
+  void prune(const std::vector<pid_t> &tids);
+  size_t size() const { return cache.size(); }
+
+  const std::string proc_path;
+  const std::vector<std::string> patterns;
+
+private:
+  struct entry {
+    std::string name;
+    size_t group;
+  };
+  const entry &lookup(const pid_t tid);
+
+  std::unordered_map<pid_t, entry> cache;
+};
+
+// Sum the scaled counts of the threads in each group of names, with the
+// threads which match no pattern last.
+template <class Table>
+std::vector<typename Table::values_type> sumByGroup(const Table &counters,
+                                                    thread_names &names) {
+  std::vector<typename Table::values_type> sums(names.patterns.size() + 1U);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    typename Table::values_type &sum = sums[names.group(counters.tids[i])];
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      sum[ev] += scaleCount(counters.values[i][ev], counters.times[i]);
+    }
+  }
+  return sums;
+}
+
+// Fill top with the table indices of the n threads with the highest count of
+// event ev, highest first.  Only the first n entries are sorted, so the cost
+// grows with the number of threads times log n.
+template <class Table>
+void topThreads(const Table &counters, const uint32_t ev, const size_t n,
+                std::vector<size_t> &top) {
+  top.resize(counters.size());
+  for (size_t i = 0U; i < counters.size(); i++) {
+    top[i] = i;
+  }
+  const size_t k = std::min(n, top.size());
+  std::partial_sort(top.begin(), top.begin() + k, top.end(),
+                    [&counters, ev](const size_t a, const size_t b) {
+                      return counters.values[a][ev] > counters.values[b][ev];
+                    });
+  top.resize(k);
+}
+
+// Fill worst with the table indices of the n threads with the lowest ratio of
+// instructions to cycles, lowest first.  Threads which ran for fewer than
+// min_cycles are left out, since a thread which barely ran has a meaningless
+// IPC.  The ratios are compared by cross-multiplying, without dividing.
+template <class Table>
+void worstIpcThreads(const Table &counters, const uint64_t min_cycles,
+                     const size_t n, std::vector<size_t> &worst) {
+  worst.clear();
+  for (size_t i = 0U; i < counters.size(); i++) {
+    if (counters.values[i][CYCLES] >= std::max<uint64_t>(min_cycles, 1U)) {
+      worst.push_back(i);
+    }
+  }
+  const size_t k = std::min(n, worst.size());
+  std::partial_sort(
+      worst.begin(), worst.begin() + k, worst.end(),
+      [&counters](const size_t a, const size_t b) {
+        const typename Table::values_type &va = counters.values[a];
+        const typename Table::values_type &vb = counters.values[b];
+        return (static_cast<unsigned __int128>(va[INSTRUCTIONS]) *
+                vb[CYCLES]) <
+               (static_cast<unsigned __int128>(vb[INSTRUCTIONS]) * va[CYCLES]);
+      });
+  worst.resize(k);
+}
+
+// Nothing is printed for an empty interval.
+void printThreadLine(const std::string &name, const pid_t tid,
+                     const uint64_t cycles, const uint64_t instructions,
+                     const std::chrono::nanoseconds elapsed);
+
+// Print the totals of each group of names, the n threads with the most cycles
+// and the n threads with the worst IPC.  The table must count cycles and
+// instructions in the CYCLES and INSTRUCTIONS slots.  The threads are ranked
+// by their raw counts but printed with their scaled estimates.
+template <class Table>
+void printThreadReport(const Table &counters, thread_names &names,
+                       const size_t n, const std::chrono::nanoseconds elapsed) {
+  if (!names.patterns.empty()) {
+    const std::vector<typename Table::values_type> sums =
+        sumByGroup(counters, names);
+    std::cout << "By thread name:" << std::endl;
+    for (size_t g = 0U; g < sums.size(); g++) {
+      printThreadLine((g < names.patterns.size()) ? names.patterns[g] : "*",
+                      -1, sums[g][CYCLES], sums[g][INSTRUCTIONS], elapsed);
+    }
+  }
+  if (0U == n) {
+    return;
+  }
+  auto print = [&counters, &names, elapsed](const size_t i) {
+    printThreadLine(names.name(counters.tids[i]), counters.tids[i],
+                    scaleCount(counters.values[i][CYCLES], counters.times[i]),
+                    scaleCount(counters.values[i][INSTRUCTIONS],
+                               counters.times[i]),
+                    elapsed);
+  };
+  std::vector<size_t> selected{};
+  topThreads(counters, CYCLES, n, selected);
+  std::cout << "Top " << selected.size() << " threads by cycles:" << std::endl;
+  for (const size_t i : selected) {
+    print(i);
+  }
+  // Threads below a thousandth of the busiest thread's cycles barely ran.
+  const uint64_t min_cycles =
+      selected.empty() ? 0U : counters.values[selected[0]][CYCLES] / 1000U;
+  worstIpcThreads(counters, min_cycles, n, selected);
+  std::cout << "Worst " << selected.size() << " threads by IPC:" << std::endl;
+  for (const size_t i : selected) {
+    print(i);
+  }
+}
+
+#endif // THREAD_REPORT_HPP
@@ -0,0 +1,108 @@
+#include "thread_report.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+
+namespace local_testing {
+
+struct ThreadReportTest : public ::testing::Test {
+  void SetUp() {
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(TEST_PATH);
+    const std::vector<std::pair<pid_t, std::string>> threads{
+        {10, "main"}, {11, "grpc-worker-1"}, {12, "grpc-worker-2"},
+        {13, "gc"},   {14, "grpc-poller"}};
+    std::vector<default_pcounter> staged{};
+    for (const auto &thread : threads) {
+      const fs::path task_path = TEST_PATH + to_string(thread.first);
+      ASSERT_TRUE(fs::create_directories(task_path));
+      std::ofstream(task_path / "comm") << thread.second << "\n";
+      staged.emplace_back(thread.first);
+      staged.back().group_fd = {-1, -1};
+    }
+    insertCounters(counters, staged);
+    // cycles, instructions: IPCs of 2, 0.5, 1, 0.1 and 3.
+    counters.values = {
+        {1000U, 2000U}, {4000U, 2000U}, {3000U, 3000U}, {50U, 5U}, {10U, 30U}};
+  }
+  void TearDown() { ASSERT_NE(-1, fs::remove_all(TEST_PATH)); }
+  default_counter_table counters{};
+};
+
+TEST_F(ThreadReportTest, threadNames) {
+  thread_names names(TEST_PATH, {"grpc-worker-*", "grpc-*"});
+  EXPECT_EQ("grpc-worker-1", names.name(11));
+  EXPECT_EQ(0U, names.group(11));
+  EXPECT_EQ(1U, names.group(14));
+  EXPECT_EQ(2U, names.group(10));
+  // Nonexistent threads have no name and belong to no group.
+  EXPECT_EQ("", names.name(99));
+  EXPECT_EQ(2U, names.group(99));
+  EXPECT_EQ(4U, names.size());
+
+  // Names are cached until the thread is pruned.
+  const fs::path comm_path = std::string(TEST_PATH) + "11/comm";
+  std::ofstream(comm_path) << "renamed\n";
+  EXPECT_EQ("grpc-worker-1", names.name(11));
+  names.prune({10, 14});
+  EXPECT_EQ(2U, names.size());
+  EXPECT_EQ("renamed", names.name(11));
+}
+
+TEST_F(ThreadReportTest, sumByGroup) {
+  thread_names names(TEST_PATH, {"grpc-worker-*", "grpc-*"});
+  counters.times[2] = {200U, 100U};
+  const std::vector<default_counter_table::values_type> sums =
+      sumByGroup(counters, names);
+  ASSERT_EQ(3U, sums.size());
+  // Thread 12 counted half of the time.
+  EXPECT_EQ(10000U, sums[0][CYCLES]);
+  EXPECT_EQ(8000U, sums[0][INSTRUCTIONS]);
+  EXPECT_EQ(10U, sums[1][CYCLES]);
+  EXPECT_EQ(1050U, sums[2][CYCLES]);
+}
+
+TEST_F(ThreadReportTest, topThreads) {
+  std::vector<size_t> top{};
+  topThreads(counters, CYCLES, 2U, top);
+  ASSERT_EQ(2U, top.size());
+  EXPECT_EQ(11, counters.tids[top[0]]);
+  EXPECT_EQ(12, counters.tids[top[1]]);
+  topThreads(counters, INSTRUCTIONS, 10U, top);
+  EXPECT_EQ(counters.size(), top.size());
+  EXPECT_EQ(12, counters.tids[top[0]]);
+  EXPECT_EQ(13, counters.tids[top[4]]);
+}
+
+TEST_F(ThreadReportTest, worstIpcThreads) {
+  std::vector<size_t> worst{};
+  worstIpcThreads(counters, 0U, 3U, worst);
+  ASSERT_EQ(3U, worst.size());
+  EXPECT_EQ(13, counters.tids[worst[0]]);
+  EXPECT_EQ(11, counters.tids[worst[1]]);
+  EXPECT_EQ(12, counters.tids[worst[2]]);
+  // Threads which barely ran are left out.
+  worstIpcThreads(counters, 100U, 10U, worst);
+  ASSERT_EQ(3U, worst.size());
+  EXPECT_EQ(11, counters.tids[worst[0]]);
+}
+
+TEST(ThreadReportSimpleTest, printThreadLine) {
+  std::ostringstream out{};
+  std::streambuf *old_cout = cout.rdbuf(out.rdbuf());
+  printThreadLine("worker", 7, 2000000000U, 1000000000U,
+                  std::chrono::seconds(2));
+  printThreadLine("worker", 7, 2000000000U, 1000000000U,
+                  std::chrono::nanoseconds(0));
+  cout.rdbuf(old_cout);
+  EXPECT_EQ("  worker [7]: 1 billion cycles/s, IPC 0.5\n", out.str());
+}
+
+} // namespace local_testing
@@ -0,0 +1,279 @@
+#include "thread_tracker.hpp"
+
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+#include <fcntl.h>
+#include <limits.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+namespace {
+// Big enough for a few hundred events per recv().
+constexpr size_t NL_BUFSIZE = 16384U;
+} // namespace
+
+void parseProcEvents(const char *buf, const size_t len,
+                     std::map<pid_t, size_t> &processes,
+                     const bool follow_children,
+                     std::map<pid_t, pid_t> &started, std::set<pid_t> &exited) {
+  size_t offset = 0U;
+  while ((offset + sizeof(struct nlmsghdr)) <= len) {
+    // The headers are copied out, since recv() makes no promise about the
+    // alignment of the messages after the first one.
+    struct nlmsghdr nlh;
+    memcpy(&nlh, buf + offset, sizeof(struct nlmsghdr));
+    if ((nlh.nlmsg_len < sizeof(struct nlmsghdr)) ||
+        ((offset + nlh.nlmsg_len) > len)) {
+      std::cerr << "Truncated proc connector message" << std::endl;
+      return;
+    }
+    const size_t payload = nlh.nlmsg_len - NLMSG_HDRLEN;
+    if (payload >= (sizeof(struct cn_msg) + sizeof(struct proc_event))) {
+      struct cn_msg msg;
+      memcpy(&msg, buf + offset + NLMSG_HDRLEN, sizeof(struct cn_msg));
+      struct proc_event ev;
+      memcpy(&ev, buf + offset + NLMSG_HDRLEN + sizeof(struct cn_msg),
+             sizeof(struct proc_event));
+      if ((CN_IDX_PROC == msg.id.idx) && (CN_VAL_PROC == msg.id.val)) {
+        // Threads and processes alike are created by clone(), which the
+        // connector reports as a fork.  Only the threads of the observed
+        // processes matter.  The child of a new process is its first thread.
+        if (proc_event::PROC_EVENT_FORK == ev.what) {
+          const pid_t child_tgid = ev.event_data.fork.child_tgid;
+          if (follow_children &&
+              (ev.event_data.fork.parent_tgid != child_tgid) &&
+              processes.count(ev.event_data.fork.parent_tgid)) {
+            processes.emplace(child_tgid, 0U);
+          }
+          if (processes.count(child_tgid)) {
+            started[ev.event_data.fork.child_pid] = child_tgid;
+          }
+        } else if ((proc_event::PROC_EVENT_EXIT == ev.what) &&
+                   processes.count(ev.event_data.exit.process_tgid)) {
+          const pid_t tid = ev.event_data.exit.process_pid;
+          started.erase(tid);
+          exited.emplace(tid);
+        }
+      }
+    }
+    offset += NLMSG_ALIGN(nlh.nlmsg_len);
+  }
+}
+
+// Subscribe before the initial scan, so that no thread created in between is
+// missed.
+thread_tracker::thread_tracker(const std::string &path, const pid_t pid,
+                               const bool use_proc_connector)
+    : thread_tracker(path, std::set<pid_t>{pid}, false, use_proc_connector) {}
+
+thread_tracker::thread_tracker(const std::string &path,
+                               const std::set<pid_t> &pids,
+                               const bool follow, const bool use_proc_connector)
+    : proc_path(path), roots(pids), follow_children(follow), tids{}, owners{},
+      processes{}, nl_fd(-1), enumerator{}, scan{}, children_buf{} {
+  if (use_proc_connector && !subscribe()) {
+    std::cerr << "Proc connector unavailable, rescanning " << proc_path
+              << " instead" << std::endl;
+    if (nl_fd >= 0) {
+      close(nl_fd);
+    }
+    nl_fd = -1;
+  }
+  std::set<pid_t> started{};
+  std::set<pid_t> exited{};
+  rescan(started, exited);
+}
+
+thread_tracker::~thread_tracker() {
+  if (nl_fd >= 0) {
+    close(nl_fd);
+  }
+}
+
+bool thread_tracker::subscribe() {
+  errno = 0;
+  nl_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 NETLINK_CONNECTOR);
+  if (nl_fd < 0) {
+    std::cerr << "Failed to open proc connector socket: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(struct sockaddr_nl));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  // nl_pid == 0 lets the kernel choose a unique port.
+  if (bind(nl_fd, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(struct sockaddr_nl))) {
+    std::cerr << "Failed to bind proc connector socket: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  const enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  alignas(struct nlmsghdr) char
+      buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(op))] = {};
+  struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(buf);
+  nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+  nlh->nlmsg_type = NLMSG_DONE;
+  struct cn_msg *msg = static_cast<struct cn_msg *>(NLMSG_DATA(nlh));
+  msg->id.idx = CN_IDX_PROC;
+  msg->id.val = CN_VAL_PROC;
+  msg->len = sizeof(op);
+  memcpy(msg->data, &op, sizeof(op));
+  if (send(nl_fd, buf, nlh->nlmsg_len, 0) < 0) {
+    std::cerr << "Failed to subscribe to proc connector: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// The children file holds the PIDs of the processes which tid forked,
+// separated by spaces.  It needs CONFIG_PROC_CHILDREN.
+void thread_tracker::readChildren(const pid_t pid, const pid_t tid,
+                                  std::vector<pid_t> &children) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s%d/task/%d/children", proc_path.c_str(), pid,
+           tid);
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  children_buf.clear();
+  char buf[4096];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    children_buf.append(buf, len);
+  }
+  close(fd);
+  pid_t child = 0;
+  bool digits = false;
+  for (const char c : children_buf) {
+    if ((c >= '0') && (c <= '9')) {
+      child = (child * 10) + (c - '0');
+      digits = true;
+    } else if (digits) {
+      children.push_back(child);
+      child = 0;
+      digits = false;
+    }
+  }
+  if (digits) {
+    children.push_back(child);
+  }
+}
+
+// Walk the tree down from the roots and compare the threads found with the
+// known ones.
+void thread_tracker::rescan(std::set<pid_t> &started, std::set<pid_t> &exited) {
+  std::map<pid_t, pid_t> found{};
+  std::map<pid_t, size_t> found_processes{};
+  std::vector<pid_t> pending(roots.begin(), roots.end());
+  while (!pending.empty()) {
+    const pid_t pid = pending.back();
+    pending.pop_back();
+    if (found_processes.count(pid)) {
+      continue;
+    }
+    if (!enumerator.enumerate(proc_path, pid, scan)) {
+      // Child processes come and go, but the roots were asked for.
+      if (roots.count(pid)) {
+        std::cout << "No such PID " << pid << std::endl;
+      }
+      continue;
+    }
+    found_processes[pid] = scan.size();
+    for (const pid_t tid : scan) {
+      found.emplace_hint(found.end(), tid, pid);
+    }
+    if (follow_children) {
+      // scan is reused by the enumerations which follow.
+      const std::vector<pid_t> threads(scan);
+      for (const pid_t tid : threads) {
+        readChildren(pid, tid, pending);
+      }
+    }
+  }
+  for (const auto &owner : found) {
+    if (!owners.count(owner.first)) {
+      started.emplace_hint(started.end(), owner.first);
+    }
+  }
+  for (const auto &owner : owners) {
+    if (!found.count(owner.first)) {
+      exited.emplace_hint(exited.end(), owner.first);
+    }
+  }
+  owners = std::move(found);
+  processes = std::move(found_processes);
+  tids.clear();
+  for (const auto &owner : owners) {
+    tids.emplace_hint(tids.end(), owner.first);
+  }
+}
+
+void thread_tracker::poll(std::set<pid_t> &started, std::set<pid_t> &exited) {
+  if (nl_fd < 0) {
+    rescan(started, exited);
+    return;
+  }
+  alignas(struct nlmsghdr) char buf[NL_BUFSIZE];
+  std::map<pid_t, pid_t> forked{};
+  bool lost = false;
+  while (true) {
+    errno = 0;
+    ssize_t len = recv(nl_fd, buf, sizeof(buf), 0);
+    if (len > 0) {
+      parseProcEvents(buf, len, processes, follow_children, forked, exited);
+    } else if ((len < 0) && (ENOBUFS == errno)) {
+      // The socket buffer overflowed, so some events are gone.
+      lost = true;
+    } else {
+      if ((len < 0) && (EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+        std::cerr << "Failed to read proc connector: " << strerror(errno)
+                  << std::endl;
+      }
+      break;
+    }
+  }
+  if (lost) {
+    started.clear();
+    exited.clear();
+    rescan(started, exited);
+    return;
+  }
+  // Events may report threads which the initial scan already found, or exits
+  // of threads which were never seen.  A tid which exited and was reused within
+  // one interval is in both sets.
+  for (auto it = exited.begin(); it != exited.end();) {
+    auto owner = owners.find(*it);
+    if (owner == owners.end()) {
+      it = exited.erase(it);
+      continue;
+    }
+    processes[owner->second]--;
+    owners.erase(owner);
+    tids.erase(*it);
+    it++;
+  }
+  for (const auto &thread : forked) {
+    if (owners.emplace(thread.first, thread.second).second) {
+      processes[thread.second]++;
+      tids.emplace(thread.first);
+      started.emplace(thread.first);
+    }
+  }
+  // A process is gone once all its threads are, including forked processes
+  // which exited before they were seen.
+  for (auto it = processes.begin(); it != processes.end();) {
+    it = (0U == it->second) ? processes.erase(it) : std::next(it);
+  }
+}
@@ -0,0 +1,110 @@
+#ifndef THREAD_TRACKER_HPP
+#define THREAD_TRACKER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <cstddef>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Record the threads of the processes in the keys of processes which started,
+// mapped to their process, or exited according to a buffer of proc connector
+// netlink messages.  With follow_children, a process forked by one of those
+// processes is added to processes, with no threads, and its threads are
+// recorded as well.  A thread which starts and exits within the same buffer is
+// dropped from started but still added to exited, in case it was already
+// known.
+void parseProcEvents(const char *buf, const size_t len,
+                     std::map<pid_t, size_t> &processes,
+                     const bool follow_children,
+                     std::map<pid_t, pid_t> &started, std::set<pid_t> &exited);
+
+// Follows the threads of one or more processes as they are created and exit,
+// and optionally of every process which they fork, so that prefork servers
+// are observed as a whole.  The netlink proc connector reports clone and exit
+// events as they happen, so the work per interval is proportional to the
+// number of events rather than to the number of threads.  If the connector is
+// unavailable, for example without CAP_NET_ADMIN, or if events are lost
+// because the socket buffer overflowed, the tracker rescans
+// /proc/<pid>/task of each known process instead, and finds the child
+// processes in /proc/<pid>/task/<tid>/children, so that a rescan costs time in
+// proportion to the size of the tree rather than to all of /proc.
+struct thread_tracker {
+  thread_tracker(const std::string &proc_path, const pid_t pid,
+                 const bool use_proc_connector = true);
+  thread_tracker(const std::string &proc_path, const std::set<pid_t> &pids,
+                 const bool follow_children,
+                 const bool use_proc_connector = true);
+  ~thread_tracker();
+  thread_tracker(const thread_tracker &) = delete;
+  thread_tracker &operator=(const thread_tracker &) = delete;
+
+  // Fill started and exited with the threads which were created or exited
+  // since the last call, and update tids accordingly.  Does not block.
+  void poll(std::set<pid_t> &started, std::set<pid_t> &exited);
+
+  const std::string proc_path;
+  // The processes which were asked for.
+  const std::set<pid_t> roots;
+  const bool follow_children;
+  // The currently running threads of all the processes.
+  std::set<pid_t> tids;
+  // The process of each thread in tids.
+  std::map<pid_t, pid_t> owners;
+  // The observed processes and the number of threads each has in tids.
+  std::map<pid_t, size_t> processes;
+  // The proc connector socket, or -1 if procfs is rescanned instead.
+  int nl_fd;
+
+private:
+  bool subscribe();
+  void rescan(std::set<pid_t> &started, std::set<pid_t> &exited);
+  void readChildren(const pid_t pid, const pid_t tid,
+                    std::vector<pid_t> &children);
+
+  // Reused by every rescan.
+  task_enumerator enumerator;
+  std::vector<pid_t> scan;
+  std::string children_buf;
+};
+
+// Close the counters of the threads which exited, and create counters for the
+// threads which started, since the last call.  Culling comes first in case a
+// tid was reused.  Every table, such as each table of an event_rotation, gets
+// the same changes.
+template <class... Tables>
+void updateCounters(thread_tracker &tracker, Tables &...counters) {
+  std::set<pid_t> started{};
+  std::set<pid_t> exited{};
+  tracker.poll(started, exited);
+  (cullCounters(counters, exited), ...);
+  (createCounters(counters, started), ...);
+}
+
+// Sum the scaled counts of the threads of each observed process.  Both the
+// table and the tracker's owners are sorted by tid, so this is one merge pass.
+// Counters whose thread the tracker no longer knows are left out.
+template <class Table>
+std::map<pid_t, typename Table::values_type>
+sumByProcess(const Table &counters, const thread_tracker &tracker) {
+  std::map<pid_t, typename Table::values_type> sums{};
+  auto owner = tracker.owners.begin();
+  for (size_t i = 0U; i < counters.size(); i++) {
+    while ((owner != tracker.owners.end()) &&
+           (owner->first < counters.tids[i])) {
+      owner++;
+    }
+    if ((owner == tracker.owners.end()) || (owner->first != counters.tids[i])) {
+      continue;
+    }
+    typename Table::values_type &sum = sums[owner->second];
+    for (uint32_t ev = 0U; ev < Table::OBSERVED_EVENTS; ev++) {
+      sum[ev] += scaleCount(counters.values[i][ev], counters.times[i]);
+    }
+  }
+  return sums;
+}
+
+#endif // THREAD_TRACKER_HPP
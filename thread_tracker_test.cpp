@@ -0,0 +1,222 @@
+#include "thread_tracker.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+constexpr int32_t NUMDIRS = 20;
+constexpr pid_t FAKE_PID = 1234;
+
+namespace local_testing {
+
+// Append one proc connector message to buf.
+void appendProcEvent(std::vector<char> &buf, const struct proc_event &ev) {
+  const size_t len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(ev));
+  const size_t offset = buf.size();
+  buf.resize(offset + NLMSG_ALIGN(len), 0);
+  struct nlmsghdr nlh;
+  memset(&nlh, 0, sizeof(nlh));
+  nlh.nlmsg_len = len;
+  nlh.nlmsg_type = NLMSG_DONE;
+  memcpy(buf.data() + offset, &nlh, sizeof(nlh));
+  struct cn_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.id.idx = CN_IDX_PROC;
+  msg.id.val = CN_VAL_PROC;
+  msg.len = sizeof(ev);
+  memcpy(buf.data() + offset + NLMSG_HDRLEN, &msg, sizeof(msg));
+  memcpy(buf.data() + offset + NLMSG_HDRLEN + sizeof(msg), &ev, sizeof(ev));
+}
+
+struct proc_event forkEvent(const pid_t tgid, const pid_t tid) {
+  struct proc_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.what = proc_event::PROC_EVENT_FORK;
+  ev.event_data.fork.parent_pid = tgid;
+  ev.event_data.fork.parent_tgid = tgid;
+  ev.event_data.fork.child_pid = tid;
+  ev.event_data.fork.child_tgid = tgid;
+  return ev;
+}
+
+struct proc_event exitEvent(const pid_t tgid, const pid_t tid) {
+  struct proc_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.what = proc_event::PROC_EVENT_EXIT;
+  ev.event_data.exit.process_pid = tid;
+  ev.event_data.exit.process_tgid = tgid;
+  return ev;
+}
+
+TEST(ThreadTrackerSimpleTest, parseProcEvents) {
+  std::vector<char> buf{};
+  appendProcEvent(buf, forkEvent(FAKE_PID, 2000));
+  appendProcEvent(buf, forkEvent(FAKE_PID, 2001));
+  // A thread of another process.
+  appendProcEvent(buf, forkEvent(FAKE_PID + 1, 3000));
+  appendProcEvent(buf, exitEvent(FAKE_PID, 2001));
+  appendProcEvent(buf, exitEvent(FAKE_PID, 5));
+  appendProcEvent(buf, exitEvent(FAKE_PID + 1, 6));
+
+  std::map<pid_t, size_t> processes{{FAKE_PID, 0U}};
+  std::map<pid_t, pid_t> started{};
+  std::set<pid_t> exited{};
+  parseProcEvents(buf.data(), buf.size(), processes, false, started, exited);
+  EXPECT_EQ((std::map<pid_t, pid_t>{{2000, FAKE_PID}}), started);
+  EXPECT_EQ((std::set<pid_t>{5, 2001}), exited);
+
+  // A truncated buffer is parsed up to the last complete message.
+  started.clear();
+  exited.clear();
+  parseProcEvents(buf.data(), buf.size() - 1U, processes, false, started,
+                  exited);
+  EXPECT_EQ((std::set<pid_t>{5, 2001}), exited);
+  EXPECT_EQ(1U, processes.size());
+}
+
+TEST(ThreadTrackerSimpleTest, parseProcEventsChildren) {
+  std::vector<char> buf{};
+  // FAKE_PID forks a process, which creates a thread and forks another.
+  struct proc_event ev = forkEvent(FAKE_PID, 4000);
+  ev.event_data.fork.child_tgid = 4000;
+  appendProcEvent(buf, ev);
+  appendProcEvent(buf, forkEvent(4000, 4001));
+  ev = forkEvent(4000, 5000);
+  ev.event_data.fork.child_tgid = 5000;
+  appendProcEvent(buf, ev);
+  // An unrelated process forks.
+  ev = forkEvent(FAKE_PID + 1, 6000);
+  ev.event_data.fork.child_tgid = 6000;
+  appendProcEvent(buf, ev);
+  appendProcEvent(buf, exitEvent(5000, 5000));
+
+  std::map<pid_t, size_t> processes{{FAKE_PID, 0U}};
+  std::map<pid_t, pid_t> started{};
+  std::set<pid_t> exited{};
+  parseProcEvents(buf.data(), buf.size(), processes, true, started, exited);
+  EXPECT_EQ((std::map<pid_t, pid_t>{{4000, 4000}, {4001, 4000}}), started);
+  EXPECT_EQ(std::set<pid_t>{5000}, exited);
+  EXPECT_EQ(3U, processes.size());
+  EXPECT_EQ(0U, processes.count(6000));
+
+  // Without follow_children, only the known processes matter.
+  processes = {{FAKE_PID, 0U}};
+  started.clear();
+  parseProcEvents(buf.data(), buf.size(), processes, false, started, exited);
+  EXPECT_TRUE(started.empty());
+  EXPECT_EQ(1U, processes.size());
+}
+
+struct ThreadTrackerTest : public ::testing::Test {
+  void SetUp() {
+    fs::current_path(fs::temp_directory_path());
+    test_path = TEST_PATH + to_string(FAKE_PID) + "/task";
+    // Clean up mess from any aborted tests.
+    std::filesystem::remove_all(test_path);
+    ASSERT_TRUE(fs::create_directories(test_path));
+    for (int i = 0; i < NUMDIRS; i++) {
+      ASSERT_TRUE(fs::create_directory(test_path / to_string(i)));
+    }
+  }
+  void TearDown() {
+    ASSERT_NE(-1, fs::remove_all(TEST_PATH));
+    ASSERT_TRUE(!fs::exists(TEST_PATH));
+  }
+  fs::path test_path;
+};
+
+TEST_F(ThreadTrackerTest, procfsFallback) {
+  thread_tracker tracker(TEST_PATH, FAKE_PID, false);
+  EXPECT_EQ(-1, tracker.nl_fd);
+  ASSERT_EQ(NUMDIRS, tracker.tids.size());
+
+  std::set<pid_t> started{};
+  std::set<pid_t> exited{};
+  tracker.poll(started, exited);
+  EXPECT_TRUE(started.empty());
+  EXPECT_TRUE(exited.empty());
+
+  for (int i = 1; i < NUMDIRS; i += 2) {
+    ASSERT_TRUE(fs::remove(test_path / to_string(i)));
+  }
+  ASSERT_TRUE(fs::create_directory(test_path / to_string(NUMDIRS + 5)));
+  tracker.poll(started, exited);
+  EXPECT_EQ(std::set<pid_t>{NUMDIRS + 5}, started);
+  EXPECT_EQ(NUMDIRS / 2U, exited.size());
+  EXPECT_EQ(1U, exited.count(1));
+  EXPECT_EQ(0U, exited.count(2));
+  EXPECT_EQ(NUMDIRS / 2U + 1U, tracker.tids.size());
+}
+
+TEST_F(ThreadTrackerTest, updateCounters) {
+  thread_tracker tracker(TEST_PATH, FAKE_PID, false);
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged(tracker.tids.begin(),
+                                       tracker.tids.end());
+  insertCounters(counters, staged);
+  for (int i = 0; i < NUMDIRS; i += 2) {
+    ASSERT_TRUE(fs::remove(test_path / to_string(i)));
+  }
+  updateCounters(tracker, counters);
+  ASSERT_EQ(NUMDIRS / 2U, counters.size());
+  for (const pid_t tid : counters.tids) {
+    EXPECT_EQ(1, tid % 2);
+  }
+}
+
+// FAKE_PID has forked FAKE_PID + 1 from thread 1, which in turn has forked
+// FAKE_PID + 2.
+TEST_F(ThreadTrackerTest, processTree) {
+  const fs::path child_path = TEST_PATH + to_string(FAKE_PID + 1) + "/task";
+  const fs::path grandchild_path =
+      TEST_PATH + to_string(FAKE_PID + 2) + "/task";
+  for (const pid_t tid : {100, 101}) {
+    ASSERT_TRUE(fs::create_directories(child_path / to_string(tid)));
+  }
+  ASSERT_TRUE(fs::create_directories(grandchild_path / "200"));
+  std::ofstream(test_path / "1" / "children") << FAKE_PID + 1 << " ";
+  std::ofstream(child_path / "101" / "children") << FAKE_PID + 2 << " ";
+
+  thread_tracker tracker(TEST_PATH, std::set<pid_t>{FAKE_PID}, true, false);
+  EXPECT_EQ(NUMDIRS + 3U, tracker.tids.size());
+  EXPECT_EQ(3U, tracker.processes.size());
+  EXPECT_EQ(2U, tracker.processes[FAKE_PID + 1]);
+  EXPECT_EQ(FAKE_PID + 2, tracker.owners[200]);
+
+  // The grandchild exits.
+  fs::remove_all(TEST_PATH + to_string(FAKE_PID + 2));
+  std::set<pid_t> started{};
+  std::set<pid_t> exited{};
+  tracker.poll(started, exited);
+  EXPECT_TRUE(started.empty());
+  EXPECT_EQ(std::set<pid_t>{200}, exited);
+  EXPECT_EQ(0U, tracker.processes.count(FAKE_PID + 2));
+
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged(tracker.tids.begin(),
+                                       tracker.tids.end());
+  insertCounters(counters, staged);
+  for (size_t i = 0U; i < counters.size(); i++) {
+    counters.values[i] = {10U, 20U};
+  }
+  const auto sums = sumByProcess(counters, tracker);
+  ASSERT_EQ(2U, sums.size());
+  EXPECT_EQ(NUMDIRS * 10U, sums.at(FAKE_PID)[CYCLES]);
+  EXPECT_EQ(40U, sums.at(FAKE_PID + 1)[INSTRUCTIONS]);
+
+  // Without following children, only the given processes are observed.
+  thread_tracker roots(TEST_PATH, std::set<pid_t>{FAKE_PID, FAKE_PID + 1},
+                       false, false);
+  EXPECT_EQ(NUMDIRS + 2U, roots.tids.size());
+}
+
+} // namespace local_testing
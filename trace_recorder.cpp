@@ -0,0 +1,216 @@
+#include "trace_recorder.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <cstring>
+
+trace_recorder::trace_recorder(const std::string &path,
+                               const std::vector<struct trace_event> &events)
+    : nr_events(events.size()),
+      record_size(sizeof(struct trace_record) +
+                  (events.size() * sizeof(uint64_t))),
+      records(0U), fd(-1), header(nullptr), chunk(nullptr), chunk_index(0U),
+      chunk_records(TRACE_CHUNK_SIZE / record_size) {
+  if (events.size() > TRACE_MAX_EVENTS) {
+    std::cerr << "Too many events to record: " << events.size() << std::endl;
+    return;
+  }
+  errno = 0;
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to create " << path << ": " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  if (ftruncate(fd, TRACE_HEADER_SIZE) < 0) {
+    std::cerr << "Failed to size " << path << ": " << strerror(errno)
+              << std::endl;
+    fail();
+    return;
+  }
+  void *map = mmap(nullptr, TRACE_HEADER_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+  if (MAP_FAILED == map) {
+    std::cerr << "Failed to map " << path << ": " << strerror(errno)
+              << std::endl;
+    fail();
+    return;
+  }
+  header = static_cast<struct trace_header *>(map);
+  memset(header, 0, sizeof(struct trace_header));
+  memcpy(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header->version = TRACE_VERSION;
+  header->nr_events = nr_events;
+  header->record_size = record_size;
+  header->chunk_size = TRACE_CHUNK_SIZE;
+  for (size_t ev = 0U; ev < events.size(); ev++) {
+    header->events[ev] = events[ev];
+  }
+  if (!mapChunk(0U)) {
+    fail();
+  }
+}
+
+// The file is cut back to the end of the last record, so it holds no unused
+// space.
+trace_recorder::~trace_recorder() {
+  if (fd < 0) {
+    return;
+  }
+  commit();
+  unmapChunk();
+  munmap(header, TRACE_HEADER_SIZE);
+  const uint64_t last_chunk = records / chunk_records;
+  const off_t end = TRACE_HEADER_SIZE + (last_chunk * TRACE_CHUNK_SIZE) +
+                    ((records % chunk_records) * record_size);
+  if (ftruncate(fd, end) < 0) {
+    std::cerr << "Failed to trim trace: " << strerror(errno) << std::endl;
+  }
+  close(fd);
+}
+
+void trace_recorder::fail() {
+  unmapChunk();
+  if (nullptr != header) {
+    munmap(header, TRACE_HEADER_SIZE);
+    header = nullptr;
+  }
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool trace_recorder::mapChunk(const uint64_t index) {
+  const off_t offset = TRACE_HEADER_SIZE + (index * TRACE_CHUNK_SIZE);
+  errno = 0;
+  if (ftruncate(fd, offset + TRACE_CHUNK_SIZE) < 0) {
+    std::cerr << "Failed to grow trace: " << strerror(errno) << std::endl;
+    return false;
+  }
+  void *map = mmap(nullptr, TRACE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, offset);
+  if (MAP_FAILED == map) {
+    std::cerr << "Failed to map trace chunk: " << strerror(errno) << std::endl;
+    return false;
+  }
+  chunk = static_cast<char *>(map);
+  chunk_index = index;
+  return true;
+}
+
+void trace_recorder::unmapChunk() {
+  if (nullptr != chunk) {
+    munmap(chunk, TRACE_CHUNK_SIZE);
+    chunk = nullptr;
+  }
+}
+
+void trace_recorder::append(const uint64_t timestamp, const uint64_t elapsed,
+                            const pid_t tid, const struct group_times &times,
+                            const uint64_t *values) {
+  if (fd < 0) {
+    return;
+  }
+  const uint64_t index = records / chunk_records;
+  if (index != chunk_index) {
+    unmapChunk();
+    if (!mapChunk(index)) {
+      fail();
+      return;
+    }
+  }
+  char *dest = chunk + ((records % chunk_records) * record_size);
+  struct trace_record rec;
+  rec.timestamp = timestamp;
+  rec.elapsed = elapsed;
+  rec.tid = tid;
+  rec.reserved = 0U;
+  rec.time_enabled = times.enabled;
+  rec.time_running = times.running;
+  memcpy(dest, &rec, sizeof(struct trace_record));
+  memcpy(dest + sizeof(struct trace_record), values,
+         nr_events * sizeof(uint64_t));
+  records++;
+}
+
+// The store of the count is the last thing a reader of a live file sees, so
+// it never reads a record which is only half written.
+void trace_recorder::commit() {
+  if (nullptr != header) {
+    __atomic_store_n(&header->records, records, __ATOMIC_RELEASE);
+  }
+}
+
+trace_reader::trace_reader(const std::string &path)
+    : header(nullptr), map(MAP_FAILED), map_size(0U) {
+  errno = 0;
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "Failed to open " << path << ": " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  // The records start after the whole header page, so a shorter file cannot
+  // hold any, whatever its header claims.
+  struct stat st;
+  if ((fstat(fd, &st) < 0) ||
+      (static_cast<size_t>(st.st_size) < TRACE_HEADER_SIZE)) {
+    std::cerr << path << " is not a trace" << std::endl;
+    close(fd);
+    return;
+  }
+  map_size = st.st_size;
+  map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map) {
+    std::cerr << "Failed to map " << path << ": " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  const struct trace_header *h = static_cast<struct trace_header *>(map);
+  const bool valid =
+      (0 == memcmp(h->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC))) &&
+      (TRACE_VERSION == h->version) && (h->nr_events <= TRACE_MAX_EVENTS) &&
+      (h->record_size ==
+       sizeof(struct trace_record) + (h->nr_events * sizeof(uint64_t))) &&
+      (h->chunk_size >= h->record_size) && (0U == h->chunk_size % 4096U);
+  if (!valid) {
+    std::cerr << path << " is not a trace" << std::endl;
+    return;
+  }
+  header = h;
+  // A file which was cut short holds fewer records than its header claims.
+  const uint64_t chunk_records = header->chunk_size / header->record_size;
+  const uint64_t bytes = map_size - TRACE_HEADER_SIZE;
+  const uint64_t available =
+      ((bytes / header->chunk_size) * chunk_records) +
+      ((bytes % header->chunk_size) / header->record_size);
+  if (available < header->records) {
+    std::cerr << path << " is truncated" << std::endl;
+    header = nullptr;
+  }
+}
+
+trace_reader::~trace_reader() {
+  if (MAP_FAILED != map) {
+    munmap(map, map_size);
+  }
+}
+
+const char *trace_reader::recordAddress(const uint64_t i) const {
+  const uint64_t chunk_records = header->chunk_size / header->record_size;
+  return static_cast<const char *>(map) + TRACE_HEADER_SIZE +
+         ((i / chunk_records) * header->chunk_size) +
+         ((i % chunk_records) * header->record_size);
+}
+
+const struct trace_record &trace_reader::record(const uint64_t i) const {
+  return *reinterpret_cast<const struct trace_record *>(recordAddress(i));
+}
+
+const uint64_t *trace_reader::values(const uint64_t i) const {
+  return reinterpret_cast<const uint64_t *>(recordAddress(i) +
+                                            sizeof(struct trace_record));
+}
@@ -0,0 +1,175 @@
+#ifndef TRACE_RECORDER_HPP
+#define TRACE_RECORDER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+  The layout of a trace file:
+    One page holding a trace_header.
+    Chunks of chunk_size bytes, each holding as many whole records as fit.
+  A record is a trace_record followed by nr_events counts, so every record in
+  a file has the same size.  The header's records field counts the records
+  which were committed, so a reader ignores a partially written interval.
+*/
+constexpr char TRACE_MAGIC[8] = {'P', 'C', 'T', 'R', 'A', 'C', 'E', '\0'};
+constexpr uint32_t TRACE_VERSION = 1U;
+constexpr uint32_t TRACE_MAX_EVENTS = 16U;
+constexpr size_t TRACE_HEADER_SIZE = 4096U;
+constexpr size_t TRACE_CHUNK_SIZE = 4U << 20U;
+
+struct trace_event {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t config;
+};
+
+struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nr_events;
+  uint64_t record_size;
+  uint64_t chunk_size;
+  uint64_t records;
+  struct trace_event events[TRACE_MAX_EVENTS];
+};
+static_assert(sizeof(struct trace_header) <= TRACE_HEADER_SIZE);
+
+// One thread's counts for one interval.
+struct trace_record {
+  // CLOCK_MONOTONIC nanoseconds at the end of the interval.
+  uint64_t timestamp;
+  // The nanoseconds which the interval lasted.
+  uint64_t elapsed;
+  int32_t tid;
+  uint32_t reserved;
+  uint64_t time_enabled;
+  uint64_t time_running;
+  // Followed by nr_events uint64_t counts.
+};
+
+template <class... Events>
+std::vector<struct trace_event> traceEvents(pcounter<Events...> *) {
+  return {{static_cast<uint32_t>(Events::type), 0U, Events::config}...};
+}
+
+// The events of a counter_table, in the order of its slots.
+template <class Table> std::vector<struct trace_event> traceEvents() {
+  return traceEvents(static_cast<typename Table::counter_type *>(nullptr));
+}
+
+// Appends records to a trace file through a writable mapping of one chunk at
+// a time, so that recording an interval costs memory copies and no system
+// calls until a chunk fills up.
+struct trace_recorder {
+  trace_recorder(const std::string &path,
+                 const std::vector<struct trace_event> &events);
+  ~trace_recorder();
+  trace_recorder(const trace_recorder &) = delete;
+  trace_recorder &operator=(const trace_recorder &) = delete;
+
+  // False if the file could not be created or a chunk could not be mapped.
+  bool ok() const { return fd >= 0; }
+  void append(const uint64_t timestamp, const uint64_t elapsed,
+              const pid_t tid, const struct group_times &times,
+              const uint64_t *values);
+  // Make the records appended so far visible to readers.
+  void commit();
+
+  const uint32_t nr_events;
+  const size_t record_size;
+  // The number of records appended.
+  uint64_t records;
+
+private:
+  bool mapChunk(const uint64_t chunk);
+  void unmapChunk();
+  void fail();
+
+  int fd;
+  struct trace_header *header;
+  char *chunk;
+  // The index of the mapped chunk, and the records per chunk.
+  uint64_t chunk_index;
+  const size_t chunk_records;
+};
+
+// Append one record per entry of the table.
+template <class Table>
+void recordCounters(trace_recorder &recorder, const Table &counters,
+                    const std::chrono::nanoseconds timestamp,
+                    const std::chrono::nanoseconds elapsed) {
+  for (size_t i = 0U; i < counters.size(); i++) {
+    recorder.append(timestamp.count(), elapsed.count(), counters.tids[i],
+                    counters.times[i], counters.values[i].data());
+  }
+  recorder.commit();
+}
+
+// Maps a trace file read-only for the analyzer.
+struct trace_reader {
+  explicit trace_reader(const std::string &path);
+  ~trace_reader();
+  trace_reader(const trace_reader &) = delete;
+  trace_reader &operator=(const trace_reader &) = delete;
+
+  // False if the file is missing, truncated or not a trace.
+  bool ok() const { return nullptr != header; }
+  uint64_t size() const { return header->records; }
+  const struct trace_record &record(const uint64_t i) const;
+  const uint64_t *values(const uint64_t i) const;
+  // Whether the file holds the events of Table, in the same order.
+  template <class Table> bool matches() const;
+
+  const struct trace_header *header;
+
+private:
+  const char *recordAddress(const uint64_t i) const;
+
+  void *map;
+  size_t map_size;
+};
+
+template <class Table> bool trace_reader::matches() const {
+  const std::vector<struct trace_event> events = traceEvents<Table>();
+  if (header->nr_events != events.size()) {
+    return false;
+  }
+  for (size_t ev = 0U; ev < events.size(); ev++) {
+    if ((header->events[ev].type != events[ev].type) ||
+        (header->events[ev].config != events[ev].config)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Load the interval which starts at record first into the table, keyed by
+// tid, as readCounters() would have left it.  Returns the index of the first
+// record of the next interval.  The table must match the file.
+template <class Table>
+uint64_t replayInterval(const trace_reader &reader, const uint64_t first,
+                        Table &counters) {
+  resizeTable(counters, 0U);
+  uint64_t i = first;
+  const uint64_t timestamp = reader.record(first).timestamp;
+  for (; (i < reader.size()) && (reader.record(i).timestamp == timestamp);
+       i++) {
+    const struct trace_record &rec = reader.record(i);
+    const size_t k = counters.size();
+    resizeTable(counters, k + 1U);
+    counters.tids[k] = rec.tid;
+    counters.leader_fds[k] = -1;
+    counters.group_fds[k].fill(-1);
+    counters.times[k] = {rec.time_enabled, rec.time_running};
+    memcpy(counters.values[k].data(), reader.values(i),
+           sizeof(typename Table::values_type));
+  }
+  return i;
+}
+
+#endif // TRACE_RECORDER_HPP
@@ -0,0 +1,133 @@
+#include "trace_recorder.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+constexpr char TRACE_FILE[] = "testdata/trace";
+
+namespace local_testing {
+
+struct TraceRecorderTest : public ::testing::Test {
+  void SetUp() {
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(TEST_PATH);
+    ASSERT_TRUE(fs::create_directories(TEST_PATH));
+  }
+  void TearDown() { ASSERT_NE(-1, fs::remove_all(TEST_PATH)); }
+};
+
+TEST(TraceRecorderSimpleTest, traceEvents) {
+  const std::vector<struct trace_event> events =
+      traceEvents<default_counter_table>();
+  ASSERT_EQ(2U, events.size());
+  EXPECT_EQ(PERF_TYPE_HARDWARE, events[CYCLES].type);
+  EXPECT_EQ(PERF_COUNT_HW_CPU_CYCLES, events[CYCLES].config);
+  EXPECT_EQ(PERF_COUNT_HW_INSTRUCTIONS, events[INSTRUCTIONS].config);
+}
+
+TEST_F(TraceRecorderTest, recordAndReplay) {
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  for (const pid_t tid : {10, 20, 30}) {
+    staged.emplace_back(tid);
+    staged.back().group_fd = {-1, -1};
+  }
+  insertCounters(counters, staged);
+  {
+    trace_recorder recorder(TRACE_FILE, traceEvents<default_counter_table>());
+    ASSERT_TRUE(recorder.ok());
+    for (uint64_t interval = 1U; interval <= 3U; interval++) {
+      for (size_t i = 0U; i < counters.size(); i++) {
+        counters.values[i] = {interval * 100U + i, interval * 200U + i};
+        counters.times[i] = {1000U, 500U};
+      }
+      recordCounters(recorder, counters, std::chrono::nanoseconds(interval),
+                     std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(9U, recorder.records);
+  }
+  // The file holds the header and exactly the records.
+  EXPECT_EQ(TRACE_HEADER_SIZE + (9U * (sizeof(struct trace_record) + 16U)),
+            fs::file_size(TRACE_FILE));
+
+  trace_reader reader(TRACE_FILE);
+  ASSERT_TRUE(reader.ok());
+  EXPECT_TRUE(reader.matches<default_counter_table>());
+  EXPECT_FALSE((reader.matches<counter_table<cycles_event>>()));
+  ASSERT_EQ(9U, reader.size());
+
+  default_counter_table replayed{};
+  uint64_t next = replayInterval(reader, 0U, replayed);
+  EXPECT_EQ(3U, next);
+  next = replayInterval(reader, next, replayed);
+  EXPECT_EQ(6U, next);
+  EXPECT_EQ(counters.tids, replayed.tids);
+  EXPECT_EQ(201U, replayed.values[1][CYCLES]);
+  EXPECT_EQ(402U, replayed.values[2][INSTRUCTIONS]);
+  EXPECT_EQ(500U, replayed.times[0].running);
+  EXPECT_EQ(1000000U, reader.record(next).elapsed);
+  const auto totals = sumScaledCounters(replayed);
+  EXPECT_EQ(2U * (200U + 201U + 202U), totals.estimates[CYCLES]);
+  EXPECT_DOUBLE_EQ(0.5, totals.confidence);
+}
+
+TEST_F(TraceRecorderTest, manyChunks) {
+  const std::vector<struct trace_event> events =
+      traceEvents<default_counter_table>();
+  const size_t record_size = sizeof(struct trace_record) + 16U;
+  const uint64_t count = (2U * (TRACE_CHUNK_SIZE / record_size)) + 10U;
+  {
+    trace_recorder recorder(TRACE_FILE, events);
+    ASSERT_TRUE(recorder.ok());
+    for (uint64_t i = 0U; i < count; i++) {
+      const uint64_t values[2] = {i, 2U * i};
+      recorder.append(i, 1U, static_cast<pid_t>(i), {}, values);
+    }
+  }
+  trace_reader reader(TRACE_FILE);
+  ASSERT_TRUE(reader.ok());
+  ASSERT_EQ(count, reader.size());
+  for (const uint64_t i : {0UL, count / 2U, count - 1U}) {
+    EXPECT_EQ(i, reader.record(i).timestamp);
+    EXPECT_EQ(2U * i, reader.values(i)[INSTRUCTIONS]);
+  }
+}
+
+TEST_F(TraceRecorderTest, badFiles) {
+  std::ofstream(TRACE_FILE) << "not a trace";
+  trace_reader reader(TRACE_FILE);
+  EXPECT_FALSE(reader.ok());
+  trace_reader missing("testdata/missing");
+  EXPECT_FALSE(missing.ok());
+}
+
+// A trace cut off within its header page has a valid header but no room for
+// the records which the header counts.
+TEST_F(TraceRecorderTest, shortFile) {
+  default_counter_table counters{};
+  std::vector<default_pcounter> staged{};
+  staged.emplace_back(10);
+  staged.back().group_fd = {-1, -1};
+  insertCounters(counters, staged);
+  {
+    trace_recorder recorder(TRACE_FILE, traceEvents<default_counter_table>());
+    ASSERT_TRUE(recorder.ok());
+    recordCounters(recorder, counters, std::chrono::nanoseconds(1),
+                   std::chrono::milliseconds(1));
+  }
+  fs::resize_file(TRACE_FILE, 1024U);
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  trace_reader reader(TRACE_FILE);
+  cerr.rdbuf(old_cerr);
+  EXPECT_FALSE(reader.ok());
+  EXPECT_THAT(errors.str(), testing::HasSubstr("is not a trace"));
+}
+
+} // namespace local_testing
@@ -0,0 +1,173 @@
+#include "uring_reader.hpp"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+// IORING_OP_READ arrived in Linux 5.6, together with the probe, so a ring
+// which cannot be probed cannot read either.  Older kernels would fail every
+// read with -EINVAL.
+bool readSupported(const int ring_fd) {
+  constexpr unsigned nr_ops = 256U;
+  std::vector<char> buf(sizeof(struct io_uring_probe) +
+                        (nr_ops * sizeof(struct io_uring_probe_op)));
+  struct io_uring_probe *probe =
+      reinterpret_cast<struct io_uring_probe *>(buf.data());
+  if (syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe,
+              nr_ops) < 0) {
+    return false;
+  }
+  return (IORING_OP_READ < probe->ops_len) &&
+         (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+}
+} // namespace
+
+uring_reader::uring_reader(const unsigned entries)
+    : ring_fd(-1), buffers{}, sq_entries(0U), queued(0U), sq_ring(MAP_FAILED),
+      sq_ring_size(0U), cq_ring(MAP_FAILED), cq_ring_size(0U), sqes(nullptr),
+      sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr), cq_head(nullptr),
+      sq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr), cqes(nullptr) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(struct io_uring_params));
+  errno = 0;
+  ring_fd = syscall(SYS_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    std::cerr << "io_uring unavailable, using read(): " << strerror(errno)
+              << std::endl;
+    return;
+  }
+  sq_entries = params.sq_entries;
+  sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+  cq_ring_size = params.cq_off.cqes +
+                 (params.cq_entries * sizeof(struct io_uring_cqe));
+  // Since Linux 5.4 both rings live in one mapping.
+  const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+  if (single_mmap) {
+    sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    cq_ring_size = sq_ring_size;
+  }
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  cq_ring = single_mmap
+                ? sq_ring
+                : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+  void *sqe_map =
+      mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+           IORING_OFF_SQES);
+  if ((MAP_FAILED == sq_ring) || (MAP_FAILED == cq_ring) ||
+      (MAP_FAILED == sqe_map)) {
+    std::cerr << "Failed to map io_uring: " << strerror(errno) << std::endl;
+    if (MAP_FAILED != sqe_map) {
+      munmap(sqe_map, params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    teardown();
+    return;
+  }
+  sqes = static_cast<struct io_uring_sqe *>(sqe_map);
+  char *sq = static_cast<char *>(sq_ring);
+  char *cq = static_cast<char *>(cq_ring);
+  sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  if (!readSupported(ring_fd)) {
+    std::cerr << "io_uring cannot read, using read()" << std::endl;
+    teardown();
+  }
+}
+
+uring_reader::~uring_reader() { teardown(); }
+
+// Also called after a failure, leaving the reader unavailable.
+void uring_reader::teardown() {
+  if (nullptr != sqes) {
+    munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    sqes = nullptr;
+  }
+  if ((MAP_FAILED != cq_ring) && (cq_ring != sq_ring)) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (MAP_FAILED != sq_ring) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  cq_ring = MAP_FAILED;
+  sq_ring = MAP_FAILED;
+  if (ring_fd >= 0) {
+    close(ring_fd);
+    ring_fd = -1;
+  }
+}
+
+void uring_reader::queueRead(const int fd, void *buf, const uint32_t len,
+                             const uint64_t user_data) {
+  const unsigned tail = *sq_tail;
+  const unsigned idx = tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = len;
+  // perf ignores the offset.
+  sqe->off = 0U;
+  sqe->user_data = user_data;
+  sq_array[idx] = idx;
+  // Publish the entry to the kernel.
+  __atomic_store_n(sq_tail, tail + 1U, __ATOMIC_RELEASE);
+  queued++;
+}
+
+// The kernel's SQ head shows how many entries it has consumed, so a call which
+// is interrupted by a signal is simply repeated for the rest.
+int uring_reader::submitAndWait() {
+  const unsigned n = queued;
+  queued = 0U;
+  while (true) {
+    const unsigned pending =
+        *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    const unsigned ready =
+        __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head;
+    if ((0U == pending) && (ready >= n)) {
+      return n;
+    }
+    errno = 0;
+    if ((syscall(SYS_io_uring_enter, ring_fd, pending, n,
+                 IORING_ENTER_GETEVENTS, nullptr, 0) < 0) &&
+        (EINTR != errno)) {
+      const int err = errno;
+      std::cerr << "io_uring_enter failed, using read(): " << strerror(err)
+                << std::endl;
+      // Completions of the reads which were submitted would otherwise turn up
+      // in a later batch.
+      drain(n - (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)));
+      teardown();
+      return -err;
+    }
+  }
+}
+
+// The reads which the kernel took from the submission queue may still write
+// into their buffers, so the ring must outlive them.  Those it did not take
+// never start.  A taken read always completes, so if waiting in the kernel
+// fails too, the completion queue is polled instead.
+void uring_reader::drain(const unsigned submitted) {
+  while ((__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head) < submitted) {
+    errno = 0;
+    if ((syscall(SYS_io_uring_enter, ring_fd, 0U, submitted,
+                 IORING_ENTER_GETEVENTS, nullptr, 0) < 0) &&
+        (EINTR != errno)) {
+      sched_yield();
+    }
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef URING_READER_HPP
+#define URING_READER_HPP
+
+#include "performance_counter_lib.hpp"
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <vector>
+
+// A minimal io_uring, driven by the raw system calls, which submits many
+// read()s with one io_uring_enter() and reaps their completions in bulk.
+// Reading the group leaders of thousands of threads then takes a handful of
+// system calls per interval instead of one per thread.
+struct uring_reader {
+  explicit uring_reader(const unsigned entries = 256U);
+  ~uring_reader();
+  uring_reader(const uring_reader &) = delete;
+  uring_reader &operator=(const uring_reader &) = delete;
+
+  // False if the kernel refused to create the ring, or is too old to read
+  // through it, in which case the caller must use read() instead.
+  bool available() const { return ring_fd >= 0; }
+  // The number of reads which fit in one batch.
+  unsigned capacity() const { return sq_entries; }
+
+  // Queue a read of len bytes from fd into buf.  user_data comes back with the
+  // completion.  The caller must not queue more than capacity() reads per
+  // batch.
+  void queueRead(const int fd, void *buf, const uint32_t len,
+                 const uint64_t user_data);
+  // Submit the queued reads and wait until all of them complete.  Returns the
+  // number submitted, or -errno.
+  int submitAndWait();
+  // Call complete(user_data, res) for every completion, where res is the
+  // number of bytes read or -errno.
+  template <class Callback> void reap(Callback complete);
+
+  int ring_fd;
+  // Scratch space for the read buffers of one batch, reused across intervals.
+  std::vector<char> buffers;
+
+private:
+  void drain(const unsigned submitted);
+  void teardown();
+
+  unsigned sq_entries;
+  unsigned queued;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *sq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+template <class Callback> void uring_reader::reap(Callback complete) {
+  unsigned head = *cq_head;
+  // Pairs with the kernel's release store of the tail.
+  const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+    complete(cqe.user_data, cqe.res);
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Read all the group leaders in the table, capacity() of them per
+// io_uring_enter().  Falls back to one read() per thread if the ring is
+// unavailable or a submission fails.  There is no io_uring operation for
+// ioctl(), so enabling and disabling still go through
+// resetAndEnableCounters() and disableCounters().
+template <class Table>
+void readCountersUring(uring_reader &ring, Table &counters) {
+  if (!ring.available()) {
+    readCounters(counters);
+    return;
+  }
+  constexpr size_t readsize = Table::COUNTER_READSIZE;
+  ring.buffers.resize(ring.capacity() * readsize);
+  size_t next = 0U;
+  while (next < counters.size()) {
+    const size_t first = next;
+    unsigned batch = 0U;
+    for (; (next < counters.size()) && (batch < ring.capacity()); next++) {
+      if (counters.leader_fds[next] > STDERR_FILENO) {
+        ring.queueRead(counters.leader_fds[next],
+                       ring.buffers.data() + (batch * readsize), readsize,
+                       (static_cast<uint64_t>(batch) << 32U) | (next - first));
+        batch++;
+      } else {
+        std::cerr << "Bad file descriptor for task " << counters.tids[next]
+                  << std::endl;
+      }
+    }
+    if (ring.submitAndWait() < 0) {
+      // The ring is gone, so read this batch and the rest one at a time.
+      for (size_t i = first; i < counters.size(); i++) {
+        if ((i >= next) || (counters.leader_fds[i] > STDERR_FILENO)) {
+          readCounter(counters, i);
+        }
+      }
+      return;
+    }
+    // The upper half of user_data is the buffer slot and the lower half is the
+    // offset of the table entry from the first one in the batch.
+    ring.reap([&](const uint64_t user_data, const int res) {
+      const size_t slot = user_data >> 32U;
+      const size_t i = first + (user_data & 0xffffffffU);
+      storeCounterRead(counters, i, ring.buffers.data() + (slot * readsize),
+                       res);
+    });
+  }
+}
+
+#endif // URING_READER_HPP
@@ -0,0 +1,89 @@
+#include "uring_reader.hpp"
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include <fcntl.h>
+
+#include <sstream>
+
+using namespace std;
+
+constexpr char TEST_PATH[] = "testdata/";
+constexpr int32_t NUMFILES = 20;
+constexpr uint32_t OBSERVED_EVENTS = default_counter_table::OBSERVED_EVENTS;
+
+namespace local_testing {
+
+// Regular files stand in for the group leaders: each holds the read_format
+// which a group read would return.
+struct UringReaderTest : public ::testing::Test {
+  void SetUp() {
+    fs::current_path(fs::temp_directory_path());
+    fs::remove_all(TEST_PATH);
+    ASSERT_TRUE(fs::create_directories(TEST_PATH));
+    std::vector<default_pcounter> staged{};
+    for (int i = 0; i < NUMFILES; i++) {
+      default_pcounter pc(static_cast<pid_t>(i));
+      const std::string path = TEST_PATH + to_string(i);
+      pc.group_fd[CYCLES] = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+      ASSERT_GT(pc.group_fd[CYCLES], STDERR_FILENO);
+      pc.group_fd[INSTRUCTIONS] = -1;
+      struct read_format<OBSERVED_EVENTS> data;
+      data.nr = OBSERVED_EVENTS;
+      data.values[CYCLES] = {static_cast<uint64_t>(100 + i), 1U};
+      data.values[INSTRUCTIONS] = {static_cast<uint64_t>(200 + i), 2U};
+      pc.event_id = {1U, 2U};
+      ASSERT_EQ(sizeof(data), write(pc.group_fd[CYCLES], &data, sizeof(data)));
+      staged.push_back(pc);
+    }
+    insertCounters(counters, staged);
+  }
+  void TearDown() {
+    for (size_t i = 0U; i < counters.size(); i++) {
+      closeCounterFds(counters, i);
+    }
+    ASSERT_NE(-1, fs::remove_all(TEST_PATH));
+  }
+  void checkValues() {
+    for (size_t i = 0U; i < counters.size(); i++) {
+      EXPECT_EQ(100U + i, counters.values[i][CYCLES]);
+      EXPECT_EQ(200U + i, counters.values[i][INSTRUCTIONS]);
+    }
+  }
+  default_counter_table counters{};
+};
+
+TEST_F(UringReaderTest, batchedReads) {
+  // A ring much smaller than the table, so the reads take several batches.
+  uring_reader ring(4U);
+  if (!ring.available()) {
+    GTEST_SKIP() << "io_uring is not available";
+  }
+  EXPECT_EQ(4U, ring.capacity());
+  readCountersUring(ring, counters);
+  checkValues();
+  // The ring is reusable on the next interval.
+  for (auto &values : counters.values) {
+    values = {};
+  }
+  readCountersUring(ring, counters);
+  checkValues();
+}
+
+TEST_F(UringReaderTest, badFileDescriptor) {
+  uring_reader ring(4U);
+  std::ostringstream errors{};
+  std::streambuf *old_cerr = cerr.rdbuf(errors.rdbuf());
+  closeCounterFd(counters.leader_fds[3]);
+  counters.leader_fds[3] = STDIN_FILENO;
+  counters.group_fds[3][CYCLES] = -1;
+  readCountersUring(ring, counters);
+  cerr.rdbuf(old_cerr);
+  EXPECT_THAT(errors.str(),
+              testing::HasSubstr("Bad file descriptor for task 3"));
+  EXPECT_EQ(0U, counters.values[3][CYCLES]);
+  EXPECT_EQ(104U, counters.values[4][CYCLES]);
+}
+
+} // namespace local_testing